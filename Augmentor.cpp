@@ -1,18 +1,115 @@
 #include "Augmentor.h"
+#include "async_io.h"
+#include "file_copy.h"
+#include <algorithm>
 #include <filesystem>
+#include <fstream>
 #include <chrono>
+#include <atomic>
+#include <exception>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <numeric>
 namespace fs = std::filesystem;
 typedef std::chrono::high_resolution_clock  clocking;
 
 namespace augmentorLib {
+    namespace {
+        /// A source image decoded once and shared by the outputs of its group
+        struct shared_source {
+            std::once_flag decoded;
+            std::shared_ptr<Image> image;
+            std::atomic<size_t> remaining{0}; // outputs of the group that have not taken their copy yet
+        };
+
+        /// Copy of the shared source for one output. The last output of the group takes the decoded image itself.
+        Image take_source(shared_source& source, const std::string& path, const decode_hint& hint) {
+            std::call_once(source.decoded, [&]() {
+                source.image = std::make_shared<Image>(path, hint);
+            });
+            // remaining only drops to 1 once every other output of the group has made its copy
+            if (source.remaining.load() == 1) {
+                Image img = std::move(*source.image);
+                source.image.reset();
+                source.remaining = 0;
+                return img;
+            }
+            Image img = *source.image;
+            if (--source.remaining == 0) {
+                source.image.reset();
+            }
+            return img;
+        }
+
+        std::vector<uint8_t> read_file(const std::string& path) {
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                throw std::runtime_error("Could not open " + path);
+            }
+            return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+
+        /// An output that does not need the decoded source gives up its share of it
+        void release_source(shared_source& source) {
+            if (--source.remaining == 0) {
+                source.image.reset();
+            }
+        }
+
+        /// The composed map of warp as a lossless grid transform: a flip / quarter turn plus a crop, where a
+        /// nearest neighbour resampling picks exactly one source pixel per output pixel and leaves none black
+        bool exact_grid(const AffineWarp<Image>& warp, grid_transform& grid) {
+            if (!warp.covered()) {
+                return false;
+            }
+            // rotations use an approximate PI, so the matrix entries are only close to 0 and 1
+            const double epsilon = 1e-3;
+            auto zero = [&](double v) { return std::abs(v) < epsilon; };
+            auto unit = [&](double v, int& sign) {
+                sign = v > 0 ? 1 : -1;
+                return std::abs(std::abs(v) - 1) < epsilon;
+            };
+            auto map = warp.source_map();
+            if (zero(map.xy) && zero(map.yx) && unit(map.xx, grid.x_sign) && unit(map.yy, grid.y_sign)) {
+                grid.transpose = false;
+            } else if (zero(map.xx) && zero(map.yy) && unit(map.xy, grid.x_sign) && unit(map.yx, grid.y_sign)) {
+                grid.transpose = true;
+            } else {
+                return false;
+            }
+            grid.x_offset = std::lround(map.x0);
+            grid.y_offset = std::lround(map.y0);
+            grid.width = warp.output_size().width;
+            grid.height = warp.output_size().height;
+
+            // the rounding error is affine in (x, y), so the corners are the worst case
+            double right = (double) grid.width - 1;
+            double bottom = (double) grid.height - 1;
+            for (auto x : {0.0, right}) {
+                for (auto y : {0.0, bottom}) {
+                    double u = grid.transpose ? y : x;
+                    double v = grid.transpose ? x : y;
+                    if (std::floor(map.x(x, y) + 0.5) != grid.x_sign * u + grid.x_offset ||
+                        std::floor(map.y(x, y) + 0.5) != grid.y_sign * v + grid.y_offset) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+    }
+
     Augmentor::Augmentor(const std::string& in_path, const std::string& out_path) {
         //this->img = Image(filename);
         this->dir_path = in_path;
         this->out_path = out_path;
+        this->seed(0);
         Augmentor::pipeline();
     }
 
    void Augmentor::save(const std::string& fileName, Image* image, int quality) {
+        prepare_output(fileName);
         image->save(fileName, quality);
     }
 
@@ -85,46 +182,717 @@ namespace augmentorLib {
         return *this;;
     }
 
+    Augmentor &Augmentor::rotate(int min_degree, int max_degree, rotate_canvas canvas, double prob) {
+        auto operation = std::make_unique<RotateOperation<Image>>(
+                rotate_range{min_degree, max_degree}, canvas, prob
+        );
+        operations.push_back(std::move(operation));
+        return *this;
+    }
+
     Augmentor& Augmentor::invert(double prob) {
         auto operation = std::make_unique<InvertOperation<Image>>(prob);
         operations.push_back(std::move(operation));
         return *this;
     }
 
-    void Augmentor::sample(size_t size) {
-        clocking::time_point beginning =  clocking::now();
-        clocking::duration d =  clocking::now()-beginning;
+    Augmentor& Augmentor::brightness(double min_factor, double max_factor, double prob) {
+        auto operation = std::make_unique<BrightnessOperation<Image>>(min_factor, max_factor, prob);
+        operations.push_back(std::move(operation));
+        return *this;
+    }
+
+    Augmentor& Augmentor::contrast(double min_factor, double max_factor, double prob) {
+        auto operation = std::make_unique<ContrastOperation<Image>>(min_factor, max_factor, prob);
+        operations.push_back(std::move(operation));
+        return *this;
+    }
+
+    Augmentor& Augmentor::gamma(double min_gamma, double max_gamma, double prob) {
+        auto operation = std::make_unique<GammaOperation<Image>>(min_gamma, max_gamma, prob);
+        operations.push_back(std::move(operation));
+        return *this;
+    }
+
+    Augmentor& Augmentor::solarize(uint8_t threshold, double prob) {
+        auto operation = std::make_unique<SolarizeOperation<Image>>(threshold, prob);
+        operations.push_back(std::move(operation));
+        return *this;
+    }
+
+    Augmentor& Augmentor::posterize(unsigned bits, double prob) {
+        auto operation = std::make_unique<PosterizeOperation<Image>>(bits, prob);
+        operations.push_back(std::move(operation));
+        return *this;
+    }
+
+    Augmentor::operation_chain Augmentor::clone_operations() const {
+        operation_chain chain;
+        chain.reserve(operations.size());
+        for (auto& operation : operations) {
+            chain.push_back(operation->clone());
+        }
+        return chain;
+    }
+
+    Augmentor& Augmentor::seed(uint64_t seed) {
+        if (seed == 0) {
+            seed = std::chrono::system_clock::now().time_since_epoch().count();
+        }
+        global_seed = seed;
+        return *this;
+    }
+
+    Augmentor& Augmentor::fan_out(bool enabled) {
+        fan_out_enabled = enabled;
+        return *this;
+    }
 
-        std::uniform_int_distribution<int> distribution(0, image_paths.size() - 1);
-        auto seed = (unsigned)d.count();
-        std::default_random_engine generator(seed);
+    Augmentor& Augmentor::lossless(bool enabled) {
+        lossless_enabled = enabled;
+        return *this;
+    }
 
-        for(size_t i=0;i<size;i++) {
-            //auto image = &img;
-            int j = distribution(generator);
-            this->output_array.push_back(image_paths[j]);
+    Augmentor& Augmentor::passthrough(bool enabled, bool hard_link) {
+        passthrough_enabled = enabled;
+        hard_link_enabled = hard_link;
+        return *this;
+    }
+
+    Augmentor& Augmentor::output(std::shared_ptr<output_sink> sink) {
+        this->sink = std::move(sink);
+        return *this;
+    }
+
+    Augmentor& Augmentor::fuse_geometry(bool enabled) {
+        fuse_enabled = enabled;
+        return *this;
+    }
+
+    augmentation_plan Augmentor::plan(size_t size) {
+        if (operations.size() > MAX_OPERATIONS) {
+            throw std::length_error("A planned operation chain can have at most 64 operations");
+        }
+        if (size > 0 && image_paths.empty()) {
+            throw std::runtime_error("No .jpg images found in " + dir_path);
         }
 
-        //std::cout<<"output size= "<<output_array.size()<<std::endl;
-//        for (unsigned long i = 0; i < output_array.size(); i++) {
-//            //std::cout<<"output[" << i << "]=" << output_array[i] << std::endl;
-//        }
+        augmentation_plan plan;
+        plan.seed = global_seed;
+        plan.sources = image_paths;
+        for (auto& operation : operations) {
+            plan.parameter_offset.push_back(plan.parameters_per_sample);
+            plan.parameters_per_sample += operation->parameter_count();
+        }
+        plan.output.reserve(size);
+        plan.source.reserve(size);
+        plan.enabled.reserve(size);
+        plan.parameters.assign(size * plan.parameters_per_sample, 0);
+
+        // the source of output i comes from its own stream, after the streams of the operations
+        auto source_stream = (uint32_t) -1;
+        for (size_t i = 0; i < size; ++i) {
+            CounterGenerator generator(global_seed, i, source_stream);
+            plan.output.push_back(i);
+            plan.source.push_back(generator.uniform_index(image_paths.size()));
+
+            uint64_t enabled = 0;
+            auto row = plan.parameters.data() + i * plan.parameters_per_sample;
+            for (size_t k = 0; k < operations.size(); ++k) {
+                operations[k]->bind(global_seed, i, k);
+                if (operations[k]->plan(row + plan.parameter_offset[k])) {
+                    enabled |= uint64_t{1} << k;
+                }
+            }
+            plan.enabled.push_back(enabled);
+        }
+        return plan;
+    }
 
-        int j=0;
-        for(const std::string& item:output_array) {
-            Image img = Image(item);//creating a temp img object
-            auto image = &img;
-            clocking::time_point start = clocking::now();
-            for (auto &operation : operations) {
-                image = operation->perform(image);
+    void Augmentor::check_plan(const augmentation_plan& plan) const {
+        if (plan.operation_count() != operations.size()) {
+            throw std::invalid_argument("The plan was built for a different operation chain");
+        }
+        size_t offset = 0;
+        for (size_t k = 0; k < operations.size(); ++k) {
+            if (plan.parameter_offset[k] != offset) {
+                throw std::invalid_argument("The plan was built for a different operation chain");
+            }
+            offset += operations[k]->parameter_count();
+        }
+    }
+
+    std::vector<std::vector<size_t>> Augmentor::source_groups(const augmentation_plan& plan) const {
+        std::vector<std::vector<size_t>> groups;
+        if (fan_out_enabled) {
+            std::vector<size_t> group_of(plan.sources.size(), plan.size());
+            for (size_t i = 0; i < plan.size(); ++i) {
+                auto& group = group_of[plan.source[i]];
+                if (group == plan.size()) {
+                    group = groups.size();
+                    groups.emplace_back();
+                }
+                groups[group].push_back(i);
+            }
+        } else {
+            groups.reserve(plan.size());
+            for (size_t i = 0; i < plan.size(); ++i) {
+                groups.push_back({i});
+            }
+        }
+
+        // longest job first: the cost of an output grows with its encoded source size and the operations that fire
+        std::vector<double> source_bytes(plan.sources.size(), 1);
+        for (size_t s = 0; s < plan.sources.size(); ++s) {
+            std::error_code error;
+            auto bytes = fs::file_size(plan.sources[s], error);
+            if (!error) {
+                source_bytes[s] = bytes;
+            }
+        }
+        std::vector<double> cost(groups.size(), 0);
+        for (size_t g = 0; g < groups.size(); ++g) {
+            for (auto i : groups[g]) {
+                double work = 1;
+                for (size_t k = 0; k < operations.size(); ++k) {
+                    if (plan.fires(i, k)) {
+                        work += operations[k]->cost();
+                    }
+                }
+                cost[g] += work * source_bytes[plan.source[i]];
+            }
+        }
+        std::vector<size_t> order(groups.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return cost[a] > cost[b]; });
+
+        std::vector<std::vector<size_t>> sorted;
+        sorted.reserve(groups.size());
+        for (auto g : order) {
+            sorted.push_back(std::move(groups[g]));
+        }
+        return sorted;
+    }
+
+    decode_hint Augmentor::source_hint(const augmentation_plan& plan, const std::vector<size_t>& group,
+                                       bool decode_all) const {
+        // every output of the group must start with the same kind of operation: the union of what they need
+        // is decoded, either the largest fixed output size or the largest centered window (smaller centered
+        // windows lie inside it, at the same offsets)
+        decode_hint hint;
+        for (auto i : group) {
+            size_t k = 0;
+            while (k < operations.size() && !plan.fires(i, k)) {
+                ++k;
+            }
+            if (k == operations.size()) {
+                if (passthrough_enabled && !pixel_output() && !decode_all) {
+                    continue; // copied, never decoded
+                }
+                return decode_hint();
+            }
+            auto parameters = plan.parameters_of(i, k);
+            image_size size{0, 0};
+            if (hint.crop_width == 0 && operations[k]->fixed_output(parameters, size)) {
+                hint.min_width = std::max(hint.min_width, size.width);
+                hint.min_height = std::max(hint.min_height, size.height);
+            } else if (hint.min_width == 0 && operations[k]->centered_window(parameters, size)) {
+                hint.crop_width = std::max(hint.crop_width, size.width);
+                hint.crop_height = std::max(hint.crop_height, size.height);
+            } else {
+                return decode_hint();
+            }
+        }
+        return hint;
+    }
+
+    bool Augmentor::transcode(const augmentation_plan& plan, size_t i) const {
+        if (!lossless_enabled || pixel_output()) {
+            return false;
+        }
+        // checked before the source is opened
+        if (!geometric_only(plan, i)) {
+            return false;
+        }
+
+        auto choose = [&](size_t width, size_t height, grid_transform& grid) {
+            AffineWarp<Image> warp;
+            warp.reset({height, width});
+            for (size_t k = 0; k < operations.size(); ++k) {
+                auto size = warp.output_size();
+                affine_transform inverse;
+                if (!plan.fires(i, k)) {
+                    continue;
+                }
+                if (!operations[k]->affine(size, plan.parameters_of(i, k), inverse)) {
+                    return false;
+                }
+                warp.push(inverse, size);
+            }
+            return exact_grid(warp, grid);
+        };
+        if (sink) {
+            std::vector<uint8_t> bytes;
+            if (!Image::transcode(plan.sources[plan.source[i]], bytes, choose)) {
+                return false;
             }
-            clocking::time_point end = clocking::now();
-            clocking::duration dur = end - start;
-            int timetaken = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
+            sink->write(plan.output[i], bytes.data(), bytes.size());
+            return true;
+        }
+        auto destination = output_name(plan.output[i]);
+        prepare_output(destination);
+        return Image::transcode(plan.sources[plan.source[i]], destination, choose);
+    }
+
+    bool Augmentor::copy_source(const augmentation_plan& plan, size_t i) const {
+        if (!passthrough_enabled || pixel_output()) {
+            return false;
+        }
+        for (size_t k = 0; k < operations.size(); ++k) {
+            if (plan.fires(i, k)) {
+                return false;
+            }
+        }
+        if (sink) {
+            auto bytes = read_file(plan.sources[plan.source[i]]);
+            sink->write(plan.output[i], bytes.data(), bytes.size());
+            return true;
+        }
+        copy_file(plan.sources[plan.source[i]], output_name(plan.output[i]), hard_link_enabled);
+        return true;
+    }
+
+    bool Augmentor::geometric_only(const augmentation_plan& plan, size_t i) const {
+        for (size_t k = 0; k < operations.size(); ++k) {
+            image_size size{1024, 1024};
+            affine_transform inverse;
+            if (plan.fires(i, k) && !operations[k]->affine(size, plan.parameters_of(i, k), inverse)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Augmentor::may_write_direct(const augmentation_plan& plan, size_t i) const {
+        if (pixel_output()) {
+            return false;
+        }
+        if (lossless_enabled) {
+            return geometric_only(plan, i);
+        }
+        if (!passthrough_enabled) {
+            return false;
+        }
+        for (size_t k = 0; k < operations.size(); ++k) {
+            if (plan.fires(i, k)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Augmentor::write_direct(const augmentation_plan& plan, size_t i) const {
+        return copy_source(plan, i) || transcode(plan, i);
+    }
+
+    std::string Augmentor::output_name(size_t index) const {
+        return this->out_path +  "output_" + std::to_string(index) + ".jpg";
+    }
+
+    Image* Augmentor::transform(Image* image, operation_chain& chain, const augmentation_plan& plan, size_t i) const {
+        static std::mutex log_mutex;
+
+        clocking::time_point start = clocking::now();
+
+        // consecutive geometric operations that fire are collected into warp and resampled in one pass, and
+        // consecutive pointwise operations into table and mapped in one pass, as soon as an operation of
+        // another kind (or the end of the chain) is reached. Pointwise tables compose exactly, so they are
+        // always fused.
+        AffineWarp<Image> warp;
+        size_t first = 0;
+        lookup_table table;
+        size_t pointwise = 0;
+        auto flush_warp = [&]() {
+            if (warp.size() == 1) {
+                image = chain[first]->apply(image, plan.parameters_of(i, first));
+            } else {
+                image = warp.apply(image);
+            }
+            warp.reset({image->getHeight(), image->getWidth()});
+        };
+        auto flush_pointwise = [&]() {
+            if (pointwise > 0) {
+                PointwiseOperation<Image>::map(table, image);
+                table.reset();
+                pointwise = 0;
+            }
+        };
+
+        warp.reset({image->getHeight(), image->getWidth()});
+        for (size_t k = 0; k < chain.size(); ++k) {
+            if (!plan.fires(i, k)) {
+                continue;
+            }
+            chain[k]->bind(plan.seed, plan.output[i], k);
+            auto parameters = plan.parameters_of(i, k);
+
+            auto size = warp.output_size();
+            affine_transform inverse;
+            if (fuse_enabled && chain[k]->affine(size, parameters, inverse)) {
+                flush_pointwise();
+                if (warp.size() == 0) {
+                    first = k;
+                }
+                warp.push(inverse, size);
+                continue;
+            }
+            if (chain[k]->pointwise(table, parameters)) {
+                flush_warp();
+                ++pointwise;
+                continue;
+            }
+            flush_warp();
+            flush_pointwise();
+            image = chain[k]->apply(image, parameters);
+            warp.reset({image->getHeight(), image->getWidth()});
+        }
+        flush_warp();
+        flush_pointwise();
+        clocking::time_point end = clocking::now();
+        clocking::duration dur = end - start;
+        int timetaken = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
+        {
+            std::lock_guard<std::mutex> lock(log_mutex);
             std::cout << "Time taken in mseconds is = " << timetaken << std::endl;
-            //std::cout<<this->out_path + "output_" + std::to_string(j) + ".jpg"<<"\n";
-            this->save(this->out_path +  "output_" + std::to_string(j) + ".jpg", image);
-            j++;
+        }
+        return image;
+    }
+
+    void Augmentor::produce(const augmentation_plan& plan, size_t i, operation_chain& chain, Image& img) const {
+        auto image = transform(&img, chain, plan, i);
+        //std::cout<<this->out_path + "output_" + std::to_string(j) + ".jpg"<<"\n";
+        store(plan, i, image);
+    }
+
+    void Augmentor::store(const augmentation_plan& plan, size_t i, const Image* image) const {
+        if (pixel_output()) {
+            sink->write_pixels(plan.output[i], image->data(), image->getWidth(), image->getHeight(),
+                               image->getPixelSize(), image->stride());
+            return;
+        }
+        if (sink) {
+            std::vector<uint8_t> bytes;
+            image->encode(bytes);
+            sink->write(plan.output[i], bytes.data(), bytes.size());
+            return;
+        }
+        prepare_output(output_name(plan.output[i]));
+        image->save(output_name(plan.output[i]));
+    }
+
+    void Augmentor::sample(size_t size, size_t threads) {
+        execute(plan(size), threads);
+    }
+
+    void Augmentor::sample(size_t size, const pipeline_config& config) {
+        execute(plan(size), config);
+    }
+
+    void Augmentor::execute(const augmentation_plan& plan, size_t threads) {
+        check_plan(plan);
+
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        threads = std::min(threads, plan.size());
+
+        // outputs are handed out in group order, so the outputs of a source are processed close together and
+        // its decoded image is dropped as soon as the last of them took its copy
+        auto groups = source_groups(plan);
+        std::unique_ptr<shared_source[]> sources(new shared_source[groups.size()]);
+        std::vector<decode_hint> hints(groups.size());
+        std::vector<std::pair<size_t, size_t>> order; // (group, plan position)
+        order.reserve(plan.size());
+        for (size_t g = 0; g < groups.size(); ++g) {
+            sources[g].remaining = groups[g].size();
+            hints[g] = source_hint(plan, groups[g], false);
+            for (auto i : groups[g]) {
+                order.emplace_back(g, i);
+            }
+        }
+
+        std::atomic<size_t> next{0};
+        auto run = [&](operation_chain& chain) {
+            for (size_t k = next++; k < order.size(); k = next++) {
+                auto i = order[k].second;
+                auto g = order[k].first;
+                if (write_direct(plan, i)) {
+                    release_source(sources[g]);
+                    continue;
+                }
+                Image img = take_source(sources[g], plan.sources[plan.source[i]], hints[g]);
+                produce(plan, i, chain, img);
+            }
+        };
+
+        if (threads <= 1) {
+            run(operations);
+            if (sink) {
+                sink->flush();
+            }
+            return;
+        }
+
+        // worker pool: every worker pulls the next output until all are done
+        std::exception_ptr failure;
+        std::mutex failure_mutex;
+        std::vector<std::thread> workers;
+        workers.reserve(threads);
+
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&]() {
+                try {
+                    auto chain = clone_operations();
+                    run(chain);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(failure_mutex);
+                    if (!failure) {
+                        failure = std::current_exception();
+                    }
+                    next = order.size();
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        if (sink) {
+            sink->flush();
+        }
+        if (failure) {
+            std::rethrow_exception(failure);
+        }
+    }
+
+    void Augmentor::execute(const augmentation_plan& plan, const pipeline_config& config) {
+        run_pipeline(plan, config, nullptr, stats);
+    }
+
+    image_stream Augmentor::stream(size_t size, const pipeline_config& config, size_t prefetch) {
+        return stream(plan(size), config, prefetch);
+    }
+
+    image_stream Augmentor::stream(augmentation_plan plan, const pipeline_config& config, size_t prefetch) {
+        check_plan(plan);
+        size_t size = plan.size();
+        auto run = [this, plan = std::move(plan), config](BoundedQueue<pipeline_item>& results) {
+            pipeline_stats stream_stats;
+            run_pipeline(plan, config, &results, stream_stats);
+            return stream_stats;
+        };
+        return image_stream(std::move(run), size, prefetch);
+    }
+
+    void Augmentor::run_pipeline(const augmentation_plan& plan, const pipeline_config& config,
+                                 BoundedQueue<pipeline_item>* results, pipeline_stats& stats) const {
+        typedef std::chrono::steady_clock stage_clock;
+
+        check_plan(plan);
+        auto groups = source_groups(plan);
+        clocking::time_point beginning = clocking::now();
+
+        size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+        size_t decoders = std::max<size_t>(config.decoders, 1);
+        size_t transformers = config.transformers ? config.transformers : hardware;
+        // a stream has no encode stage: its consumer takes the transformed images, every one of them
+        bool streaming = results != nullptr;
+        size_t encoders = streaming ? 0 : std::max<size_t>(config.encoders, 1);
+        size_t depth = std::max<size_t>(config.queue_depth, 1);
+
+        BoundedQueue<pipeline_item> decoded(depth);
+        BoundedQueue<pipeline_item> transformed(depth);
+        auto& finished = streaming ? *results : transformed;
+
+        // background I/O: sources are read up to io_depth groups ahead of the decoders, outputs are handed to
+        // the writer and only waited for once io_depth of them are pending per encoder
+        std::unique_ptr<async_file_io> io;
+        if (config.io_depth > 0) {
+            io = async_file_io::create(config.io_depth, config.io_uring);
+        }
+        std::vector<std::future<std::vector<uint8_t>>> reads(groups.size());
+        std::mutex read_mutex;
+        size_t issued = 0;
+        auto read_ahead = [&](size_t g) {
+            std::lock_guard<std::mutex> lock(read_mutex);
+            for (; issued < groups.size() && issued < g + config.io_depth; ++issued) {
+                auto& group = groups[issued];
+                bool decode = streaming || std::any_of(group.begin(), group.end(),
+                                                       [&](size_t i) { return !may_write_direct(plan, i); });
+                if (decode) {
+                    reads[issued] = io->read(plan.sources[plan.source[group.front()]]);
+                }
+            }
+        };
+
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> decoders_left{decoders};
+        std::atomic<size_t> transformers_left{transformers};
+        std::atomic<size_t> items[3] = {{0}, {0}, {0}};
+        std::atomic<long long> busy_ns[3] = {{0}, {0}, {0}};
+
+        std::exception_ptr failure;
+        std::mutex failure_mutex;
+        auto fail = [&]() {
+            std::lock_guard<std::mutex> lock(failure_mutex);
+            if (!failure) {
+                failure = std::current_exception();
+            }
+            next = groups.size();
+            decoded.close();
+            finished.close();
+        };
+        auto busy_since = [](stage_clock::time_point start) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(stage_clock::now() - start).count();
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(decoders + transformers + encoders);
+
+        // decoders take whole source groups: one decode, one pushed copy per output of the group
+        for (size_t t = 0; t < decoders; ++t) {
+            workers.emplace_back([&]() {
+                try {
+                    for (size_t g = next++; g < groups.size(); g = next++) {
+                        auto start = stage_clock::now();
+                        if (io) {
+                            read_ahead(g);
+                        }
+                        // copied and lossless outputs are written right here, the source is decoded for the
+                        // others only
+                        std::vector<size_t> outputs;
+                        for (auto i : groups[g]) {
+                            if (streaming || !write_direct(plan, i)) {
+                                outputs.push_back(i);
+                            }
+                        }
+                        if (outputs.empty()) {
+                            busy_ns[0] += busy_since(start);
+                            continue;
+                        }
+                        std::unique_ptr<Image> source;
+                        if (reads[g].valid()) {
+                            auto bytes = reads[g].get();
+                            source = std::make_unique<Image>(bytes.data(), bytes.size(),
+                                                             source_hint(plan, outputs, streaming));
+                        } else {
+                            source = std::make_unique<Image>(plan.sources[plan.source[outputs.front()]],
+                                                             source_hint(plan, outputs, streaming));
+                        }
+                        busy_ns[0] += busy_since(start);
+                        ++items[0];
+
+                        bool open = true;
+                        for (size_t k = 0; open && k < outputs.size(); ++k) {
+                            bool last = k + 1 == outputs.size();
+                            pipeline_item item{outputs[k], last ? std::move(source) : std::make_unique<Image>(*source)};
+                            open = decoded.push(std::move(item));
+                        }
+                        if (!open) {
+                            break;
+                        }
+                    }
+                } catch (...) {
+                    fail();
+                }
+                if (--decoders_left == 0) {
+                    decoded.close();
+                }
+            });
+        }
+
+        for (size_t t = 0; t < transformers; ++t) {
+            workers.emplace_back([&]() {
+                try {
+                    auto chain = clone_operations();
+                    pipeline_item item;
+                    while (decoded.pop(item)) {
+                        auto start = stage_clock::now();
+                        auto image = transform(item.image.get(), chain, plan, item.index);
+                        if (image != item.image.get()) {
+                            item.image = std::make_unique<Image>(*image);
+                        }
+                        busy_ns[1] += busy_since(start);
+                        ++items[1];
+                        if (streaming) {
+                            item.index = plan.output[item.index];
+                        }
+                        if (!finished.push(std::move(item))) {
+                            // the stream was dropped: stop the decoders too
+                            decoded.close();
+                            break;
+                        }
+                    }
+                } catch (...) {
+                    fail();
+                }
+                if (--transformers_left == 0) {
+                    finished.close();
+                }
+            });
+        }
+
+        for (size_t t = 0; t < encoders; ++t) {
+            workers.emplace_back([&]() {
+                try {
+                    pipeline_item item;
+                    std::deque<std::future<void>> writes;
+                    while (transformed.pop(item)) {
+                        auto start = stage_clock::now();
+                        if (io && !sink) {
+                            std::vector<uint8_t> bytes;
+                            item.image->encode(bytes);
+                            writes.push_back(io->write(output_name(plan.output[item.index]), std::move(bytes)));
+                        } else {
+                            store(plan, item.index, item.image.get());
+                        }
+                        item.image.reset();
+                        busy_ns[2] += busy_since(start);
+                        ++items[2];
+                        if (writes.size() > config.io_depth) {
+                            writes.front().get();
+                            writes.pop_front();
+                        }
+                    }
+                    for (auto& write : writes) {
+                        write.get();
+                    }
+                } catch (...) {
+                    fail();
+                }
+            });
+        }
+
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        auto decoded_stats = decoded.statistics();
+        auto transformed_stats = finished.statistics();
+        stats = pipeline_stats{};
+        stats.decode = stage_stats{decoders, items[0], busy_ns[0] / 1e6, 0, decoded_stats.push_stall_ms};
+        stats.transform = stage_stats{transformers, items[1], busy_ns[1] / 1e6,
+                                      decoded_stats.pop_stall_ms, transformed_stats.push_stall_ms};
+        stats.encode = stage_stats{encoders, items[2], busy_ns[2] / 1e6, transformed_stats.pop_stall_ms, 0};
+        stats.io_backend = io ? io->backend() : "";
+        stats.decoded_queue = decoded_stats;
+        stats.transformed_queue = transformed_stats;
+        if (sink && !streaming) {
+            sink->flush();
+        }
+        stats.wall_ms = std::chrono::duration_cast<std::chrono::microseconds>(clocking::now() - beginning).count() / 1e3;
+
+        if (failure) {
+            std::rethrow_exception(failure);
         }
     }
 
@@ -141,6 +909,11 @@ namespace augmentorLib {
         return *this;
     }
 
+    Augmentor& Augmentor::gaussian_blur(double sigma, double prob) {
+        operations.push_back(make_gaussian_blur<Image>(sigma, prob));
+        return *this;
+    }
+
     Augmentor &Augmentor::random_erase(image_size lower_mask_size, image_size upper_mask_size, double prob) {
         auto operation = std::make_unique<RandomEraseOperation<Image>>(lower_mask_size, upper_mask_size, prob);
         operations.push_back(std::move(operation));
@@ -3,6 +3,10 @@
 
 #include "jpeg.h"
 #include "Operation.h"
+#include "Pipeline.h"
+#include "Plan.h"
+#include "Stream.h"
+#include "output_sink.h"
 #include <iostream>
 #include <string>
 #include <stdexcept>
@@ -16,14 +20,93 @@ namespace augmentorLib {
     ///
     /// This is the main class of the library, an instance of which the user would create for sampling images
     class Augmentor {
+        typedef std::vector<std::unique_ptr< Operation<Image> >> operation_chain;
+
         //dir dir_path
         std::string dir_path;
         std::string out_path;
         // Provided by the jpeg.h file. Representation of an decompressed image file.
         std::vector<std::string> image_paths;
-        std::vector<std::string> output_array;
         // unique points for base classes
-        std::vector<std::unique_ptr< Operation<Image> >> operations;
+        operation_chain operations;
+
+        /// Copy of the operation chain for one worker thread
+        operation_chain clone_operations() const;
+
+        /// Global seed: the source and every random choice of output N only depend on (seed, N)
+        uint64_t global_seed = 0;
+
+        /// Statistics of the last pipelined sample call
+        pipeline_stats stats;
+
+        /// Decode every source once and derive all of its outputs from that copy
+        bool fan_out_enabled = false;
+
+        /// Resample runs of consecutive geometric operations once instead of once per operation
+        bool fuse_enabled = true;
+
+        /// Write outputs that only flip, turn and crop their source straight from its DCT coefficients
+        bool lossless_enabled = true;
+
+        /// Copy the source file as the output when no operation fires on it, optionally as a hard link
+        bool passthrough_enabled = true;
+        bool hard_link_enabled = false;
+
+        /// Receives the encoded outputs instead of output_N.jpg files, when set
+        std::shared_ptr<output_sink> sink;
+
+        /// The sink stores decoded pixels: every output is decoded and transformed, none is encoded
+        bool pixel_output() const { return sink && sink->takes_pixels(); }
+
+        /// Throws if plan was not built for the current operation chain
+        void check_plan(const augmentation_plan& plan) const;
+
+        /// Positions of the plan grouped by source, most expensive group first. Without fan out every output is
+        /// its own group
+        std::vector<std::vector<size_t>> source_groups(const augmentation_plan& plan) const;
+
+        /// How much of the source shared by the outputs of group must be decoded: when every one of them starts
+        /// with an operation of fixed output size (resize) the decoder downscales, when every one starts with a
+        /// centered crop it decodes only the window. Outputs on which nothing fires are copied and left out,
+        /// unless decode_all is set.
+        decode_hint source_hint(const augmentation_plan& plan, const std::vector<size_t>& group, bool decode_all) const;
+
+        /// Writes the output of plan position i straight from the DCT coefficients of its source, when every
+        /// operation that fires together only flips, turns by quarter turns and crops on iMCU boundaries
+        /// \return false if the output needs the pixel path
+        bool transcode(const augmentation_plan& plan, size_t i) const;
+
+        /// Writes the output of plan position i as a copy of its source file when no operation fires on it
+        /// \return false if some operation fires
+        bool copy_source(const augmentation_plan& plan, size_t i) const;
+
+        /// Every operation that fires on plan position i is geometric, or none fires
+        bool geometric_only(const augmentation_plan& plan, size_t i) const;
+
+        /// write_direct may take plan position i without decoding its source, judged from the plan alone
+        bool may_write_direct(const augmentation_plan& plan, size_t i) const;
+
+        /// Writes the output of plan position i without decoding its source, by copy_source or transcode
+        /// \return false if the output needs the decoded source
+        bool write_direct(const augmentation_plan& plan, size_t i) const;
+
+        /// Path of the index-th output image
+        std::string output_name(size_t index) const;
+
+        /// Run the operations of plan position i that fire through chain and log the time taken
+        Image* transform(Image* image, operation_chain& chain, const augmentation_plan& plan, size_t i) const;
+
+        /// Transform an already decoded copy of the source of plan position i and save it
+        void produce(const augmentation_plan& plan, size_t i, operation_chain& chain, Image& img) const;
+
+        /// Encodes image as the output of plan position i, into the sink or its output_N.jpg file
+        void store(const augmentation_plan& plan, size_t i, const Image* image) const;
+
+        /// Runs plan through the staged pipeline and fills in stats. With results, every transformed image is
+        /// pushed there instead of being encoded (nothing is copied or transcoded) and results is closed at
+        /// the end; a closed results queue stops the pipeline early.
+        void run_pipeline(const augmentation_plan& plan, const pipeline_config& config,
+                          BoundedQueue<pipeline_item>* results, pipeline_stats& stats) const;
     public:
         /// Default Constructor.
         Augmentor() = default;
@@ -101,18 +184,66 @@ namespace augmentorLib {
         /// Rotate the image
         ///
         /// Rotate based on current width and height based on a angle selected in random from the range specified
-        /// @param min_factor - minimum zoom factor of range
-        /// @param max_factor - maximum zoom factor of range
-        /// @param prob - probability of performing the resize operation
+        /// @param min_degree - minimum angle of range, in degrees
+        /// @param max_degree - maximum angle of range, in degrees
+        /// @param prob - probability of performing the rotate operation
         /// @returns A reference to the Augmentor object
         Augmentor& rotate(int min_degree, int max_degree, double prob=1);
 
+        /// Rotate the image onto a canvas of another size
+        ///
+        /// @param min_degree - minimum angle of range, in degrees
+        /// @param max_degree - maximum angle of range, in degrees
+        /// @param canvas - expand to the whole rotated image, crop to the largest rectangle inside it, or keep the size
+        /// @param prob - probability of performing the rotate operation
+        /// @returns A reference to the Augmentor object
+        Augmentor& rotate(int min_degree, int max_degree, rotate_canvas canvas, double prob=1);
+
         /// Invert the image
         /// Inverts the colors in the image
         /// \param prob probability of performing the resize operation
         /// \return A reference to the Augmentor object
         Augmentor& invert(double prob=1);
 
+        /// Brightness
+        /// Multiplies every color value by a factor selected in random from the range specified
+        /// \param min_factor minimum factor of range
+        /// \param max_factor maximum factor of range
+        /// \param prob probability of performing the brightness operation
+        /// \return A reference to the Augmentor object
+        Augmentor& brightness(double min_factor, double max_factor, double prob=1);
+
+        /// Contrast
+        /// Scales the distance of every color value to mid grey by a factor selected in random from the range
+        /// specified
+        /// \param min_factor minimum factor of range
+        /// \param max_factor maximum factor of range
+        /// \param prob probability of performing the contrast operation
+        /// \return A reference to the Augmentor object
+        Augmentor& contrast(double min_factor, double max_factor, double prob=1);
+
+        /// Gamma
+        /// Gamma corrects the image with a gamma selected in random from the range specified
+        /// \param min_gamma minimum gamma of range
+        /// \param max_gamma maximum gamma of range
+        /// \param prob probability of performing the gamma operation
+        /// \return A reference to the Augmentor object
+        Augmentor& gamma(double min_gamma, double max_gamma, double prob=1);
+
+        /// Solarize
+        /// Inverts every color value at or above the threshold
+        /// \param threshold smallest value that is inverted
+        /// \param prob probability of performing the solarize operation
+        /// \return A reference to the Augmentor object
+        Augmentor& solarize(uint8_t threshold=128, double prob=1);
+
+        /// Posterize
+        /// Reduces every color value to its most significant bits
+        /// \param bits number of bits kept, 1 to 8
+        /// \param prob probability of performing the posterize operation
+        /// \return A reference to the Augmentor object
+        Augmentor& posterize(unsigned bits, double prob=1);
+
         /// Blur
         ///
         /// Blurs the image based on the sigma value
@@ -129,7 +260,8 @@ namespace augmentorLib {
 
         /// Blur
         ///
-        /// Blurs the image based on the sigma value
+        /// Blurs the image based on the sigma value. Kernel sizes from 3 to 15 are rounded to the nearest size with
+        /// unrolled kernels (3, 5, 7, 9, 11 or 15, see separable_blur::specialized_size)
         /// \param sigma Sigma value for Gaussian distribution
         /// \param kernel_size Kernel size for Gaussian distribution
         /// \param prob probability of performing the resize operation
@@ -138,6 +270,16 @@ namespace augmentorLib {
 
         Augmentor& rapid_blur(const double sigma, const unsigned int passes=3, double prob=1);
 
+        /// Gaussian Blur
+        ///
+        /// Blurs the image with a Gaussian of standard deviation sigma, picking the engine by sigma: a kernel for
+        /// small ones, box blurs, then a recursive filter whose cost does not depend on sigma (see
+        /// make_gaussian_blur)
+        /// \param sigma standard deviation in pixels
+        /// \param prob probability of performing the blur operation
+        /// \return A reference to the Augmentor object
+        Augmentor& gaussian_blur(double sigma, double prob=1);
+
         /// Pipeline
         /// Creates an input image array to operate on
         /// \return A reference to the Augmentor object
@@ -170,11 +312,142 @@ namespace augmentorLib {
         /// \return A reference to the Augmentor object
         Augmentor& flip(const std::string& type, double prob=1);
 
+        /// Seed
+        ///
+        /// Fixes the global seed of the random numbers. The source picked for output N and the random choices of
+        /// every operation on it come from counter based streams keyed by (seed, N, operation index), so a seeded
+        /// run is bit-identical for any thread count or execution mode. Without a seed the current time is used.
+        /// \param seed global seed, 0 picks a new time based seed
+        /// \return A reference to the Augmentor object
+        Augmentor& seed(uint64_t seed);
+
+        /// Fan out
+        ///
+        /// Sources are drawn with replacement, so most of them back several outputs. With fan out enabled, sample
+        /// groups the outputs by source, decodes each source once and hands every output its own copy of the
+        /// decoded image: decode cost is O(unique sources) instead of O(samples).
+        /// \param enabled turn fan out on or off
+        /// \return A reference to the Augmentor object
+        Augmentor& fan_out(bool enabled=true);
+
+        /// Fuse geometry
+        ///
+        /// Resize, crop (centered), zoom, rotate and flip are all an affine resampling of their input. When
+        /// several of them fire one after the other on an output, their maps are composed into one 2x3 matrix
+        /// and the image is resampled once, straight into the final size: the cost is proportional to the
+        /// output pixels instead of the sum over every intermediate image. Enabled by default; a fused run
+        /// rounds coordinates once instead of after every operation, so pixels can differ from an unfused run.
+        /// \param enabled turn fusion on or off
+        /// \return A reference to the Augmentor object
+        Augmentor& fuse_geometry(bool enabled=true);
+
+        /// Lossless
+        ///
+        /// When the operations that fire on an output only flip it, turn it by quarter turns and crop it on iMCU
+        /// (8 or 16 pixel) boundaries, without leaving any pixel black, the output is written jpegtran-style:
+        /// the quantized DCT coefficients of the source are moved block by block and never decoded, so it is
+        /// about twice as fast and bit exact instead of re-encoded at quality 95. Enabled by default.
+        /// \param enabled turn the coefficient path on or off
+        /// \return A reference to the Augmentor object
+        Augmentor& lossless(bool enabled=true);
+
+        /// Passthrough
+        ///
+        /// Every operation fires with its own probability, so some outputs come out of the plan with no
+        /// operation firing at all. Their output is the source file itself: it is copied (reflink or
+        /// copy_file_range, see copy_file) instead of decoded and re-encoded at quality 95, which costs neither
+        /// CPU nor extra disk space on filesystems with reflinks. Enabled by default.
+        /// \param enabled turn the copy on or off
+        /// \param hard_link write a hard link to the source instead of a copy, when both are on one filesystem.
+        ///        The output then shares the source inode: editing the output in place edits the source.
+        /// \return A reference to the Augmentor object
+        Augmentor& passthrough(bool enabled=true, bool hard_link=false);
+
+        /// Output
+        ///
+        /// Sends every encoded output to sink instead of writing it to its own output_N.jpg file: tar_sink
+        /// writes WebDataset shards, record_sink record files with an offset index (output_sink.h). Every
+        /// sample / execute call completes its last shard before it returns. Copied outputs (passthrough) are
+        /// read and stored like the others, there is nothing to reflink or link in an archive.
+        /// tensor_sink stores the final pixels as raw uint8 or normalized float tensors for trainers to map:
+        /// with it every output is decoded and transformed, and passthrough and lossless are not used.
+        /// \param sink where outputs go, nullptr goes back to one file per output
+        /// \return A reference to the Augmentor object
+        Augmentor& output(std::shared_ptr<output_sink> sink);
+
         /// Sample
         ///
         /// creates the specifed number of augmented images
         /// \param size number of augmented images to specify
-        void sample(size_t size);
+        /// \param threads number of worker threads, 0 uses every hardware thread. Each worker runs its own
+        /// clone of the operation chain, outputs keep the same output_N.jpg names as a serial run
+        void sample(size_t size, size_t threads = 1);
+
+        /// Sample
+        ///
+        /// creates the specifed number of augmented images with a staged pipeline: decoder threads feed a bounded
+        /// queue of decoded images, transformer threads run the operation chain into a second bounded queue,
+        /// and encoder threads compress and write the results. Full queues block the stage in front of them, so
+        /// at most 2 * queue_depth images wait between stages. With io_depth set, source files are read ahead
+        /// and outputs written behind by an async_file_io (io_uring, or a thread pool), so decoders and
+        /// encoders never wait on a file.
+        /// \param size number of augmented images to specify
+        /// \param config thread count of every stage, queue depth and background I/O
+        /// @see statistics()
+        void sample(size_t size, const pipeline_config& config);
+
+        /// Largest number of operations a chain can have when it is planned
+        static const size_t MAX_OPERATIONS = 64;
+
+        /// Plan
+        ///
+        /// Makes every random choice of size outputs up front: the source of every output, which operations fire
+        /// and their parameters. No image is decoded. sample(size) is execute(plan(size)).
+        /// \param size number of augmented images to plan
+        /// \return the plan, valid for this operation chain
+        augmentation_plan plan(size_t size);
+
+        /// Execute
+        ///
+        /// Runs a plan built by plan(), loaded with augmentation_plan::load or a shard of either. Outputs are
+        /// scheduled longest job first (estimated from source file size and the operations that fire), and
+        /// operations that do not fire for an output are skipped without touching its pixels.
+        /// \param plan plan of the current operation chain
+        /// \param threads number of worker threads, 0 uses every hardware thread
+        void execute(const augmentation_plan& plan, size_t threads = 1);
+
+        /// Execute
+        ///
+        /// Runs a plan with the staged decode -> transform -> encode pipeline.
+        /// \param plan plan of the current operation chain
+        /// \param config thread count of every stage, queue depth and background I/O
+        void execute(const augmentation_plan& plan, const pipeline_config& config);
+
+        /// Stream
+        ///
+        /// Pulls augmented images in process instead of writing them: a background decode -> transform pipeline
+        /// keeps up to prefetch finished images ready, the caller takes them one by one, in batches or with a
+        /// range-based for loop. Nothing is encoded, written or decoded again.
+        /// \code
+        /// auto stream = augmentor.stream(100000);
+        /// for (auto& image : stream) { ... }
+        /// \endcode
+        /// \param size number of augmented images
+        /// \param config thread count of the decode and transform stages, queue depth and background reads
+        /// \param prefetch finished images waiting for the caller
+        /// \return the stream, which must not outlive this Augmentor
+        image_stream stream(size_t size, const pipeline_config& config = pipeline_config(), size_t prefetch = 32);
+
+        /// Stream
+        ///
+        /// Streams the outputs of a plan built by plan() or loaded, see stream(size_t).
+        image_stream stream(augmentation_plan plan, const pipeline_config& config = pipeline_config(),
+                            size_t prefetch = 32);
+
+        /// Statistics
+        ///
+        /// \return per-stage work and wait times and queue depths of the last pipelined sample call
+        [[nodiscard]] const pipeline_stats& statistics() const { return stats; }
     };
 }
 
@@ -0,0 +1,260 @@
+#ifndef LIB_BOUNDEDQUEUE_H
+#define LIB_BOUNDEDQUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace augmentorLib {
+
+    /// Counters of a BoundedQueue, used to find the bottleneck stage of a pipeline
+    struct queue_stats {
+        size_t capacity = 0;
+        size_t max_depth = 0;
+        double mean_depth = 0;      // depth seen by producers right after each push
+        double push_stall_ms = 0;   // time producers spent waiting for a free slot (backpressure)
+        double pop_stall_ms = 0;    // time consumers spent waiting for an item (starvation)
+    };
+
+    /// A bounded multi-producer multi-consumer lock-free queue
+    ///
+    /// Ring buffer where every slot carries a sequence number (D. Vyukov's bounded MPMC queue): producers and
+    /// consumers claim slots with a CAS on their own position counter and never take a lock. The blocking
+    /// push() / pop() wrappers spin, then yield, then park on a condition variable while the queue is full /
+    /// empty, which is what gives a pipeline its backpressure without burning a core per idle stage. A push or
+    /// pop only takes the lock to wake parked threads when there are some.
+    /// \tparam T value type, must be default constructible and movable
+    template<typename T>
+    class BoundedQueue {
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct cell {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        std::unique_ptr<cell[]> buffer;
+        const size_t mask;
+        alignas(64) std::atomic<size_t> enqueue_pos{0};
+        alignas(64) std::atomic<size_t> dequeue_pos{0};
+        alignas(64) std::atomic<bool> closed{false};
+
+        // parking, once spinning and yielding did not help
+        std::mutex park_mutex;
+        std::condition_variable not_full;
+        std::condition_variable not_empty;
+        std::atomic<unsigned> push_waiters{0};
+        std::atomic<unsigned> pop_waiters{0};
+
+        static const unsigned SPIN_LIMIT = 64;
+        static const unsigned YIELD_LIMIT = 128;
+
+        std::atomic<size_t> max_depth{0};
+        std::atomic<size_t> depth_sum{0};
+        std::atomic<size_t> pushes{0};
+        std::atomic<long long> push_stall_ns{0};
+        std::atomic<long long> pop_stall_ns{0};
+
+        static size_t round_up(size_t capacity) {
+            size_t n = 2;
+            while (n < capacity) {
+                n <<= 1;
+            }
+            return n;
+        }
+
+        /// Spins, then yields, then parks on cv until ready() holds
+        template<typename Ready>
+        void backoff(unsigned& spins, std::atomic<unsigned>& waiters, std::condition_variable& cv, Ready ready) {
+            if (++spins < SPIN_LIMIT) {
+                return;
+            }
+            if (spins < YIELD_LIMIT) {
+                std::this_thread::yield();
+                return;
+            }
+            std::unique_lock<std::mutex> lock(park_mutex);
+            waiters.fetch_add(1, std::memory_order_relaxed);
+            // pairs with the fence in wake(): either ready() sees the slot it published, or it sees a waiter
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (!closed.load(std::memory_order_acquire) && !ready()) {
+                cv.wait(lock);
+            }
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        /// Wakes a thread parked on cv, after a slot was published
+        void wake(std::atomic<unsigned>& waiters, std::condition_variable& cv) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters.load(std::memory_order_relaxed) != 0) {
+                // the waiter checks under the lock, so it is either still checking or already waiting
+                { std::lock_guard<std::mutex> lock(park_mutex); }
+                cv.notify_one();
+            }
+        }
+
+        /// The slot at the head / tail is ready for try_push / try_pop, without claiming it
+        bool ready(const std::atomic<size_t>& position, size_t offset) const {
+            auto pos = position.load(std::memory_order_relaxed);
+            for (;;) {
+                auto seq = buffer[pos & mask].sequence.load(std::memory_order_acquire);
+                auto diff = (std::ptrdiff_t) seq - (std::ptrdiff_t) (pos + offset);
+                if (diff == 0) {
+                    return true;
+                }
+                if (diff < 0) {
+                    return false;
+                }
+                pos = position.load(std::memory_order_relaxed);
+            }
+        }
+
+        void record_depth() {
+            auto depth = size();
+            depth_sum += depth;
+            ++pushes;
+            auto seen = max_depth.load(std::memory_order_relaxed);
+            while (depth > seen && !max_depth.compare_exchange_weak(seen, depth, std::memory_order_relaxed)) {}
+        }
+
+    public:
+        /// \param capacity Number of slots, rounded up to a power of two
+        explicit BoundedQueue(size_t capacity): buffer{new cell[round_up(capacity)]}, mask{round_up(capacity) - 1} {
+            for (size_t i = 0; i <= mask; ++i) {
+                buffer[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        BoundedQueue(const BoundedQueue&) = delete;
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        /// Moves value into the queue if there is a free slot
+        /// \return false if the queue is full, value is left untouched
+        bool try_push(T& value) {
+            auto pos = enqueue_pos.load(std::memory_order_relaxed);
+            for (;;) {
+                auto& slot = buffer[pos & mask];
+                auto seq = slot.sequence.load(std::memory_order_acquire);
+                auto diff = (std::ptrdiff_t) seq - (std::ptrdiff_t) pos;
+                if (diff == 0) {
+                    if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        slot.value = std::move(value);
+                        slot.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /// Moves the oldest item into value if there is one
+        /// \return false if the queue is empty
+        bool try_pop(T& value) {
+            auto pos = dequeue_pos.load(std::memory_order_relaxed);
+            for (;;) {
+                auto& slot = buffer[pos & mask];
+                auto seq = slot.sequence.load(std::memory_order_acquire);
+                auto diff = (std::ptrdiff_t) seq - (std::ptrdiff_t) (pos + 1);
+                if (diff == 0) {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        value = std::move(slot.value);
+                        slot.sequence.store(pos + mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = dequeue_pos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /// Blocks while the queue is full
+        /// \return false if the queue was closed, the value is dropped
+        bool push(T value) {
+            if (try_push(value)) {
+                record_depth();
+                wake(pop_waiters, not_empty);
+                return true;
+            }
+            auto start = clock::now();
+            unsigned spins = 0;
+            while (!closed.load(std::memory_order_acquire)) {
+                if (try_push(value)) {
+                    push_stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+                    record_depth();
+                    wake(pop_waiters, not_empty);
+                    return true;
+                }
+                backoff(spins, push_waiters, not_full, [this]() { return ready(enqueue_pos, 0); });
+            }
+            return false;
+        }
+
+        /// Blocks while the queue is empty and still open
+        /// \return false once the queue is closed and drained
+        bool pop(T& value) {
+            if (try_pop(value)) {
+                wake(push_waiters, not_full);
+                return true;
+            }
+            auto start = clock::now();
+            unsigned spins = 0;
+            for (;;) {
+                // read the flag before trying, so an item pushed right before close() is never missed
+                bool done = closed.load(std::memory_order_acquire);
+                if (try_pop(value)) {
+                    pop_stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+                    wake(push_waiters, not_full);
+                    return true;
+                }
+                if (done) {
+                    pop_stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+                    return false;
+                }
+                backoff(spins, pop_waiters, not_empty, [this]() { return ready(dequeue_pos, 1); });
+            }
+        }
+
+        /// No more items will be pushed, consumers drain what is left and then stop
+        void close() {
+            closed.store(true, std::memory_order_release);
+            { std::lock_guard<std::mutex> lock(park_mutex); }
+            not_full.notify_all();
+            not_empty.notify_all();
+        }
+
+        /// Approximate number of queued items
+        [[nodiscard]] size_t size() const {
+            auto tail = dequeue_pos.load(std::memory_order_relaxed);
+            auto head = enqueue_pos.load(std::memory_order_relaxed);
+            return head > tail ? head - tail : 0;
+        }
+
+        [[nodiscard]] size_t capacity() const {
+            return mask + 1;
+        }
+
+        [[nodiscard]] queue_stats statistics() const {
+            queue_stats stats;
+            stats.capacity = capacity();
+            stats.max_depth = max_depth.load();
+            auto n = pushes.load();
+            stats.mean_depth = n ? (double) depth_sum.load() / n : 0;
+            stats.push_stall_ms = push_stall_ns.load() / 1e6;
+            stats.pop_stall_ms = pop_stall_ns.load() / 1e6;
+            return stats;
+        }
+    };
+}
+
+#endif //LIB_BOUNDEDQUEUE_H
@@ -0,0 +1,65 @@
+#ifndef LIB_PIPELINE_H
+#define LIB_PIPELINE_H
+
+#include "BoundedQueue.h"
+#include <cstddef>
+#include <ostream>
+
+namespace augmentorLib {
+
+    /// Thread counts and queue sizes of the staged decode -> transform -> encode pipeline
+    struct pipeline_config {
+        size_t decoders = 1;        // threads reading and decompressing source images
+        size_t transformers = 0;    // threads running the operation chain, 0 uses every hardware thread
+        size_t encoders = 1;        // threads compressing and writing output images
+        size_t queue_depth = 8;     // decoded / transformed images buffered between two stages
+        size_t io_depth = 0;        // source files read ahead and outputs written behind in the background,
+                                    // 0 reads and writes synchronously in the decode and encode threads
+        bool io_uring = true;       // background I/O through io_uring when the kernel allows it, else threads
+    };
+
+    /// Work and wait time of the threads of one stage, summed over the threads
+    struct stage_stats {
+        size_t threads = 0;
+        size_t items = 0;
+        double busy_ms = 0;         // time spent decoding / transforming / encoding
+        double input_wait_ms = 0;   // time starved, waiting on an empty input queue
+        double output_wait_ms = 0;  // time blocked, waiting on a full output queue
+    };
+
+    /// Statistics of the last pipelined Augmentor::sample call
+    ///
+    /// The bottleneck is the stage with the highest busy time per thread; the stages before it report
+    /// output waits and the stages after it report input waits.
+    struct pipeline_stats {
+        stage_stats decode;
+        stage_stats transform;
+        stage_stats encode;
+        queue_stats decoded_queue;      // between decode and transform
+        queue_stats transformed_queue;  // between transform and encode
+        const char* io_backend = "";    // "io_uring" or "threads" with background I/O, else empty
+        double wall_ms = 0;
+    };
+
+    inline std::ostream& operator<<(std::ostream& out, const stage_stats& stage) {
+        return out << stage.threads << " threads, " << stage.items << " items, busy " << stage.busy_ms
+                   << " ms, input wait " << stage.input_wait_ms << " ms, output wait " << stage.output_wait_ms << " ms";
+    }
+
+    inline std::ostream& operator<<(std::ostream& out, const queue_stats& queue) {
+        return out << "capacity " << queue.capacity << ", max depth " << queue.max_depth
+                   << ", mean depth " << queue.mean_depth;
+    }
+
+    inline std::ostream& operator<<(std::ostream& out, const pipeline_stats& stats) {
+        return out << "decode:    " << stats.decode << std::endl
+                   << "  queue:   " << stats.decoded_queue << std::endl
+                   << "transform: " << stats.transform << std::endl
+                   << "  queue:   " << stats.transformed_queue << std::endl
+                   << "encode:    " << stats.encode << std::endl
+                   << "io:        " << (*stats.io_backend ? stats.io_backend : "synchronous") << std::endl
+                   << "wall time: " << stats.wall_ms << " ms";
+    }
+}
+
+#endif //LIB_PIPELINE_H
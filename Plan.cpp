@@ -0,0 +1,140 @@
+#include "Plan.h"
+
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <stdexcept>
+
+namespace augmentorLib {
+    namespace {
+        const char PLAN_MAGIC[8] = {'A', 'U', 'G', 'P', 'L', 'A', 'N', '1'};
+
+        template<typename T>
+        void write_value(std::ofstream& out, const T& value) {
+            out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+
+        template<typename T>
+        void write_vector(std::ofstream& out, const std::vector<T>& values) {
+            write_value<uint64_t>(out, values.size());
+            out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+        }
+
+        template<typename T>
+        T read_value(std::ifstream& in) {
+            T value{};
+            in.read(reinterpret_cast<char*>(&value), sizeof(T));
+            return value;
+        }
+
+        /// Bytes of the file after the read position, what a count read from it can describe at most
+        uint64_t bytes_left(std::ifstream& in) {
+            auto position = in.tellg();
+            in.seekg(0, std::ios::end);
+            auto end = in.tellg();
+            in.seekg(position);
+            return position < 0 || end < position ? 0 : (uint64_t) (end - position);
+        }
+
+        template<typename T>
+        std::vector<T> read_vector(std::ifstream& in) {
+            auto n = read_value<uint64_t>(in);
+            if (!in || n > bytes_left(in) / sizeof(T)) {
+                throw std::runtime_error("Corrupt augmentation plan");
+            }
+            std::vector<T> values(n);
+            in.read(reinterpret_cast<char*>(values.data()), n * sizeof(T));
+            return values;
+        }
+    }
+
+    augmentation_plan augmentation_plan::shard(size_t index, size_t count) const {
+        if (count == 0 || index >= count) {
+            throw std::out_of_range("Shard index must be smaller than the shard count");
+        }
+        augmentation_plan part;
+        part.seed = seed;
+        part.sources = sources;
+        part.parameter_offset = parameter_offset;
+        part.parameters_per_sample = parameters_per_sample;
+
+        for (size_t i = index; i < size(); i += count) {
+            part.output.push_back(output[i]);
+            part.source.push_back(source[i]);
+            part.enabled.push_back(enabled[i]);
+            auto row = parameters.begin() + i * parameters_per_sample;
+            part.parameters.insert(part.parameters.end(), row, row + parameters_per_sample);
+        }
+        return part;
+    }
+
+    void augmentation_plan::save(const std::string& fileName) const {
+        std::ofstream out(fileName, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Could not open " + fileName + " for writing");
+        }
+        out.write(PLAN_MAGIC, sizeof(PLAN_MAGIC));
+        write_value<uint64_t>(out, seed);
+        write_value<uint64_t>(out, sources.size());
+        for (const auto& path : sources) {
+            write_value<uint64_t>(out, path.size());
+            out.write(path.data(), path.size());
+        }
+        write_vector(out, std::vector<uint64_t>(parameter_offset.begin(), parameter_offset.end()));
+        write_value<uint64_t>(out, parameters_per_sample);
+        write_vector(out, output);
+        write_vector(out, source);
+        write_vector(out, enabled);
+        write_vector(out, parameters);
+        if (!out) {
+            throw std::runtime_error("Could not write " + fileName);
+        }
+    }
+
+    augmentation_plan augmentation_plan::load(const std::string& fileName) {
+        std::ifstream in(fileName, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Could not open " + fileName);
+        }
+        char magic[sizeof(PLAN_MAGIC)];
+        in.read(magic, sizeof(magic));
+        if (!in || !std::equal(magic, magic + sizeof(magic), PLAN_MAGIC)) {
+            throw std::runtime_error(fileName + " does not seem to be an augmentation plan");
+        }
+
+        augmentation_plan plan;
+        plan.seed = read_value<uint64_t>(in);
+        // counts and lengths are checked before anything is allocated for them
+        auto source_count = read_value<uint64_t>(in);
+        if (!in || source_count > bytes_left(in) / sizeof(uint64_t)) {
+            throw std::runtime_error("Corrupt augmentation plan " + fileName);
+        }
+        for (uint64_t i = 0; i < source_count; ++i) {
+            auto length = read_value<uint64_t>(in);
+            if (!in || length > PATH_MAX) {
+                throw std::runtime_error("Corrupt augmentation plan " + fileName);
+            }
+            std::string path(length, '\0');
+            in.read(path.data(), length);
+            plan.sources.push_back(std::move(path));
+        }
+        auto offsets = read_vector<uint64_t>(in);
+        plan.parameter_offset.assign(offsets.begin(), offsets.end());
+        plan.parameters_per_sample = read_value<uint64_t>(in);
+        plan.output = read_vector<uint64_t>(in);
+        plan.source = read_vector<uint32_t>(in);
+        plan.enabled = read_vector<uint64_t>(in);
+        plan.parameters = read_vector<double>(in);
+
+        if (!in || plan.source.size() != plan.size() || plan.enabled.size() != plan.size()
+                || plan.parameters.size() != plan.size() * plan.parameters_per_sample) {
+            throw std::runtime_error("Corrupt augmentation plan " + fileName);
+        }
+        for (auto source : plan.source) {
+            if (source >= plan.sources.size()) {
+                throw std::runtime_error("Corrupt augmentation plan " + fileName);
+            }
+        }
+        return plan;
+    }
+}
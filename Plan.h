@@ -0,0 +1,68 @@
+#ifndef LIB_PLAN_H
+#define LIB_PLAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace augmentorLib {
+
+    /// A precomputed augmentation run
+    ///
+    /// Every random choice of a run, stored as a struct of arrays with one entry per output: the source image,
+    /// a bitmask of the operations that fire and the parameters they drew. Augmentor::plan builds it without
+    /// touching any pixels and Augmentor::execute runs it, so a plan can be inspected, reordered, saved and
+    /// replayed, or split into shards that separate processes execute.
+    struct augmentation_plan {
+        /// Seed the operations are bound to when the plan is executed
+        uint64_t seed = 0;
+        /// Distinct source paths, referenced by index from source
+        std::vector<std::string> sources;
+        /// Per operation of the chain: offset of its parameters inside the parameter row of an output
+        std::vector<size_t> parameter_offset;
+        /// Length of the parameter row of an output
+        size_t parameters_per_sample = 0;
+
+        /// Per output: N of the output_N.jpg file it is written to
+        std::vector<uint64_t> output;
+        /// Per output: index into sources
+        std::vector<uint32_t> source;
+        /// Per output: bit k is set if operation k fires
+        std::vector<uint64_t> enabled;
+        /// Per output: parameters_per_sample values, unused slots of operations that do not fire are 0
+        std::vector<double> parameters;
+
+        [[nodiscard]] size_t size() const { return output.size(); }
+
+        [[nodiscard]] size_t operation_count() const { return parameter_offset.size(); }
+
+        [[nodiscard]] bool fires(size_t sample, size_t operation) const {
+            return (enabled[sample] >> operation) & 1u;
+        }
+
+        [[nodiscard]] const double* parameters_of(size_t sample, size_t operation) const {
+            return parameters.data() + sample * parameters_per_sample + parameter_offset[operation];
+        }
+
+        /// Shard
+        ///
+        /// Outputs index, index + count, index + 2 * count, ... of the plan; output names are kept, so count
+        /// processes executing one shard each write the same files as a single process executing the whole plan.
+        /// \param index shard number, 0 <= index < count
+        /// \param count number of shards
+        [[nodiscard]] augmentation_plan shard(size_t index, size_t count) const;
+
+        /// Save
+        ///
+        /// Writes the plan to a binary file. Will throw if the file cannot be written.
+        void save(const std::string& fileName) const;
+
+        /// Load
+        ///
+        /// Reads a plan written by save. Will throw if the file cannot be read or is not a plan.
+        static augmentation_plan load(const std::string& fileName);
+    };
+}
+
+#endif //LIB_PLAN_H
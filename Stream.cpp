@@ -0,0 +1,70 @@
+#include "Stream.h"
+#include <algorithm>
+
+namespace augmentorLib {
+    image_stream::image_stream(producer run, size_t size, size_t prefetch):
+            shared(new state(size, std::max<size_t>(prefetch, 1))) {
+        auto s = shared.get();
+        s->worker = std::thread([s, run = std::move(run)]() {
+            try {
+                s->stats = run(s->results);
+            } catch (...) {
+                s->failure = std::current_exception();
+            }
+            s->results.close();
+        });
+    }
+
+    image_stream& image_stream::operator=(image_stream&& rhs) noexcept {
+        if (this != &rhs) {
+            finish();
+            shared = std::move(rhs.shared);
+        }
+        return *this;
+    }
+
+    image_stream::~image_stream() {
+        finish();
+    }
+
+    void image_stream::finish() {
+        if (shared && shared->worker.joinable()) {
+            // full pushes fail once closed, which stops every stage of the pipeline
+            shared->results.close();
+            shared->worker.join();
+        }
+    }
+
+    bool image_stream::next(jpegimageSTL::jpeg::Image& image, size_t& index) {
+        pipeline_item item;
+        if (!shared->results.pop(item)) {
+            if (shared->worker.joinable()) {
+                shared->worker.join();
+            }
+            if (shared->failure) {
+                auto failure = shared->failure;
+                shared->failure = nullptr;
+                std::rethrow_exception(failure);
+            }
+            return false;
+        }
+        index = item.index;
+        image = std::move(*item.image);
+        return true;
+    }
+
+    bool image_stream::next(jpegimageSTL::jpeg::Image& image) {
+        size_t index;
+        return next(image, index);
+    }
+
+    size_t image_stream::next_batch(std::vector<jpegimageSTL::jpeg::Image>& batch, size_t size) {
+        batch.resize(size);
+        size_t taken = 0;
+        while (taken < size && next(batch[taken])) {
+            ++taken;
+        }
+        batch.resize(taken);
+        return taken;
+    }
+}
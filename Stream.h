@@ -0,0 +1,121 @@
+#ifndef LIB_STREAM_H
+#define LIB_STREAM_H
+
+#include "jpeg.h"
+#include "BoundedQueue.h"
+#include "Pipeline.h"
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace augmentorLib {
+
+    /// An image between two stages of the pipeline
+    struct pipeline_item {
+        size_t index = 0;   // position in the plan; the output index (N of output_N.jpg) once it leaves the pipeline
+        std::unique_ptr<jpegimageSTL::jpeg::Image> image;
+    };
+
+    /// Augmented images pulled in process, without encoding, writing or decoding them
+    ///
+    /// A background pipeline (decode -> transform) fills a queue of up to prefetch finished images while the
+    /// consumer works on the previous ones; the consumer takes them one by one or in batches. Images come in
+    /// the order they are finished, which changes with the thread counts, but the pixels of output N only
+    /// depend on the seed and N: next(image, index) tells which output an image is.
+    ///
+    /// Destroying the stream before the end stops the pipeline. The Augmentor it came from must outlive it and
+    /// must not be changed meanwhile.
+    class image_stream {
+    public:
+        /// Runs the pipeline into results and closes it once every image is in
+        typedef std::function<pipeline_stats(BoundedQueue<pipeline_item>& results)> producer;
+
+    private:
+        struct state {
+            BoundedQueue<pipeline_item> results;
+            std::thread worker;
+            std::exception_ptr failure;
+            pipeline_stats stats;
+            size_t size;
+
+            state(size_t size, size_t prefetch) : results(prefetch), size(size) {}
+        };
+
+        std::unique_ptr<state> shared;
+
+        /// Stops the pipeline and waits for it
+        void finish();
+
+    public:
+        /// Input iterator over the remaining images, for range-based for loops
+        class iterator {
+        private:
+            image_stream* stream = nullptr;
+            jpegimageSTL::jpeg::Image current;
+
+        public:
+            typedef std::input_iterator_tag iterator_category;
+            typedef jpegimageSTL::jpeg::Image value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef value_type* pointer;
+            typedef value_type& reference;
+
+            iterator() = default;
+
+            explicit iterator(image_stream* stream) : stream(stream) {
+                ++*this;
+            }
+
+            reference operator*() { return current; }
+            pointer operator->() { return &current; }
+
+            iterator& operator++() {
+                if (stream && !stream->next(current)) {
+                    stream = nullptr;
+                }
+                return *this;
+            }
+
+            bool operator==(const iterator& rhs) const { return stream == rhs.stream; }
+            bool operator!=(const iterator& rhs) const { return stream != rhs.stream; }
+        };
+
+        /// Starts run on a background thread
+        /// \param run fills the results queue
+        /// \param size number of images run produces
+        /// \param prefetch finished images kept ready, at least 1
+        image_stream(producer run, size_t size, size_t prefetch);
+
+        image_stream(image_stream&&) noexcept = default;
+
+        image_stream& operator=(image_stream&& rhs) noexcept;
+
+        ~image_stream();
+
+        /// Takes the next image, waiting for it if none is ready
+        /// \return false once every image was taken. Rethrows what stopped the pipeline, if anything did.
+        bool next(jpegimageSTL::jpeg::Image& image);
+
+        /// Takes the next image and its output index
+        bool next(jpegimageSTL::jpeg::Image& image, size_t& index);
+
+        /// Takes up to size images into batch, replacing its content
+        /// \return number of images taken, less than size only at the end of the stream
+        size_t next_batch(std::vector<jpegimageSTL::jpeg::Image>& batch, size_t size);
+
+        /// Number of images of the whole stream
+        [[nodiscard]] size_t size() const { return shared->size; }
+
+        /// Work and wait times of the pipeline, once next() returned false. The encode stage is the consumer.
+        [[nodiscard]] const pipeline_stats& statistics() const { return shared->stats; }
+
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(); }
+    };
+}
+
+#endif //LIB_STREAM_H
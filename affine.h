@@ -0,0 +1,57 @@
+#ifndef LIB_AFFINE_H
+#define LIB_AFFINE_H
+
+#include <cmath>
+
+namespace augmentorLib {
+
+    /// A 2x3 affine map of pixel coordinates
+    ///
+    ///     x' = xx * x + xy * y + x0
+    ///     y' = yx * x + yy * y + y0
+    ///
+    /// Geometric operations describe themselves by the map from their output pixel coordinates back to their
+    /// input pixel coordinates, so that a run of them composes into a single map from the final output to the
+    /// source image. Pixel centres sit on integer coordinates.
+    struct affine_transform {
+        double xx = 1, xy = 0, x0 = 0;
+        double yx = 0, yy = 1, y0 = 0;
+
+        static affine_transform translation(double dx, double dy) {
+            return {1, 0, dx, 0, 1, dy};
+        }
+
+        /// Maps pixel centres of an image of size (to_width, to_height) onto pixel centres of one of size
+        /// (from_width, from_height), both images covering the same area
+        static affine_transform rescale(double from_width, double from_height, double to_width, double to_height) {
+            double sx = from_width / to_width;
+            double sy = from_height / to_height;
+            return {sx, 0, 0.5 * sx - 0.5, 0, sy, 0.5 * sy - 0.5};
+        }
+
+        /// Counterclockwise rotation by angle radians around (cx, cy)
+        static affine_transform rotation(double angle, double cx, double cy) {
+            double c = std::cos(angle);
+            double s = std::sin(angle);
+            return {c, -s, cx - c * cx + s * cy, s, c, cy - s * cx - c * cy};
+        }
+
+        /// Composition: (*this * other)(p) = (*this)(other(p)), other is applied first
+        affine_transform operator*(const affine_transform& other) const {
+            return {
+                xx * other.xx + xy * other.yx, xx * other.xy + xy * other.yy, xx * other.x0 + xy * other.y0 + x0,
+                yx * other.xx + yy * other.yx, yx * other.xy + yy * other.yy, yx * other.x0 + yy * other.y0 + y0
+            };
+        }
+
+        inline double x(double x, double y) const {
+            return xx * x + xy * y + x0;
+        }
+
+        inline double y(double x, double y) const {
+            return yx * x + yy * y + y0;
+        }
+    };
+}
+
+#endif //LIB_AFFINE_H
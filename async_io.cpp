@@ -0,0 +1,653 @@
+#include "async_io.h"
+#include "file_copy.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define ASYNC_IO_URING
+#endif
+
+namespace augmentorLib {
+    namespace {
+        std::runtime_error io_error(const std::string& what, const std::string& path, int error) {
+            return std::runtime_error(what + " " + path + ": " + std::strerror(error));
+        }
+
+        /// Slots for the files in flight: callers block in acquire while all depth of them are taken
+        class flight_limit {
+        private:
+            std::mutex mutex;
+            std::condition_variable freed;
+            size_t in_flight = 0;
+            const size_t depth;
+
+        public:
+            explicit flight_limit(size_t depth): depth(depth) {}
+
+            void acquire() {
+                std::unique_lock<std::mutex> lock(mutex);
+                freed.wait(lock, [&]() { return in_flight < depth; });
+                ++in_flight;
+            }
+
+            void release() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    --in_flight;
+                }
+                freed.notify_all();
+            }
+
+            /// Blocks until every file in flight is done
+            void drain() {
+                std::unique_lock<std::mutex> lock(mutex);
+                freed.wait(lock, [&]() { return in_flight == 0; });
+            }
+        };
+
+        /// Fallback: depth threads, each doing one blocking open / pread or pwrite / close at a time
+        class thread_pool_io : public async_file_io {
+        private:
+            std::mutex mutex;
+            std::condition_variable ready;
+            std::deque<std::function<void()>> tasks;
+            bool stopping = false;
+            std::vector<std::thread> threads;
+            flight_limit limit;
+
+            void run() {
+                for (;;) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        ready.wait(lock, [&]() { return stopping || !tasks.empty(); });
+                        if (tasks.empty()) {
+                            return;
+                        }
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                    }
+                    task();
+                    limit.release();
+                }
+            }
+
+            /// Queues a task once one of the depth slots is free, the slot is released when the task is done
+            void post(std::function<void()> task) {
+                limit.acquire();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    tasks.push_back(std::move(task));
+                }
+                ready.notify_one();
+            }
+
+            static std::vector<uint8_t> read_file(const std::string& path) {
+                int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                    throw io_error("Could not open", path, errno);
+                }
+                struct stat status{};
+                if (::fstat(fd, &status) != 0) {
+                    int error = errno;
+                    ::close(fd);
+                    throw io_error("Could not open", path, error);
+                }
+                std::vector<uint8_t> data(status.st_size);
+                size_t done = 0;
+                while (done < data.size()) {
+                    ssize_t n = ::pread(fd, data.data() + done, data.size() - done, done);
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n < 0) {
+                        int error = errno;
+                        ::close(fd);
+                        throw io_error("Could not read", path, error);
+                    }
+                    if (n == 0) {
+                        break;
+                    }
+                    done += n;
+                }
+                ::close(fd);
+                data.resize(done);
+                return data;
+            }
+
+            static void write_file(const std::string& path, const std::vector<uint8_t>& data) {
+                prepare_output(path);
+                int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (fd < 0) {
+                    throw io_error("Could not open", path, errno);
+                }
+                size_t done = 0;
+                while (done < data.size()) {
+                    ssize_t n = ::pwrite(fd, data.data() + done, data.size() - done, done);
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n < 0) {
+                        int error = errno;
+                        ::close(fd);
+                        throw io_error("Could not write", path, error);
+                    }
+                    done += n;
+                }
+                if (::close(fd) != 0) {
+                    throw io_error("Could not write", path, errno);
+                }
+            }
+
+        public:
+            explicit thread_pool_io(size_t depth): limit(depth) {
+                threads.reserve(depth);
+                for (size_t t = 0; t < depth; ++t) {
+                    threads.emplace_back([this]() { run(); });
+                }
+            }
+
+            ~thread_pool_io() override {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                ready.notify_all();
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+            }
+
+            std::future<std::vector<uint8_t>> read(const std::string& path) override {
+                auto task = std::make_shared<std::packaged_task<std::vector<uint8_t>()>>(
+                        [path]() { return read_file(path); });
+                auto result = task->get_future();
+                post([task]() { (*task)(); });
+                return result;
+            }
+
+            std::future<void> write(const std::string& path, std::vector<uint8_t> data) override {
+                auto bytes = std::make_shared<std::vector<uint8_t>>(std::move(data));
+                auto task = std::make_shared<std::packaged_task<void()>>(
+                        [path, bytes]() { write_file(path, *bytes); });
+                auto result = task->get_future();
+                post([task]() { (*task)(); });
+                return result;
+            }
+
+            const char* backend() const override {
+                return "threads";
+            }
+        };
+
+#ifdef ASYNC_IO_URING
+        /// io_uring backend, on the raw system calls (no liburing)
+        ///
+        /// Every file is a small state machine driven by its completions. A read queues openat and statx
+        /// together, then read until the file is in, then close. A write queues unlinkat hard linked to openat
+        /// (so the open runs whether or not there was a file to unlink), then write, then close. Submitting
+        /// threads fill the submission ring under a mutex; one reaper thread waits on the completion ring,
+        /// queues the next step of each file and fulfils its promise after the close.
+        ///
+        /// Should io_uring_enter fail for good, the ring is broken: the entries the kernel did not take are
+        /// handed to the reaper as if they had failed with that error (a close is still done, synchronously),
+        /// so their files fail through their futures, and later files go to a thread pool instead.
+        class uring_io : public async_file_io {
+        private:
+            enum step : uint64_t { open_step, stat_step, transfer_step, close_step, unlink_step };
+
+            struct request {
+                bool writing = false;
+                std::string path;
+                std::vector<uint8_t> data;
+                size_t done = 0;
+                int fd = -1;
+                int pending = 0;            // completions outstanding for the current step
+                int error = 0;              // first errno met
+                const char* what = nullptr; // what failed
+                struct statx status{};
+                std::promise<std::vector<uint8_t>> read_result;
+                std::promise<void> write_result;
+            };
+
+            int ring = -1;
+            void* sq_map = MAP_FAILED;
+            size_t sq_map_size = 0;
+            void* cq_map = MAP_FAILED;
+            size_t cq_map_size = 0;
+            io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+            size_t sqes_size = 0;
+
+            unsigned* sq_head = nullptr;
+            unsigned* sq_tail = nullptr;
+            unsigned sq_mask = 0;
+            unsigned* sq_array = nullptr;
+            unsigned* cq_head = nullptr;
+            unsigned* cq_tail = nullptr;
+            unsigned cq_mask = 0;
+            io_uring_cqe* cqes = nullptr;
+
+            std::mutex submit_mutex;
+            std::atomic<int> broken{0};                         // errno of the io_uring_enter that broke the ring
+            std::vector<std::pair<uint64_t, int>> unsent;       // user data and result of entries never submitted
+            std::unique_ptr<thread_pool_io> fallback;           // takes the files once the ring is broken
+            const size_t depth;
+            flight_limit limit;
+            std::thread reaper;
+
+            static int enter(int fd, unsigned submit, unsigned wait, unsigned flags, const void* arg = nullptr,
+                             size_t size = 0) {
+                return (int) ::syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+            }
+
+            /// Fills the next free submission entry; the caller holds submit_mutex
+            io_uring_sqe* next_sqe(unsigned& tail) {
+                // at most two entries per file in flight, the ring has room for all of them
+                unsigned index = tail & sq_mask;
+                io_uring_sqe* sqe = &sqes[index];
+                std::memset(sqe, 0, sizeof(*sqe));
+                sq_array[index] = index;
+                ++tail;
+                return sqe;
+            }
+
+            /// Publishes the count entries before tail and hands them to the kernel; the caller holds submit_mutex
+            ///
+            /// If the ring is or becomes broken, the entries the kernel did not take are withdrawn and queued in
+            /// unsent, for the reaper to complete with the error.
+            void submit(unsigned tail, unsigned count) {
+                if (broken == 0) {
+                    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+                }
+                while (count > 0 && broken == 0) {
+                    int n = enter(ring, count, 0, 0);
+                    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+                        continue;
+                    }
+                    if (n < 0) {
+                        broken = errno;
+                        __atomic_store_n(sq_tail, tail - count, __ATOMIC_RELEASE);
+                        break;
+                    }
+                    count -= n;
+                }
+                for (unsigned i = tail - count; i != tail; ++i) {
+                    unsent.emplace_back(sqes[sq_array[i & sq_mask]].user_data, -broken);
+                }
+            }
+
+            static uint64_t tag(request* r, step s) {
+                return reinterpret_cast<uint64_t>(r) | s;
+            }
+
+            void queue_open(request* r) {
+                std::lock_guard<std::mutex> lock(submit_mutex);
+                unsigned tail = *sq_tail;
+                r->pending = 2;
+                if (r->writing) {
+                    io_uring_sqe* unlink = next_sqe(tail);
+                    unlink->opcode = IORING_OP_UNLINKAT;
+                    unlink->fd = AT_FDCWD;
+                    unlink->addr = reinterpret_cast<uint64_t>(r->path.c_str());
+                    unlink->flags = IOSQE_IO_HARDLINK;
+                    unlink->user_data = tag(r, unlink_step);
+                }
+                io_uring_sqe* open = next_sqe(tail);
+                open->opcode = IORING_OP_OPENAT;
+                open->fd = AT_FDCWD;
+                open->addr = reinterpret_cast<uint64_t>(r->path.c_str());
+                open->open_flags = r->writing ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+                open->len = 0644;
+                open->user_data = tag(r, open_step);
+                if (!r->writing) {
+                    io_uring_sqe* stat = next_sqe(tail);
+                    stat->opcode = IORING_OP_STATX;
+                    stat->fd = AT_FDCWD;
+                    stat->addr = reinterpret_cast<uint64_t>(r->path.c_str());
+                    stat->len = STATX_SIZE;
+                    stat->off = reinterpret_cast<uint64_t>(&r->status);
+                    stat->user_data = tag(r, stat_step);
+                }
+                submit(tail, 2);
+            }
+
+            void queue_transfer(request* r) {
+                std::lock_guard<std::mutex> lock(submit_mutex);
+                unsigned tail = *sq_tail;
+                io_uring_sqe* sqe = next_sqe(tail);
+                sqe->opcode = r->writing ? IORING_OP_WRITE : IORING_OP_READ;
+                sqe->fd = r->fd;
+                sqe->addr = reinterpret_cast<uint64_t>(r->data.data() + r->done);
+                sqe->len = (unsigned) std::min<size_t>(r->data.size() - r->done, 1u << 30);
+                sqe->off = r->done;
+                sqe->user_data = tag(r, transfer_step);
+                r->pending = 1;
+                submit(tail, 1);
+            }
+
+            void queue_close(request* r) {
+                if (r->fd < 0) {
+                    finish(r);
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(submit_mutex);
+                unsigned tail = *sq_tail;
+                io_uring_sqe* sqe = next_sqe(tail);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = r->fd;
+                sqe->user_data = tag(r, close_step);
+                r->pending = 1;
+                submit(tail, 1);
+            }
+
+            void fail(request* r, const char* what, int error) {
+                if (r->error == 0) {
+                    r->error = error;
+                    r->what = what;
+                }
+            }
+
+            void finish(request* r) {
+                if (r->error != 0) {
+                    auto failure = std::make_exception_ptr(io_error(r->what, r->path, r->error));
+                    if (r->writing) {
+                        r->write_result.set_exception(failure);
+                    } else {
+                        r->read_result.set_exception(failure);
+                    }
+                } else if (r->writing) {
+                    r->write_result.set_value();
+                } else {
+                    r->data.resize(r->done);
+                    r->read_result.set_value(std::move(r->data));
+                }
+                delete r;
+                limit.release();
+            }
+
+            /// Next step of the file r, after a completion of step s with result res
+            void advance(request* r, step s, int res) {
+                switch (s) {
+                    case unlink_step:
+                        // a missing file is fine, the open that follows reports anything worse
+                        break;
+                    case open_step:
+                        if (res < 0) {
+                            fail(r, "Could not open", -res);
+                        } else {
+                            r->fd = res;
+                        }
+                        break;
+                    case stat_step:
+                        if (res < 0) {
+                            fail(r, "Could not open", -res);
+                        }
+                        break;
+                    case transfer_step:
+                        if (res == -EINTR || res == -EAGAIN) {
+                            queue_transfer(r);
+                            return;
+                        }
+                        if (res < 0) {
+                            fail(r, r->writing ? "Could not write" : "Could not read", -res);
+                            queue_close(r);
+                            return;
+                        }
+                        r->done += res;
+                        if (res > 0 && r->done < r->data.size()) {
+                            queue_transfer(r);
+                            return;
+                        }
+                        // a read of 0 bytes means the file shrank since the statx, a write of 0 bytes is an error
+                        if (r->writing && r->done < r->data.size()) {
+                            fail(r, "Could not write", EIO);
+                        }
+                        queue_close(r);
+                        return;
+                    case close_step:
+                        if (res < 0 && r->writing) {
+                            fail(r, "Could not write", -res);
+                        }
+                        finish(r);
+                        return;
+                }
+                if (--r->pending > 0) {
+                    return;
+                }
+                if (r->error != 0 || r->fd < 0) {
+                    queue_close(r);
+                    return;
+                }
+                if (!r->writing) {
+                    r->data.resize(r->status.stx_size);
+                }
+                if (r->data.empty()) {
+                    queue_close(r);
+                } else {
+                    queue_transfer(r);
+                }
+            }
+
+            /// Completes the entries that never reached the kernel
+            /// \return false once the no-op that stops the reaper is among them
+            bool reap_unsent() {
+                std::vector<std::pair<uint64_t, int>> entries;
+                {
+                    std::lock_guard<std::mutex> lock(submit_mutex);
+                    entries.swap(unsent);
+                }
+                for (auto entry : entries) {
+                    if (entry.first == 0) {
+                        return false;
+                    }
+                    auto r = reinterpret_cast<request*>(entry.first & ~uint64_t(7));
+                    auto s = static_cast<step>(entry.first & 7);
+                    if (s == close_step) {
+                        // the file descriptor is still ours to close
+                        entry.second = ::close(r->fd) == 0 ? 0 : -errno;
+                    }
+                    advance(r, s, entry.second);
+                }
+                return true;
+            }
+
+            void reap() {
+                for (;;) {
+                    if (broken != 0 && !reap_unsent()) {
+                        return;
+                    }
+                    unsigned head = *cq_head;
+                    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                        // bounded, so that entries left unsent by a broken ring are seen without any completion
+                        __kernel_timespec timeout{0, 100000000};
+                        io_uring_getevents_arg arg{};
+                        arg.ts = reinterpret_cast<uint64_t>(&timeout);
+                        if (enter(ring, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 &&
+                            errno != EINTR && errno != ETIME) {
+                            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        }
+                        continue;
+                    }
+                    io_uring_cqe cqe = cqes[head & cq_mask];
+                    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                    if (cqe.user_data == 0) {
+                        return;
+                    }
+                    auto r = reinterpret_cast<request*>(cqe.user_data & ~uint64_t(7));
+                    advance(r, static_cast<step>(cqe.user_data & 7), cqe.res);
+                }
+            }
+
+            void release() {
+                if (sqes != MAP_FAILED) {
+                    ::munmap(sqes, sqes_size);
+                }
+                if (cq_map != MAP_FAILED && cq_map != sq_map) {
+                    ::munmap(cq_map, cq_map_size);
+                }
+                if (sq_map != MAP_FAILED) {
+                    ::munmap(sq_map, sq_map_size);
+                }
+                if (ring >= 0) {
+                    ::close(ring);
+                }
+            }
+
+            /// Every operation the state machine uses is known to the kernel
+            bool supported() const {
+                const unsigned count = 256;
+                std::vector<uint8_t> buffer(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op));
+                auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+                if (::syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, count) < 0) {
+                    return false;
+                }
+                for (unsigned op : {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE,
+                                    IORING_OP_CLOSE, IORING_OP_UNLINKAT}) {
+                    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+        public:
+            explicit uring_io(size_t depth): depth(depth), limit(depth) {
+                io_uring_params params{};
+                ring = (int) ::syscall(__NR_io_uring_setup, (unsigned) std::min<size_t>(2 * depth, 4096), &params);
+                if (ring < 0) {
+                    return;
+                }
+                sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+                if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                    sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+                }
+                sq_map = ::mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                                IORING_OFF_SQ_RING);
+                if (sq_map == MAP_FAILED) {
+                    return;
+                }
+                cq_map = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_map :
+                         ::mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                                IORING_OFF_CQ_RING);
+                sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+                void* sqe_map = ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                                       IORING_OFF_SQES);
+                sqes = static_cast<io_uring_sqe*>(sqe_map);
+                if (cq_map == MAP_FAILED || sqe_map == MAP_FAILED) {
+                    return;
+                }
+
+                auto sq = static_cast<char*>(sq_map);
+                sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+                sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+                sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+                sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+                auto cq = static_cast<char*>(cq_map);
+                cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+                cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+                cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+                cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+                if (!(params.features & IORING_FEAT_EXT_ARG) || !supported()) {
+                    return;
+                }
+                reaper = std::thread([this]() { reap(); });
+            }
+
+            ~uring_io() override {
+                if (reaper.joinable()) {
+                    limit.drain();
+                    // a no-op with user data 0 stops the reaper, through unsent if the ring is broken
+                    {
+                        std::lock_guard<std::mutex> lock(submit_mutex);
+                        unsigned tail = *sq_tail;
+                        next_sqe(tail)->opcode = IORING_OP_NOP;
+                        submit(tail, 1);
+                    }
+                    reaper.join();
+                }
+                release();
+            }
+
+            /// The ring is set up and the kernel has every operation needed
+            [[nodiscard]] bool usable() const {
+                return reaper.joinable();
+            }
+
+            /// The thread pool, once the ring is broken, else nullptr
+            thread_pool_io* fallback_io() {
+                if (broken == 0) {
+                    return nullptr;
+                }
+                std::lock_guard<std::mutex> lock(submit_mutex);
+                if (!fallback) {
+                    fallback = std::make_unique<thread_pool_io>(depth);
+                }
+                return fallback.get();
+            }
+
+            std::future<std::vector<uint8_t>> read(const std::string& path) override {
+                if (auto io = fallback_io()) {
+                    return io->read(path);
+                }
+                limit.acquire();
+                auto r = new request;
+                r->path = path;
+                auto result = r->read_result.get_future();
+                queue_open(r);
+                return result;
+            }
+
+            std::future<void> write(const std::string& path, std::vector<uint8_t> data) override {
+                if (auto io = fallback_io()) {
+                    return io->write(path, std::move(data));
+                }
+                limit.acquire();
+                auto r = new request;
+                r->writing = true;
+                r->path = path;
+                r->data = std::move(data);
+                auto result = r->write_result.get_future();
+                queue_open(r);
+                return result;
+            }
+
+            const char* backend() const override {
+                return broken == 0 ? "io_uring" : "threads";
+            }
+        };
+#endif
+    }
+
+    std::unique_ptr<async_file_io> async_file_io::create(size_t depth, bool use_uring) {
+        depth = std::max<size_t>(depth, 1);
+#ifdef ASYNC_IO_URING
+        if (use_uring) {
+            auto uring = std::make_unique<uring_io>(depth);
+            if (uring->usable()) {
+                return uring;
+            }
+        }
+#else
+        (void) use_uring;
+#endif
+        return std::make_unique<thread_pool_io>(depth);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef LIB_ASYNC_IO_H
+#define LIB_ASYNC_IO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace augmentorLib {
+
+    /// Whole-file reads and writes that run in the background
+    ///
+    /// With many small files the open / read / close round trips, not the bandwidth, limit a run: one thread
+    /// blocking on each file in turn leaves the device idle most of the time. An async_file_io keeps up to
+    /// depth files in flight and hands back futures, so decoders get compressed bytes that were read while
+    /// they decoded the previous image, and encoders hand their output over without waiting for the write.
+    ///
+    /// Two backends: Linux io_uring, where open, stat, read / write and close are queued to the kernel from one
+    /// ring and reaped by a single thread, and a pool of depth threads doing blocking pread / pwrite where
+    /// io_uring is missing, disabled, or lacks one of those operations (kernels before 5.11). If the ring stops
+    /// taking submissions, the files it held fail with that error and the rest go to the thread pool.
+    class async_file_io {
+    public:
+        virtual ~async_file_io() = default;
+
+        /// Starts reading the whole file at path. Blocks while depth files are in flight.
+        /// \return the bytes of the file, or a std::runtime_error if it cannot be read
+        virtual std::future<std::vector<uint8_t>> read(const std::string& path) = 0;
+
+        /// Starts writing data to path. The old file is unlinked first, so that the write never goes through a
+        /// hard link into another file (see prepare_output). Blocks while depth files are in flight.
+        /// \return ready once the file is written and closed, or a std::runtime_error
+        virtual std::future<void> write(const std::string& path, std::vector<uint8_t> data) = 0;
+
+        /// "io_uring" or "threads", the backend now taking files
+        [[nodiscard]] virtual const char* backend() const = 0;
+
+        /// \param depth number of files read or written at the same time, at least 1
+        /// \param use_uring try io_uring first, else go straight to the thread pool
+        static std::unique_ptr<async_file_io> create(size_t depth, bool use_uring = true);
+    };
+}
+
+#endif //LIB_ASYNC_IO_H
@@ -0,0 +1,967 @@
+#include "blur.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLUR_X86
+#endif
+
+namespace augmentorLib {
+    /// n intermediates of a row from a row padded with radius pixels on each side: tap k of sample i is
+    /// padded[i + k * pixel_size]
+    typedef void (*horizontal_function)(const uint8_t* padded, size_t pixel_size, const int16_t* weights,
+                                        const int32_t* pairs, size_t taps, int16_t* out, size_t n);
+
+    /// n bytes of an output row from the taps rows of intermediates
+    typedef void (*vertical_function)(const int16_t* const* rows, const int16_t* weights, const int32_t* pairs,
+                                      size_t taps, uint8_t* out, size_t n);
+
+    struct separable_blur::kernels {
+        horizontal_function horizontal;
+        vertical_function vertical;
+        bool folded;    // pairs packs the weights 0 .. radius of a symmetric kernel instead of all of them
+    };
+
+    namespace {
+        const int INTERMEDIATE_SHIFT = separable_blur::WEIGHT_BITS - separable_blur::INTERMEDIATE_BITS;
+        const int OUTPUT_SHIFT = separable_blur::WEIGHT_BITS + separable_blur::INTERMEDIATE_BITS;
+
+        /// Kernel sizes with unrolled kernels of their own
+        const size_t SPECIALIZED_SIZES[] = {3, 5, 7, 9, 11, 15};
+
+        /// Samples [begin, end) of an output row
+        void vertical_range(const int16_t* const* rows, const int16_t* weights, size_t taps, uint8_t* out,
+                            size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                int32_t acc = 0;
+                for (size_t k = 0; k < taps; ++k) {
+                    acc += weights[k] * rows[k][i];
+                }
+                out[i] = (uint8_t) ((acc + (1 << (OUTPUT_SHIFT - 1))) >> OUTPUT_SHIFT);
+            }
+        }
+
+        void horizontal_scalar(const uint8_t* padded, size_t pixel_size, const int16_t* weights, const int32_t*,
+                               size_t taps, int16_t* out, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                int32_t acc = 0;
+                for (size_t k = 0; k < taps; ++k) {
+                    acc += weights[k] * padded[i + k * pixel_size];
+                }
+                out[i] = (int16_t) ((acc + (1 << (INTERMEDIATE_SHIFT - 1))) >> INTERMEDIATE_SHIFT);
+            }
+        }
+
+        void vertical_scalar(const int16_t* const* rows, const int16_t* weights, const int32_t*, size_t taps,
+                             uint8_t* out, size_t n) {
+            vertical_range(rows, weights, taps, out, 0, n);
+        }
+
+        /// The kernels of a symmetric kernel of Taps weights: the loops over the taps have a constant trip count
+        /// and unroll completely, and taps k and Taps - 1 - k are added before their shared weight multiplies
+        /// them, which halves the multiplications. Integer sums are exact, so they compute the same values as
+        /// the generic kernels.
+        template<size_t Taps>
+        void horizontal_symmetric_range(const uint8_t* padded, size_t pixel_size, const int16_t* weights,
+                                        int16_t* out, size_t begin, size_t end) {
+            constexpr size_t r = Taps / 2;
+            for (size_t i = begin; i < end; ++i) {
+                int32_t acc = weights[r] * padded[i + r * pixel_size];
+#pragma GCC unroll 8
+                for (size_t k = 0; k < r; ++k) {
+                    acc += weights[k] * (padded[i + k * pixel_size] + padded[i + (Taps - 1 - k) * pixel_size]);
+                }
+                out[i] = (int16_t) ((acc + (1 << (INTERMEDIATE_SHIFT - 1))) >> INTERMEDIATE_SHIFT);
+            }
+        }
+
+        template<size_t Taps>
+        void vertical_symmetric_range(const int16_t* const* rows, const int16_t* weights, uint8_t* out,
+                                      size_t begin, size_t end) {
+            constexpr size_t r = Taps / 2;
+            for (size_t i = begin; i < end; ++i) {
+                int32_t acc = weights[r] * rows[r][i];
+#pragma GCC unroll 8
+                for (size_t k = 0; k < r; ++k) {
+                    acc += weights[k] * (rows[k][i] + rows[Taps - 1 - k][i]);
+                }
+                out[i] = (uint8_t) ((acc + (1 << (OUTPUT_SHIFT - 1))) >> OUTPUT_SHIFT);
+            }
+        }
+
+        template<size_t Taps>
+        void horizontal_symmetric_scalar(const uint8_t* padded, size_t pixel_size, const int16_t* weights,
+                                         const int32_t*, size_t, int16_t* out, size_t n) {
+            horizontal_symmetric_range<Taps>(padded, pixel_size, weights, out, 0, n);
+        }
+
+        template<size_t Taps>
+        void vertical_symmetric_scalar(const int16_t* const* rows, const int16_t* weights, const int32_t*, size_t,
+                                       uint8_t* out, size_t n) {
+            vertical_symmetric_range<Taps>(rows, weights, out, 0, n);
+        }
+
+#ifdef BLUR_X86
+        /// Taps 2j and 2j + 1 of 16 samples are interleaved and multiplied by their packed weights with one
+        /// pmaddwd per half. The unpack and the final pack both work within 128-bit lanes, so the samples come
+        /// out in order.
+        __attribute__((target("avx2")))
+        void horizontal_avx2(const uint8_t* padded, size_t pixel_size, const int16_t* weights, const int32_t* pairs,
+                             size_t taps, int16_t* out, size_t n) {
+            const __m256i round = _mm256_set1_epi32(1 << (INTERMEDIATE_SHIFT - 1));
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16) {
+                __m256i low = round;
+                __m256i high = round;
+                const uint8_t* tap = padded + i;
+                for (size_t k = 0; k < taps; k += 2, tap += 2 * pixel_size) {
+                    __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tap)));
+                    __m256i b = k + 1 < taps
+                                ? _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tap + pixel_size)))
+                                : _mm256_setzero_si256();
+                    __m256i w = _mm256_set1_epi32(pairs[k / 2]);
+                    low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+                    high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+                }
+                low = _mm256_srai_epi32(low, INTERMEDIATE_SHIFT);
+                high = _mm256_srai_epi32(high, INTERMEDIATE_SHIFT);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_packus_epi32(low, high));
+            }
+            horizontal_scalar(padded + i, pixel_size, weights, pairs, taps, out + i, n - i);
+        }
+
+        __attribute__((target("avx2")))
+        void vertical_avx2(const int16_t* const* rows, const int16_t* weights, const int32_t* pairs, size_t taps,
+                           uint8_t* out, size_t n) {
+            const __m256i round = _mm256_set1_epi32(1 << (OUTPUT_SHIFT - 1));
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16) {
+                __m256i low = round;
+                __m256i high = round;
+                for (size_t k = 0; k < taps; k += 2) {
+                    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k] + i));
+                    __m256i b = k + 1 < taps
+                                ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k + 1] + i))
+                                : _mm256_setzero_si256();
+                    __m256i w = _mm256_set1_epi32(pairs[k / 2]);
+                    low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+                    high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+                }
+                low = _mm256_srai_epi32(low, OUTPUT_SHIFT);
+                high = _mm256_srai_epi32(high, OUTPUT_SHIFT);
+                __m256i words = _mm256_packus_epi32(low, high);
+                __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), bytes);
+            }
+            vertical_range(rows, weights, taps, out, i, n);
+        }
+
+        /// Folded sums of symmetric taps fit 16 bits: at most 2 * 255 horizontally, and 2 * 255 << 6 vertically
+        /// with 6 fractional bits. Sum j of the radius + 1 folded sums (the last one is the centre tap alone) is
+        /// paired with sum j + 1 for pmaddwd, as the taps of the generic kernels are.
+        template<size_t Taps>
+        __attribute__((target("avx2")))
+        void horizontal_symmetric_avx2(const uint8_t* padded, size_t pixel_size, const int16_t* weights,
+                                       const int32_t* pairs, size_t, int16_t* out, size_t n) {
+            constexpr size_t r = Taps / 2;
+            const __m256i round = _mm256_set1_epi32(1 << (INTERMEDIATE_SHIFT - 1));
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16) {
+                const uint8_t* tap = padded + i;
+                __m256i folded[r + 2];
+#pragma GCC unroll 8
+                for (size_t k = 0; k < r; ++k) {
+                    folded[k] = _mm256_add_epi16(
+                            _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tap + k * pixel_size))),
+                            _mm256_cvtepu8_epi16(_mm_loadu_si128(
+                                    reinterpret_cast<const __m128i*>(tap + (Taps - 1 - k) * pixel_size))));
+                }
+                folded[r] = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tap + r * pixel_size)));
+                folded[r + 1] = _mm256_setzero_si256();
+                __m256i low = round;
+                __m256i high = round;
+#pragma GCC unroll 8
+                for (size_t j = 0; j <= r; j += 2) {
+                    __m256i w = _mm256_set1_epi32(pairs[j / 2]);
+                    low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(folded[j], folded[j + 1]), w));
+                    high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(folded[j], folded[j + 1]), w));
+                }
+                low = _mm256_srai_epi32(low, INTERMEDIATE_SHIFT);
+                high = _mm256_srai_epi32(high, INTERMEDIATE_SHIFT);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_packus_epi32(low, high));
+            }
+            horizontal_symmetric_range<Taps>(padded, pixel_size, weights, out, i, n);
+        }
+
+        template<size_t Taps>
+        __attribute__((target("avx2")))
+        void vertical_symmetric_avx2(const int16_t* const* rows, const int16_t* weights, const int32_t* pairs, size_t,
+                                     uint8_t* out, size_t n) {
+            constexpr size_t r = Taps / 2;
+            const __m256i round = _mm256_set1_epi32(1 << (OUTPUT_SHIFT - 1));
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16) {
+                __m256i folded[r + 2];
+#pragma GCC unroll 8
+                for (size_t k = 0; k < r; ++k) {
+                    folded[k] = _mm256_add_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k] + i)),
+                                                 _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[Taps - 1 - k] + i)));
+                }
+                folded[r] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[r] + i));
+                folded[r + 1] = _mm256_setzero_si256();
+                __m256i low = round;
+                __m256i high = round;
+#pragma GCC unroll 8
+                for (size_t j = 0; j <= r; j += 2) {
+                    __m256i w = _mm256_set1_epi32(pairs[j / 2]);
+                    low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(folded[j], folded[j + 1]), w));
+                    high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(folded[j], folded[j + 1]), w));
+                }
+                low = _mm256_srai_epi32(low, OUTPUT_SHIFT);
+                high = _mm256_srai_epi32(high, OUTPUT_SHIFT);
+                __m256i words = _mm256_packus_epi32(low, high);
+                __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), bytes);
+            }
+            vertical_symmetric_range<Taps>(rows, weights, out, i, n);
+        }
+#endif
+
+        bool has_avx2() {
+#ifdef BLUR_X86
+            static const bool supported = []() {
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx2") != 0;
+            }();
+            return supported;
+#else
+            return false;
+#endif
+        }
+
+        const separable_blur::kernels* generic_kernels() {
+#ifdef BLUR_X86
+            static const separable_blur::kernels avx2{horizontal_avx2, vertical_avx2, false};
+            if (has_avx2()) {
+                return &avx2;
+            }
+#endif
+            static const separable_blur::kernels scalar{horizontal_scalar, vertical_scalar, false};
+            return &scalar;
+        }
+
+        template<size_t Taps>
+        const separable_blur::kernels* symmetric_kernels() {
+#ifdef BLUR_X86
+            static const separable_blur::kernels avx2{horizontal_symmetric_avx2<Taps>, vertical_symmetric_avx2<Taps>,
+                                                      true};
+            if (has_avx2()) {
+                return &avx2;
+            }
+#endif
+            static const separable_blur::kernels scalar{horizontal_symmetric_scalar<Taps>,
+                                                        vertical_symmetric_scalar<Taps>, true};
+            return &scalar;
+        }
+
+        /// The unrolled kernels of a symmetric kernel of taps weights, nullptr for other sizes
+        const separable_blur::kernels* specialized_kernels(size_t taps) {
+            switch (taps) {
+                case 3: return symmetric_kernels<3>();
+                case 5: return symmetric_kernels<5>();
+                case 7: return symmetric_kernels<7>();
+                case 9: return symmetric_kernels<9>();
+                case 11: return symmetric_kernels<11>();
+                case 15: return symmetric_kernels<15>();
+                default: return nullptr;
+            }
+        }
+
+        /// Lines the recursive blur runs on at once, one float vector
+        const size_t LANES = 8;
+
+        /// Samples per strip of the vertical recursive pass, so that a strip of a few hundred rows stays in L2
+        const size_t STRIP = 64;
+
+        /// Runs the recursion forward, then backward, along length positions step floats apart; every position
+        /// holds count lanes, a multiple of LANES, each lane a line of its own. c holds the coefficients of
+        /// recursive_blur.
+        typedef void (*recursive_function)(float* data, size_t length, size_t step, size_t count, const float* c);
+
+        /// n samples of each of LANES rows into lines, sample i of row r at lines[i * LANES + r]
+        typedef void (*interleave_function)(const uint8_t* const* rows, float* lines, size_t n);
+
+        /// The reverse of interleave_function, rounded to bytes, for the first count rows only
+        typedef void (*deinterleave_function)(const float* lines, uint8_t* const* rows, size_t count, size_t n);
+
+        typedef void (*widen_function)(const uint8_t* in, float* out, size_t n);
+        typedef void (*narrow_function)(const float* in, uint8_t* out, size_t n);
+
+        struct recursive_kernels {
+            recursive_function run;
+            interleave_function interleave;
+            deinterleave_function deinterleave;
+            widen_function widen;
+            narrow_function narrow;
+        };
+
+        inline uint8_t to_byte(float value) {
+            return (uint8_t) std::min(std::max(value + 0.5f, 0.0f), 255.0f);
+        }
+
+        void recursive_scalar(float* data, size_t length, size_t step, size_t count, const float* c) {
+            const float b = c[0], a1 = c[1], a2 = c[2], a3 = c[3];
+            const float* m = c + 4;
+            for (size_t l = 0; l < count; ++l) {
+                float* line = data + l;
+                const float last = line[(length - 1) * step];
+                float p1 = line[0], p2 = line[0], p3 = line[0];
+                for (size_t n = 0; n < length; ++n) {
+                    float v = b * line[n * step] + a3 * p3 + a2 * p2 + a1 * p1;
+                    line[n * step] = v;
+                    p3 = p2;
+                    p2 = p1;
+                    p1 = v;
+                }
+                const float d1 = p1 - last, d2 = p2 - last, d3 = p3 - last;
+                p1 = last + (m[0] * d1 + m[1] * d2 + m[2] * d3);
+                p2 = last + (m[3] * d1 + m[4] * d2 + m[5] * d3);
+                p3 = last + (m[6] * d1 + m[7] * d2 + m[8] * d3);
+                line[(length - 1) * step] = p1;
+                for (size_t n = length - 1; n-- > 0;) {
+                    float v = b * line[n * step] + a3 * p3 + a2 * p2 + a1 * p1;
+                    line[n * step] = v;
+                    p3 = p2;
+                    p2 = p1;
+                    p1 = v;
+                }
+            }
+        }
+
+        void interleave_scalar(const uint8_t* const* rows, float* lines, size_t n) {
+            for (size_t r = 0; r < LANES; ++r) {
+                for (size_t i = 0; i < n; ++i) {
+                    lines[i * LANES + r] = rows[r][i];
+                }
+            }
+        }
+
+        void deinterleave_scalar(const float* lines, uint8_t* const* rows, size_t count, size_t n) {
+            for (size_t r = 0; r < count; ++r) {
+                for (size_t i = 0; i < n; ++i) {
+                    rows[r][i] = to_byte(lines[i * LANES + r]);
+                }
+            }
+        }
+
+        void widen_scalar(const uint8_t* in, float* out, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = in[i];
+            }
+        }
+
+        void narrow_scalar(const float* in, uint8_t* out, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = to_byte(in[i]);
+            }
+        }
+
+#ifdef BLUR_X86
+        /// Blocks vectors of LANES lines side by side, so that as many independent recursions hide the latency
+        /// of each step. The operations of recursive_scalar in the same order, without fused multiply-adds, so
+        /// that both give the same floats.
+        template<size_t Blocks>
+        __attribute__((target("avx2")))
+        inline void recursive_blocks(float* line, size_t length, size_t step, const float* c) {
+            const __m256 b = _mm256_set1_ps(c[0]), a1 = _mm256_set1_ps(c[1]), a2 = _mm256_set1_ps(c[2]),
+                    a3 = _mm256_set1_ps(c[3]);
+            const size_t end = (length - 1) * step;
+            __m256 last[Blocks], p1[Blocks], p2[Blocks], p3[Blocks];
+#pragma GCC unroll 4
+            for (size_t j = 0; j < Blocks; ++j) {
+                last[j] = _mm256_loadu_ps(line + end + j * LANES);
+                p1[j] = p2[j] = p3[j] = _mm256_loadu_ps(line + j * LANES);
+            }
+            for (size_t n = 0; n <= end; n += step) {
+#pragma GCC unroll 4
+                for (size_t j = 0; j < Blocks; ++j) {
+                    __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+                            _mm256_mul_ps(b, _mm256_loadu_ps(line + n + j * LANES)), _mm256_mul_ps(a3, p3[j])),
+                            _mm256_mul_ps(a2, p2[j])), _mm256_mul_ps(a1, p1[j]));
+                    _mm256_storeu_ps(line + n + j * LANES, v);
+                    p3[j] = p2[j];
+                    p2[j] = p1[j];
+                    p1[j] = v;
+                }
+            }
+#pragma GCC unroll 4
+            for (size_t j = 0; j < Blocks; ++j) {
+                const __m256 d1 = _mm256_sub_ps(p1[j], last[j]), d2 = _mm256_sub_ps(p2[j], last[j]),
+                        d3 = _mm256_sub_ps(p3[j], last[j]);
+                __m256 q[3];
+                for (size_t k = 0; k < 3; ++k) {
+                    q[k] = _mm256_add_ps(last[j], _mm256_add_ps(_mm256_add_ps(
+                            _mm256_mul_ps(_mm256_set1_ps(c[4 + 3 * k]), d1),
+                            _mm256_mul_ps(_mm256_set1_ps(c[5 + 3 * k]), d2)),
+                            _mm256_mul_ps(_mm256_set1_ps(c[6 + 3 * k]), d3)));
+                }
+                p1[j] = q[0];
+                p2[j] = q[1];
+                p3[j] = q[2];
+                _mm256_storeu_ps(line + end + j * LANES, p1[j]);
+            }
+            for (size_t n = end; n > 0;) {
+                n -= step;
+#pragma GCC unroll 4
+                for (size_t j = 0; j < Blocks; ++j) {
+                    __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+                            _mm256_mul_ps(b, _mm256_loadu_ps(line + n + j * LANES)), _mm256_mul_ps(a3, p3[j])),
+                            _mm256_mul_ps(a2, p2[j])), _mm256_mul_ps(a1, p1[j]));
+                    _mm256_storeu_ps(line + n + j * LANES, v);
+                    p3[j] = p2[j];
+                    p2[j] = p1[j];
+                    p1[j] = v;
+                }
+            }
+        }
+
+        __attribute__((target("avx2")))
+        void recursive_avx2(float* data, size_t length, size_t step, size_t count, const float* c) {
+            size_t l = 0;
+            for (; l + 3 * LANES <= count; l += 3 * LANES) {
+                recursive_blocks<3>(data + l, length, step, c);
+            }
+            if (l + 2 * LANES <= count) {
+                recursive_blocks<2>(data + l, length, step, c);
+            } else if (l < count) {
+                recursive_blocks<1>(data + l, length, step, c);
+            }
+        }
+
+        /// Transposes 8 x 8 bytes, the low halves of in: out[k] holds column 2k, then column 2k + 1
+        __attribute__((target("avx2")))
+        inline void transpose_8x8(const __m128i* in, __m128i* out) {
+            const __m128i t0 = _mm_unpacklo_epi8(in[0], in[1]), t1 = _mm_unpacklo_epi8(in[2], in[3]),
+                    t2 = _mm_unpacklo_epi8(in[4], in[5]), t3 = _mm_unpacklo_epi8(in[6], in[7]);
+            const __m128i u0 = _mm_unpacklo_epi16(t0, t1), u1 = _mm_unpackhi_epi16(t0, t1),
+                    u2 = _mm_unpacklo_epi16(t2, t3), u3 = _mm_unpackhi_epi16(t2, t3);
+            out[0] = _mm_unpacklo_epi32(u0, u2);
+            out[1] = _mm_unpackhi_epi32(u0, u2);
+            out[2] = _mm_unpacklo_epi32(u1, u3);
+            out[3] = _mm_unpackhi_epi32(u1, u3);
+        }
+
+        /// 8 floats to bytes as to_byte does, in the low 8 bytes
+        __attribute__((target("avx2")))
+        inline __m128i to_bytes(__m256 value) {
+            value = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(value, _mm256_set1_ps(0.5f)), _mm256_setzero_ps()),
+                                  _mm256_set1_ps(255.0f));
+            const __m256i words = _mm256_cvttps_epi32(value);
+            const __m128i shorts = _mm_packus_epi32(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+            return _mm_packus_epi16(shorts, shorts);
+        }
+
+        __attribute__((target("avx2")))
+        void interleave_avx2(const uint8_t* const* rows, float* lines, size_t n) {
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                __m128i in[8], out[4];
+                for (size_t r = 0; r < LANES; ++r) {
+                    in[r] = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(rows[r] + i));
+                }
+                transpose_8x8(in, out);
+                float* line = lines + i * LANES;
+                for (size_t k = 0; k < 4; ++k) {
+                    _mm256_storeu_ps(line + 2 * k * LANES, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(out[k])));
+                    _mm256_storeu_ps(line + (2 * k + 1) * LANES,
+                                     _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(out[k], 8))));
+                }
+            }
+            for (; i < n; ++i) {
+                for (size_t r = 0; r < LANES; ++r) {
+                    lines[i * LANES + r] = rows[r][i];
+                }
+            }
+        }
+
+        __attribute__((target("avx2")))
+        void deinterleave_avx2(const float* lines, uint8_t* const* rows, size_t count, size_t n) {
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                __m128i in[8], out[4];
+                for (size_t k = 0; k < 8; ++k) {
+                    in[k] = to_bytes(_mm256_loadu_ps(lines + (i + k) * LANES));
+                }
+                transpose_8x8(in, out);
+                alignas(16) uint8_t bytes[LANES][8];
+                for (size_t k = 0; k < 4; ++k) {
+                    _mm_store_si128(reinterpret_cast<__m128i*>(bytes[2 * k]), out[k]);
+                }
+                for (size_t r = 0; r < count; ++r) {
+                    std::memcpy(rows[r] + i, bytes[r], 8);
+                }
+            }
+            for (; i < n; ++i) {
+                for (size_t r = 0; r < count; ++r) {
+                    rows[r][i] = to_byte(lines[i * LANES + r]);
+                }
+            }
+        }
+
+        __attribute__((target("avx2")))
+        void widen_avx2(const uint8_t* in, float* out, size_t n) {
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i));
+                _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes)));
+            }
+            for (; i < n; ++i) {
+                out[i] = in[i];
+            }
+        }
+
+        __attribute__((target("avx2")))
+        void narrow_avx2(const float* in, uint8_t* out, size_t n) {
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), to_bytes(_mm256_loadu_ps(in + i)));
+            }
+            for (; i < n; ++i) {
+                out[i] = to_byte(in[i]);
+            }
+        }
+#endif
+
+        recursive_kernels select_recursive() {
+#ifdef BLUR_X86
+            if (has_avx2()) {
+                return {recursive_avx2, interleave_avx2, deinterleave_avx2, widen_avx2, narrow_avx2};
+            }
+#endif
+            return {recursive_scalar, interleave_scalar, deinterleave_scalar, widen_scalar, narrow_scalar};
+        }
+
+        /// Rounded means of box sums: the wide multiplier is exact for any sum, the 16-bit one only where
+        /// box_blur found one
+        struct box_divisor {
+            uint32_t half;
+            uint64_t wide_multiplier;
+            uint16_t multiplier;
+            int shift;
+
+            inline uint8_t operator()(uint32_t sum) const {
+                return (uint8_t) ((sum + half) * wide_multiplier >> box_blur::WIDE_SHIFT);
+            }
+        };
+
+        /// prefix[j + pixel_size] is the sum of the samples of the channel of j up to padded[j], in Sum, which may
+        /// wrap: a window of the sum of at most 255 * MAX_LENGTH still comes out exact as a difference
+        template<typename Sum>
+        void box_prefix(const uint8_t* padded, size_t n, size_t pixel_size, Sum* prefix) {
+            std::fill(prefix, prefix + pixel_size, 0);
+            for (size_t j = 0; j < n; ++j) {
+                prefix[j + pixel_size] = (Sum) (prefix[j] + padded[j]);
+            }
+        }
+
+        /// box_prefix for PixelSize channels: the running sums stay in registers instead of going through the
+        /// prefix, whose stores the next pixel would wait for
+        template<typename Sum, size_t PixelSize>
+        void box_prefix_fixed(const uint8_t* padded, size_t n, size_t, Sum* prefix) {
+            Sum total[PixelSize] = {};
+            std::fill(prefix, prefix + PixelSize, 0);
+            prefix += PixelSize;
+            for (size_t j = 0; j < n; j += PixelSize) {
+#pragma GCC unroll 4
+                for (size_t c = 0; c < PixelSize; ++c) {
+                    total[c] = (Sum) (total[c] + padded[j + c]);
+                    prefix[j + c] = total[c];
+                }
+            }
+        }
+
+        template<typename Sum>
+        using box_prefix_function = void (*)(const uint8_t* padded, size_t n, size_t pixel_size, Sum* prefix);
+
+        template<typename Sum>
+        box_prefix_function<Sum> select_prefix(size_t pixel_size) {
+            switch (pixel_size) {
+                case 1: return box_prefix_fixed<Sum, 1>;
+                case 3: return box_prefix_fixed<Sum, 3>;
+                case 4: return box_prefix_fixed<Sum, 4>;
+                default: return box_prefix<Sum>;
+            }
+        }
+
+        /// n horizontal means, the window of sample i being prefix[i + span] - prefix[i]
+        template<typename Sum>
+        using box_window_function = void (*)(const Sum* prefix, size_t span, uint8_t* out, size_t n,
+                                             const box_divisor& divide);
+
+        /// n means of the column sums, then moves the sums a row down: adds the row entering the window and
+        /// subtracts the one leaving it
+        template<typename Sum>
+        using box_vertical_function = void (*)(Sum* sums, const uint8_t* add, const uint8_t* del, uint8_t* out,
+                                               size_t n, const box_divisor& divide);
+
+        template<typename Sum>
+        struct box_kernels {
+            box_window_function<Sum> window;
+            box_vertical_function<Sum> vertical;
+        };
+
+        template<typename Sum>
+        void box_window_scalar(const Sum* prefix, size_t span, uint8_t* out, size_t n, const box_divisor& divide) {
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = divide((Sum) (prefix[i + span] - prefix[i]));
+            }
+        }
+
+        template<typename Sum>
+        void box_vertical_scalar(Sum* sums, const uint8_t* add, const uint8_t* del, uint8_t* out, size_t n,
+                                 const box_divisor& divide) {
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = divide(sums[i]);
+                sums[i] = (Sum) (sums[i] + add[i] - del[i]);
+            }
+        }
+
+#ifdef BLUR_X86
+        /// 16 rounded means in bytes
+        __attribute__((target("avx2")))
+        inline __m128i box_divide(__m256i sums, const box_divisor& divide) {
+            __m256i means = _mm256_mulhi_epu16(_mm256_add_epi16(sums, _mm256_set1_epi16((int16_t) divide.half)),
+                                               _mm256_set1_epi16((int16_t) divide.multiplier));
+            means = _mm256_srl_epi16(means, _mm_cvtsi32_si128(divide.shift - 16));
+            return _mm_packus_epi16(_mm256_castsi256_si128(means), _mm256_extracti128_si256(means, 1));
+        }
+
+        __attribute__((target("avx2")))
+        void box_window_avx2(const uint16_t* prefix, size_t span, uint8_t* out, size_t n, const box_divisor& divide) {
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16) {
+                __m256i sums = _mm256_sub_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(prefix + i + span)),
+                                                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prefix + i)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), box_divide(sums, divide));
+            }
+            for (; i < n; ++i) {
+                out[i] = divide((uint16_t) (prefix[i + span] - prefix[i]));
+            }
+        }
+
+        __attribute__((target("avx2")))
+        void box_vertical_avx2(uint16_t* sums, const uint8_t* add, const uint8_t* del, uint8_t* out, size_t n,
+                               const box_divisor& divide) {
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16) {
+                __m256i column = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sums + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), box_divide(column, divide));
+                column = _mm256_sub_epi16(column, _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(del + i))));
+                column = _mm256_add_epi16(column, _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(add + i))));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(sums + i), column);
+            }
+            for (; i < n; ++i) {
+                out[i] = divide(sums[i]);
+                sums[i] = (uint16_t) (sums[i] + add[i] - del[i]);
+            }
+        }
+#endif
+
+        /// Working memory of the box blurs of one thread in Sum, kept between calls
+        template<typename Sum>
+        struct box_scratch {
+            std::vector<uint8_t> padded;
+            std::vector<Sum> prefix;
+            std::vector<Sum> sums;
+            std::vector<uint8_t> ring;
+
+            static box_scratch& thread() {
+                thread_local box_scratch scratch;
+                return scratch;
+            }
+        };
+
+        /// The sweep of box_blur::apply, in sums of type Sum
+        template<typename Sum>
+        void box_sweep(const box_kernels<Sum>& run, const box_divisor& divide, size_t length, uint8_t* data,
+                       size_t width, size_t height, size_t stride, size_t pixel_size) {
+            auto& scratch = box_scratch<Sum>::thread();
+            const size_t r = length / 2;
+            const size_t row_bytes = width * pixel_size;
+            const size_t border = r * pixel_size;
+            const size_t padded_bytes = row_bytes + 2 * border;
+            // rows y - r .. y + r + 1 are in the ring while output row y is written; short images fit whole
+            const size_t slots = std::min(2 * r + 2, height);
+            const size_t ring_stride = (row_bytes + 31) / 32 * 32;
+
+            scratch.padded.resize(padded_bytes);
+            scratch.prefix.resize(padded_bytes + pixel_size);
+            scratch.sums.resize(row_bytes);
+            scratch.ring.resize(slots * ring_stride);
+            uint8_t* padded = scratch.padded.data();
+            Sum* prefix = scratch.prefix.data();
+            Sum* sums = scratch.sums.data();
+            uint8_t* ring = scratch.ring.data();
+            const auto prefix_row = select_prefix<Sum>(pixel_size);
+
+            auto filter_row = [&](size_t s) {
+                const uint8_t* row = data + s * stride;
+                std::memcpy(padded + border, row, row_bytes);
+                for (size_t p = 0; p < r; ++p) {
+                    std::memcpy(padded + p * pixel_size, row, pixel_size);
+                    std::memcpy(padded + border + row_bytes + p * pixel_size, row + row_bytes - pixel_size, pixel_size);
+                }
+                prefix_row(padded, padded_bytes, pixel_size, prefix);
+                run.window(prefix, length * pixel_size, ring + (s % slots) * ring_stride, row_bytes, divide);
+            };
+            auto filtered = [&](long s) {
+                return ring + ((size_t) std::clamp(s, 0l, (long) height - 1) % slots) * ring_stride;
+            };
+
+            const size_t first = std::min(r + 1, height - 1);
+            for (size_t s = 0; s <= first; ++s) {
+                filter_row(s);
+            }
+            std::fill(sums, sums + row_bytes, 0);
+            for (long k = -(long) r; k <= (long) r; ++k) {
+                const uint8_t* row = filtered(k);
+                for (size_t i = 0; i < row_bytes; ++i) {
+                    sums[i] = (Sum) (sums[i] + row[i]);
+                }
+            }
+            for (size_t y = 0; y < height; ++y) {
+                if (y + r + 1 > first && y + r + 1 < height) {
+                    filter_row(y + r + 1);
+                }
+                run.vertical(sums, filtered((long) (y + r + 1)), filtered((long) y - (long) r), data + y * stride,
+                             row_bytes, divide);
+            }
+        }
+
+        /// Working memory of the blurs of one thread, kept between calls
+        struct blur_scratch {
+            std::vector<uint8_t> padded;
+            std::vector<int16_t> ring;
+            std::vector<const int16_t*> taps;
+            std::vector<float> lines;
+
+            static blur_scratch& thread() {
+                thread_local blur_scratch scratch;
+                return scratch;
+            }
+        };
+    }
+
+    separable_blur::separable_blur(const std::vector<double>& kernel, bool specialize) {
+        if (kernel.size() % 2 == 0) {
+            throw std::invalid_argument("A blur kernel needs an odd number of weights");
+        }
+        double sum = 0;
+        for (auto w : kernel) {
+            if (w < 0) {
+                throw std::invalid_argument("A blur kernel cannot have negative weights");
+            }
+            sum += w;
+        }
+        // rounding error goes to the centre, so that a flat image stays exactly flat
+        const int one = 1 << WEIGHT_BITS;
+        int total = 0;
+        weights.resize(kernel.size());
+        for (size_t k = 0; k < kernel.size(); ++k) {
+            weights[k] = (int16_t) std::lround(kernel[k] / sum * one);
+            total += weights[k];
+        }
+        weights[kernel.size() / 2] = (int16_t) (weights[kernel.size() / 2] + one - total);
+
+        run = generic_kernels();
+        if (specialize && std::equal(weights.begin(), weights.begin() + (long) radius(), weights.rbegin())) {
+            if (auto unrolled = specialized_kernels(weights.size())) {
+                run = unrolled;
+            }
+        }
+
+        const size_t packed = run->folded ? radius() + 1 : weights.size();
+        for (size_t k = 0; k < packed; k += 2) {
+            uint16_t first = (uint16_t) weights[k];
+            uint16_t second = k + 1 < packed ? (uint16_t) weights[k + 1] : 0;
+            weight_pairs.push_back((int32_t) ((uint32_t) second << 16 | first));
+        }
+    }
+
+    size_t separable_blur::specialized_size(size_t n) {
+        if (n < SPECIALIZED_SIZES[0] || n > std::end(SPECIALIZED_SIZES)[-1]) {
+            return n;
+        }
+        // ties go to the larger size, which cuts less of the tails
+        size_t nearest = SPECIALIZED_SIZES[0];
+        for (auto size : SPECIALIZED_SIZES) {
+            if (std::labs((long) size - (long) n) <= std::labs((long) nearest - (long) n)) {
+                nearest = size;
+            }
+        }
+        return nearest;
+    }
+
+    bool separable_blur::specialized() const {
+        return run->folded;
+    }
+
+    void separable_blur::apply(uint8_t* data, size_t width, size_t height, size_t stride, size_t pixel_size) const {
+        if (width == 0 || height == 0) {
+            return;
+        }
+        auto& scratch = blur_scratch::thread();
+        const size_t r = radius();
+        const size_t taps = weights.size();
+        const size_t row_bytes = width * pixel_size;
+        const size_t border = r * pixel_size;
+        const size_t ring_stride = (row_bytes + 15) / 16 * 16;
+
+        scratch.padded.resize(row_bytes + 2 * border);
+        scratch.ring.resize(taps * ring_stride);
+        scratch.taps.resize(taps);
+        uint8_t* padded = scratch.padded.data();
+        int16_t* ring = scratch.ring.data();
+
+        // source row s lives in ring slot s % taps until row s + taps replaces it
+        auto filter_row = [&](size_t s) {
+            const uint8_t* row = data + s * stride;
+            std::memcpy(padded + border, row, row_bytes);
+            for (size_t p = 0; p < r; ++p) {
+                std::memcpy(padded + p * pixel_size, row, pixel_size);
+                std::memcpy(padded + border + row_bytes + p * pixel_size, row + row_bytes - pixel_size, pixel_size);
+            }
+            run->horizontal(padded, pixel_size, weights.data(), weight_pairs.data(), taps,
+                            ring + (s % taps) * ring_stride, row_bytes);
+        };
+
+        for (size_t s = 0; s <= r && s < height; ++s) {
+            filter_row(s);
+        }
+        for (size_t y = 0; y < height; ++y) {
+            if (y > 0 && y + r < height) {
+                filter_row(y + r);
+            }
+            for (size_t k = 0; k < taps; ++k) {
+                long s = std::clamp((long) y - (long) r + (long) k, 0l, (long) height - 1);
+                scratch.taps[k] = ring + ((size_t) s % taps) * ring_stride;
+            }
+            run->vertical(scratch.taps.data(), weights.data(), weight_pairs.data(), taps, data + y * stride, row_bytes);
+        }
+    }
+
+    recursive_blur::recursive_blur(double sigma): deviation(sigma), coefficients{} {
+        if (!(sigma >= MIN_SIGMA)) {
+            throw std::invalid_argument("A recursive blur needs a sigma of at least 0.5");
+        }
+        // Young and van Vliet, "Recursive implementation of the Gaussian filter", 1995
+        const double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma);
+        const double q2 = q * q, q3 = q2 * q;
+        const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+        const double a1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+        const double a2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+        const double a3 = 0.422205 * q3 / b0;
+        const double b = 1 - (a1 + a2 + a3);
+
+        // Triggs and Sdika, "Boundary conditions for Young - van Vliet recursive filtering", 2006: the backward
+        // pass starts from last + b * M * (w[n - 1] - last, w[n - 2] - last, w[n - 3] - last)
+        const double scale = b / ((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3) * (1 + a2 + (a1 - a3) * a3));
+        const double m[9] = {
+                -a3 * a1 + 1 - a3 * a3 - a2, (a3 + a1) * (a2 + a3 * a1), a3 * (a1 + a3 * a2),
+                a1 + a3 * a2, -(a2 - 1) * (a2 + a3 * a1), -a3 * (a3 * a1 + a3 * a3 + a2 - 1),
+                a3 * a1 + a2 + a1 * a1 - a2 * a2, a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3,
+                a3 * (a1 + a3 * a2)
+        };
+        coefficients[0] = (float) b;
+        coefficients[1] = (float) a1;
+        coefficients[2] = (float) a2;
+        coefficients[3] = (float) a3;
+        for (size_t k = 0; k < 9; ++k) {
+            coefficients[4 + k] = (float) (scale * m[k]);
+        }
+    }
+
+    void recursive_blur::apply(uint8_t* data, size_t width, size_t height, size_t stride, size_t pixel_size) const {
+        if (width == 0 || height == 0) {
+            return;
+        }
+        static const recursive_kernels run = select_recursive();
+        auto& scratch = blur_scratch::thread();
+        const size_t row_bytes = width * pixel_size;
+        scratch.lines.resize(std::max(row_bytes * LANES, height * STRIP));
+        float* lines = scratch.lines.data();
+        const float* c = coefficients.data();
+
+        // rows y0 .. y0 + 7 side by side, the last row repeated past the bottom: a pixel holds pixel_size * LANES
+        // lanes, the channels of 8 rows
+        for (size_t y0 = 0; y0 < height; y0 += LANES) {
+            const size_t count = std::min(LANES, height - y0);
+            uint8_t* rows[LANES];
+            for (size_t r = 0; r < LANES; ++r) {
+                rows[r] = data + (y0 + std::min(r, count - 1)) * stride;
+            }
+            run.interleave(rows, lines, row_bytes);
+            run.run(lines, width, pixel_size * LANES, pixel_size * LANES, c);
+            run.deinterleave(lines, rows, count, row_bytes);
+        }
+
+        // strips of columns: sample x0 + i of row y at lines[y * STRIP + i]
+        for (size_t x0 = 0; x0 < row_bytes; x0 += STRIP) {
+            const size_t n = std::min(STRIP, row_bytes - x0);
+            for (size_t y = 0; y < height; ++y) {
+                run.widen(data + y * stride + x0, lines + y * STRIP, n);
+            }
+            run.run(lines, height, STRIP, (n + LANES - 1) / LANES * LANES, c);
+            for (size_t y = 0; y < height; ++y) {
+                run.narrow(lines + y * STRIP, data + y * stride + x0, n);
+            }
+        }
+    }
+
+    box_blur::box_blur(size_t length): length(length), multiplier(0), shift(0), wide_multiplier(0) {
+        if (length % 2 == 0 || length > MAX_LENGTH) {
+            throw std::invalid_argument("A box blur needs an odd length of at most 65535");
+        }
+        // ceil(2^k / length) is exact for sums up to n when its excess times n stays below 2^k
+        const uint64_t largest = 255 * (uint64_t) length + length / 2;
+        wide_multiplier = ((1ull << WIDE_SHIFT) + length - 1) / length;
+        if (largest < (1u << 16)) {
+            for (int k = 16; k < 32; ++k) {
+                const uint64_t m = ((1ull << k) + length - 1) / length;
+                if (m > UINT16_MAX) {
+                    break;
+                }
+                if ((m * length - (1ull << k)) * largest < (1ull << k)) {
+                    multiplier = (uint16_t) m;
+                    shift = k;
+                    break;
+                }
+            }
+        }
+    }
+
+    void box_blur::apply(uint8_t* data, size_t width, size_t height, size_t stride, size_t pixel_size) const {
+        if (width == 0 || height == 0 || length == 1) {
+            return;
+        }
+        const box_divisor divide{(uint32_t) (length / 2), wide_multiplier, multiplier, shift};
+        if (multiplier != 0) {
+#ifdef BLUR_X86
+            static const box_kernels<uint16_t> avx2{box_window_avx2, box_vertical_avx2};
+            if (has_avx2()) {
+                box_sweep(avx2, divide, length, data, width, height, stride, pixel_size);
+                return;
+            }
+#endif
+            static const box_kernels<uint16_t> narrow{box_window_scalar<uint16_t>, box_vertical_scalar<uint16_t>};
+            box_sweep(narrow, divide, length, data, width, height, stride, pixel_size);
+        } else {
+            static const box_kernels<uint32_t> wide{box_window_scalar<uint32_t>, box_vertical_scalar<uint32_t>};
+            box_sweep(wide, divide, length, data, width, height, stride, pixel_size);
+        }
+    }
+}
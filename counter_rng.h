@@ -0,0 +1,127 @@
+#ifndef LIB_COUNTER_RNG_H
+#define LIB_COUNTER_RNG_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace augmentorLib {
+
+    /// Philox4x32-10 block function
+    ///
+    /// Counter based generator from Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3" (SC11). Output
+    /// block i of a stream is a pure function of (key, counter i), so any draw of any stream can be computed
+    /// directly, in any order and on any thread. The rounds are a few 32x32->64 multiplies with no state, which
+    /// compilers can unroll and vectorize across counters.
+    struct philox4x32 {
+        typedef std::array<uint32_t, 4> counter_type;
+        typedef std::array<uint32_t, 2> key_type;
+
+        static counter_type generate(counter_type counter, key_type key) {
+            const uint32_t M0 = 0xD2511F53;
+            const uint32_t M1 = 0xCD9E8D57;
+            const uint32_t W0 = 0x9E3779B9;
+            const uint32_t W1 = 0xBB67AE85;
+
+            for (int round = 0; round < 10; ++round) {
+                uint64_t p0 = (uint64_t) M0 * counter[0];
+                uint64_t p1 = (uint64_t) M1 * counter[2];
+                counter = {
+                        (uint32_t) (p1 >> 32) ^ counter[1] ^ key[0],
+                        (uint32_t) p1,
+                        (uint32_t) (p0 >> 32) ^ counter[3] ^ key[1],
+                        (uint32_t) p0
+                };
+                key[0] += W0;
+                key[1] += W1;
+            }
+            return counter;
+        }
+    };
+
+    /// A reproducible stream of random numbers identified by (seed, sample, stream)
+    ///
+    /// The stream is keyed by the global seed; the counter holds the sample index, the stream id (one or more per
+    /// operation of the chain) and the index of the block inside the stream. Two generators with the same triple
+    /// produce the same numbers regardless of which thread runs them or what ran before.
+    class CounterGenerator {
+    private:
+        philox4x32::key_type key;
+        philox4x32::counter_type counter;
+        philox4x32::counter_type block;
+        unsigned used;
+
+        void refill() {
+            block = philox4x32::generate(counter, key);
+            ++counter[0];
+            used = 0;
+        }
+
+        /// Seed and stream for generators that are never bound to a sample: a seed of 0 means current time, and
+        /// every instance gets its own stream so generators created in the same tick still differ
+        static uint64_t init_seed(uint64_t seed) {
+            if (seed == 0) {
+                return std::chrono::system_clock::now().time_since_epoch().count();
+            }
+            return seed;
+        }
+
+        static uint32_t next_instance() {
+            static std::atomic<uint32_t> instances{0};
+            return instances++;
+        }
+
+    public:
+        /// \param seed global seed, 0 uses the current time
+        explicit CounterGenerator(uint64_t seed = 0) {
+            reset(init_seed(seed), 0, next_instance());
+        }
+
+        CounterGenerator(uint64_t seed, uint64_t sample, uint32_t stream) {
+            reset(seed, sample, stream);
+        }
+
+        /// Jump to the start of the stream (seed, sample, stream)
+        void reset(uint64_t seed, uint64_t sample, uint32_t stream) {
+            key = {(uint32_t) seed, (uint32_t) (seed >> 32)};
+            counter = {0, stream, (uint32_t) sample, (uint32_t) (sample >> 32)};
+            used = 4;
+        }
+
+        inline uint32_t next_u32() {
+            if (used == 4) {
+                refill();
+            }
+            return block[used++];
+        }
+
+        /// \return a uniform number in [0, 1)
+        inline double uniform() {
+            uint64_t high = next_u32();
+            uint64_t bits = (high << 32) | next_u32();
+            return (bits >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+        /// \return a uniform integer in [0, n)
+        inline uint64_t uniform_index(uint64_t n) {
+            return ((uint64_t) next_u32() * n) >> 32;
+        }
+
+        /// Fill n bytes with random values, a whole 16 byte block per generate call
+        void fill(uint8_t* out, size_t n) {
+            while (n > 0) {
+                refill();
+                size_t k = n < sizeof(block) ? n : sizeof(block);
+                std::memcpy(out, block.data(), k);
+                out += k;
+                n -= k;
+            }
+            used = 4;
+        }
+    };
+}
+
+#endif //LIB_COUNTER_RNG_H
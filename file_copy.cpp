@@ -0,0 +1,124 @@
+#include "file_copy.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+namespace augmentorLib {
+    namespace {
+        /// Closes the descriptor on every way out of copy_file
+        struct file_descriptor {
+            int fd;
+
+            explicit file_descriptor(int fd) : fd(fd) {}
+
+            ~file_descriptor() {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+
+            file_descriptor(const file_descriptor&) = delete;
+            file_descriptor& operator=(const file_descriptor&) = delete;
+        };
+
+        [[noreturn]] void fail(const std::string& what, const std::string& path) {
+            throw std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+        }
+
+        /// Copies size bytes through a buffer, for filesystems and kernels without copy_file_range
+        void copy_buffered(int in, int out, off_t offset, off_t size, const std::string& from, const std::string& to) {
+            char buffer[1 << 16];
+            while (offset < size) {
+                ssize_t n = ::pread(in, buffer, sizeof(buffer), offset);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    fail("Could not read", from);
+                }
+                if (n == 0) {
+                    // the source was truncated meanwhile
+                    break;
+                }
+                for (ssize_t written = 0; written < n;) {
+                    ssize_t w = ::write(out, buffer + written, n - written);
+                    if (w < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        fail("Could not write", to);
+                    }
+                    written += w;
+                }
+                offset += n;
+            }
+        }
+    }
+
+    void prepare_output(const std::string& path) {
+        if (::unlink(path.c_str()) != 0 && errno != ENOENT) {
+            fail("Could not replace", path);
+        }
+    }
+
+    copy_result copy_file(const std::string& from, const std::string& to, bool hard_link) {
+        prepare_output(to);
+        if (hard_link) {
+            if (::link(from.c_str(), to.c_str()) == 0) {
+                return copy_result::linked;
+            }
+            // another filesystem, a filesystem without links or too many links: copy instead
+            if (errno != EXDEV && errno != EPERM && errno != EMLINK && errno != EOPNOTSUPP) {
+                fail("Could not link", to);
+            }
+        }
+
+        file_descriptor in(::open(from.c_str(), O_RDONLY | O_CLOEXEC));
+        if (in.fd < 0) {
+            fail("Could not open", from);
+        }
+        struct stat status{};
+        if (::fstat(in.fd, &status) != 0) {
+            fail("Could not stat", from);
+        }
+        file_descriptor out(::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (out.fd < 0) {
+            fail("Could not open for writing", to);
+        }
+
+        off_t offset = 0;
+#ifdef __linux__
+        if (::ioctl(out.fd, FICLONE, in.fd) == 0) {
+            return copy_result::cloned;
+        }
+        while (offset < status.st_size) {
+            ssize_t n = ::copy_file_range(in.fd, nullptr, out.fd, nullptr, status.st_size - offset, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && offset == 0 &&
+                (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                break;
+            }
+            if (n < 0) {
+                fail("Could not copy to", to);
+            }
+            if (n == 0) {
+                // the source was truncated meanwhile
+                return copy_result::copied;
+            }
+            offset += n;
+        }
+#endif
+        copy_buffered(in.fd, out.fd, offset, status.st_size, from, to);
+        return copy_result::copied;
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef LIB_FILE_COPY_H
+#define LIB_FILE_COPY_H
+
+#include <string>
+
+namespace augmentorLib {
+
+    /// How copy_file produced the destination
+    enum class copy_result {
+        linked,     // hard link to the source inode, no data written
+        cloned,     // reflink (FICLONE): the destination shares the source extents until one of them is written
+        copied      // bytes copied in the kernel (copy_file_range) or, failing that, through a buffer
+    };
+
+    /// Copies the file from to the path to, replacing it
+    ///
+    /// The cheapest method the filesystem offers is used: a hard link when hard_link is set and both paths are
+    /// on the same filesystem, else a reflink on filesystems that share extents (btrfs, XFS), else
+    /// copy_file_range, which stays in the kernel and lets NFS and SMB copy on the server side. Read and write
+    /// through a buffer is the last resort.
+    /// \throws std::runtime_error if from cannot be read or to cannot be written
+    copy_result copy_file(const std::string& from, const std::string& to, bool hard_link = false);
+
+    /// Removes path if it exists, so the next write creates a new file instead of writing through a hard link
+    /// into the source it was linked to by copy_file
+    void prepare_output(const std::string& path);
+}
+
+#endif //LIB_FILE_COPY_H
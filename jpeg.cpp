@@ -2,139 +2,416 @@
 
 #include <jpeglib.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include<iostream>
 
 namespace jpegimageSTL::jpeg
     {
-        Image::Image(const size_t x, const size_t y, const size_t pixelSize, const int colourSpace)
+        namespace
         {
-            m_errorMgr = std::make_shared<::jpeg_error_mgr>();
-            // Note this usage of a lambda to provide our own error handler
-            // to libjpeg. If we do not supply a handler, and libjpeg hits
-            // a problem, it just prints the error message and calls exit().
-            m_errorMgr->error_exit = [](::j_common_ptr cinfo){
+            // If we do not supply a handler, and libjpeg hits a problem, it just prints the error message and
+            // calls exit().
+            void throwError( ::j_common_ptr cinfo )
+            {
                 char jpegLastErrorMsg[JMSG_LENGTH_MAX];
                 // Call the function pointer to get the error message
                 (*(cinfo->err->format_message))(cinfo, jpegLastErrorMsg);
                 throw std::runtime_error(jpegLastErrorMsg);
+            }
+
+            /// The libjpeg objects of one thread
+            ///
+            /// Creating a decompress / compress object allocates its memory manager and every module's
+            /// permanent state; on small images that costs as much as the decoding itself. Each thread creates
+            /// them once and reuses them for every image it reads, writes or transcodes, along with the row
+            /// pointer and scratch buffers.
+            struct codec_context
+            {
+                ::jpeg_error_mgr errorMgr;
+                ::jpeg_decompress_struct decompress;
+                ::jpeg_compress_struct compress;
+                std::vector<::JSAMPROW> rows;
+                std::vector<uint8_t> scratch;
+                // small input files, see source_file
+                std::vector<uint8_t> input;
+                // compressed output, malloc'ed because jpeg_mem_dest may replace it with a larger malloc'ed block
+                unsigned char* output = nullptr;
+                unsigned long outputCapacity = 0;
+                unsigned long outputSize = 0;
+
+                codec_context()
+                {
+                    decompress.err = ::jpeg_std_error( &errorMgr );
+                    errorMgr.error_exit = throwError;
+                    ::jpeg_create_decompress( &decompress );
+                    compress.err = &errorMgr;
+                    ::jpeg_create_compress( &compress );
+                }
+
+                ~codec_context()
+                {
+                    ::jpeg_destroy_compress( &compress );
+                    ::jpeg_destroy_decompress( &decompress );
+                    std::free( output );
+                }
+
+                codec_context( const codec_context& ) = delete;
+                codec_context& operator=( const codec_context& ) = delete;
+
+                /// Points the compress object at the output buffer, grown to at least capacity bytes. The objects
+                /// only ever read from and write to memory: libjpeg refuses to switch a reused object between
+                /// stdio and memory managers.
+                void beginOutput( unsigned long capacity )
+                {
+                    if ( outputCapacity < capacity ){
+                        std::free( output );
+                        output = static_cast<unsigned char*>( std::malloc( capacity ) );
+                        outputCapacity = output ? capacity : 0;
+                    }
+                    outputSize = outputCapacity;
+                    ::jpeg_mem_dest( &compress, &output, &outputSize );
+                }
+
+                /// After jpeg_finish_compress: takes over the buffer libjpeg grew into, if the image did not fit
+                void endOutput( unsigned char* given )
+                {
+                    if ( output != given ){
+                        std::free( given );
+                        outputCapacity = outputSize;
+                    }
+                }
+
+                /// Row pointers to count rows of stride bytes, starting at first
+                ::JSAMPARRAY rowPointers( uint8_t* first, size_t count, size_t stride )
+                {
+                    rows.resize( count );
+                    for ( size_t y = 0; y < count; ++y ){
+                        rows[y] = first + y * stride;
+                    }
+                    return rows.data();
+                }
             };
 
-            m_width       = x;
-            m_height      = y;
-            m_pixelSize   = pixelSize;
-            m_colourSpace = colourSpace;
+            /// Resets the objects of the calling thread's context when a decode, save or transcode ends, whether
+            /// it finished or threw half way: the memory of the image is released and the next image starts
+            /// from a clean state.
+            struct codec_session
+            {
+                codec_context& context;
+
+                codec_session() : context( threadContext() ) {}
+
+                ~codec_session()
+                {
+                    ::jpeg_abort_compress( &context.compress );
+                    ::jpeg_abort_decompress( &context.decompress );
+                }
+
+                codec_session( const codec_session& ) = delete;
+                codec_session& operator=( const codec_session& ) = delete;
+
+                static codec_context& threadContext()
+                {
+                    thread_local codec_context context;
+                    return context;
+                }
+            };
+
+            /// The bytes of a whole input file
+            ///
+            /// Large files are memory mapped and decoded straight from the page cache, which spares the copy
+            /// through stdio's small buffer; the kernel is told they are read once, front to back, and to start
+            /// reading them ahead right away. Below mapThreshold, setting up and tearing down the mapping costs
+            /// more than copying, so small files are read with one read() into a reused buffer of the thread.
+            struct source_file
+            {
+                static constexpr size_t mapThreshold = size_t( 1 ) << 20;
+
+                const uint8_t* data = nullptr;
+                size_t size = 0;
+                bool mapped = false;
 
-            m_bitmapData.clear();
-            m_bitmapData.reserve(m_height);
+                explicit source_file( const std::string& fileName )
+                {
+                    int fd = ::open( fileName.c_str(), O_RDONLY | O_CLOEXEC );
+                    if ( fd < 0 ){
+                        throw std::runtime_error("Could not open " + fileName);
+                    }
+                    struct stat status{};
+                    if ( ::fstat( fd, &status ) != 0 ){
+                        ::close( fd );
+                        throw std::runtime_error("Could not open " + fileName);
+                    }
+                    size = status.st_size;
+                    if ( size >= mapThreshold ){
+                        void* p = ::mmap( nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+                        ::close( fd );
+                        if ( p == MAP_FAILED ){
+                            throw std::runtime_error("Could not map " + fileName);
+                        }
+                        ::madvise( p, size, MADV_SEQUENTIAL );
+                        ::madvise( p, size, MADV_WILLNEED );
+                        data = static_cast<const uint8_t*>( p );
+                        mapped = true;
+                        return;
+                    }
+                    auto& buffer = codec_session::threadContext().input;
+                    buffer.resize( size );
+                    size_t done = 0;
+                    while ( done < size ){
+                        ssize_t n = ::read( fd, buffer.data() + done, size - done );
+                        if ( n < 0 && errno == EINTR ){
+                            continue;
+                        }
+                        if ( n <= 0 ){
+                            break;
+                        }
+                        done += n;
+                    }
+                    ::close( fd );
+                    // a file that shrank meanwhile ends early, which libjpeg reports
+                    size = done;
+                    data = buffer.data();
+                }
+
+                ~source_file()
+                {
+                    if ( mapped ){
+                        ::munmap( const_cast<uint8_t*>( data ), size );
+                    }
+                }
 
-            for(size_t i = 0; i < m_height; ++i){
-                std::vector<uint8_t> vec(m_width*m_pixelSize, 0);
-                m_bitmapData.push_back(vec);
+                source_file( const source_file& ) = delete;
+                source_file& operator=( const source_file& ) = delete;
+            };
+
+            /// Compresses image into the output buffer of codec
+            /// \return size of the compressed image in bytes
+            unsigned long compress( codec_context& codec, const Image& image, int quality )
+            {
+                if ( quality < 0 ){
+                    quality = 0;
+                }
+                if ( quality > 100 ){
+                    quality = 100;
+                }
+                ::jpeg_compress_struct* compressInfo = &codec.compress;
+                // room for the raw samples: the output practically never has to grow
+                codec.beginOutput( image.getWidth() * image.getHeight() * image.getPixelSize() + 65536 );
+                unsigned char* given = codec.output;
+                compressInfo->image_width = image.getWidth();
+                compressInfo->image_height = image.getHeight();
+                compressInfo->input_components = image.getPixelSize();
+                compressInfo->in_color_space =
+                        static_cast<::J_COLOR_SPACE>( image.getColorSpace() );
+                ::jpeg_set_defaults( compressInfo );
+                ::jpeg_set_quality( compressInfo, quality, TRUE );
+                ::jpeg_start_compress( compressInfo, TRUE);
+                // Casting const-ness away here because the jpeglib
+                // call expects a non-const pointer. It presumably
+                // doesn't modify our data. The whole image goes in one call.
+                ::JSAMPARRAY rows = codec.rowPointers(
+                        const_cast<uint8_t*>( image.data() ), image.getHeight(), image.stride() );
+                ::jpeg_write_scanlines( compressInfo, rows, image.getHeight() );
+                ::jpeg_finish_compress( compressInfo );
+                codec.endOutput( given );
+                return codec.outputSize;
             }
 
+            /// Writes size bytes to fileName in one go, replacing it
+            void writeFile( const std::string& fileName, const uint8_t* data, size_t size )
+            {
+                int fd = ::open( fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+                if ( fd < 0 ){
+                    throw std::runtime_error("Could not open " + fileName + " for writing");
+                }
+                while ( size > 0 ){
+                    ssize_t n = ::write( fd, data, size );
+                    if ( n < 0 && errno == EINTR ){
+                        continue;
+                    }
+                    if ( n < 0 ){
+                        ::close( fd );
+                        throw std::runtime_error("Could not write " + fileName);
+                    }
+                    data += n;
+                    size -= n;
+                }
+                ::close( fd );
+            }
         }
 
-        Image::Image()
+        size_t Image::alignedStride( const size_t width, const size_t pixelSize )
         {
-            m_errorMgr = std::make_shared<::jpeg_error_mgr>();
-            // Note this usage of a lambda to provide our own error handler
-            // to libjpeg. If we do not supply a handler, and libjpeg hits
-            // a problem, it just prints the error message and calls exit().
-            m_errorMgr->error_exit = [](::j_common_ptr cinfo){
-                char jpegLastErrorMsg[JMSG_LENGTH_MAX];
-                // Call the function pointer to get the error message
-                (*(cinfo->err->format_message))(cinfo, jpegLastErrorMsg);
-                throw std::runtime_error(jpegLastErrorMsg);
-            };
+            size_t rowBytes = width * pixelSize;
+            return ( rowBytes + row_alignment - 1 ) / row_alignment * row_alignment;
         }
 
-        Image::Image( const std::string& fileName )
+        void Image::allocate( const size_t width, const size_t height, const size_t pixelSize )
         {
-            // Creating a custom deleter for the decompressInfo pointer
-            // to ensure ::jpeg_destroy_compress() gets called even if
-            // we throw out of this function.
-            auto dt = []( ::jpeg_decompress_struct *ds ){
-                ::jpeg_destroy_decompress( ds );
-            };
-
-            std::unique_ptr<::jpeg_decompress_struct, decltype(dt)> decompressInfo(new ::jpeg_decompress_struct,dt);
+            m_width     = width;
+            m_height    = height;
+            m_pixelSize = pixelSize;
+            m_stride    = alignedStride( width, pixelSize );
+            // one allocation for the whole bitmap, zero filled (padding included)
+            buffer_type( m_stride * m_height, 0 ).swap( m_bitmapData );
+        }
 
-            // Note this is a shared pointer as we can share this
-            // between objects which have copy constructed from each other
-            m_errorMgr = std::make_shared<::jpeg_error_mgr>();
+        Image::Image(const size_t x, const size_t y, const size_t pixelSize, const int colourSpace)
+        {
+            m_colourSpace = colourSpace;
+            allocate( x, y, pixelSize );
+        }
 
-            // Using fopen here ( and in save() ) because libjpeg expects
-            // a FILE pointer.
-            // We store the FILE* in a unique_ptr so we can also use the custom
-            // deleter here to ensure fclose() gets called even if we throw.
-            auto fdt = []( FILE* fp ){
-                fclose( fp );
-            };
+        Image::Image(): m_width{0}, m_height{0}, m_pixelSize{0}, m_stride{0}, m_colourSpace{0}
+        {
+        }
 
-            std::unique_ptr<FILE, decltype(fdt)>infile(
-                    fopen(fileName.c_str(), "rb"),fdt
-            );
+        Image::Image( const std::string& fileName ) : Image( fileName, decode_hint() )
+        {
+        }
 
-            if (infile.get() == NULL){
-                throw std::runtime_error("Could not open " + fileName);
-            }
+        Image::Image( const std::string& fileName, const decode_hint& hint )
+        {
+            source_file file( fileName );
+            decode( file.data, file.size, hint );
+        }
 
-            decompressInfo->err = ::jpeg_std_error(m_errorMgr.get());
+        Image::Image( const uint8_t* data, size_t size, const decode_hint& hint )
+        {
+            decode( data, size, hint );
+        }
 
-            // Note this usage of a lambda to provide our own error handler
-            // to libjpeg. If we do not supply a handler, and libjpeg hits
-            // a problem, it just prints the error message and calls exit().
-            m_errorMgr->error_exit = [](::j_common_ptr cinfo){
-                char jpegLastErrorMsg[JMSG_LENGTH_MAX];
-                // Call the function pointer to get the error message
-                (*(cinfo->err->format_message))(cinfo, jpegLastErrorMsg);
-                throw std::runtime_error(jpegLastErrorMsg);
-            };
-            ::jpeg_create_decompress(decompressInfo.get());
+        void Image::decode( const uint8_t* data, size_t size, const decode_hint& hint )
+        {
+            codec_session session;
+            ::jpeg_decompress_struct* decompressInfo = &session.context.decompress;
 
             // Read the file:
-            ::jpeg_stdio_src(decompressInfo.get(), infile.get());
+            ::jpeg_mem_src(decompressInfo, data, size);
 
-            int rc = ::jpeg_read_header(decompressInfo.get(), TRUE);
+            int rc = ::jpeg_read_header(decompressInfo, TRUE);
             if (rc != 1){
                 throw std::runtime_error("File does not seem to be a normal JPEG");
             }
 
-            ::jpeg_start_decompress(decompressInfo.get());
+            // largest IDCT scaling that keeps the output at least as large as asked for
+            if ( hint.min_width > 0 && hint.min_height > 0 ){
+                for ( unsigned denominator : { 8u, 4u, 2u } ){
+                    decompressInfo->scale_num = 1;
+                    decompressInfo->scale_denom = denominator;
+                    ::jpeg_calc_output_dimensions( decompressInfo );
+                    if ( decompressInfo->output_width >= hint.min_width &&
+                         decompressInfo->output_height >= hint.min_height ){
+                        break;
+                    }
+                    decompressInfo->scale_denom = 1;
+                }
+            }
 
-            m_width       = decompressInfo->output_width;
-            m_height      = decompressInfo->output_height;
-            m_pixelSize   = decompressInfo->output_components;
-            m_colourSpace = decompressInfo->out_color_space;
+            ::jpeg_start_decompress(decompressInfo);
 
-            size_t row_stride = m_width * m_pixelSize;
+            m_colourSpace = decompressInfo->out_color_space;
+            JDIMENSION fullWidth = decompressInfo->output_width;
+            JDIMENSION fullHeight = decompressInfo->output_height;
+
+            if ( hint.crop_width > 0 && hint.crop_height > 0 &&
+                 hint.crop_width <= fullWidth && hint.crop_height <= fullHeight ){
+                // same window as a centered crop of the full image
+                JDIMENSION left = fullWidth / 2 - hint.crop_width / 2;
+                JDIMENSION top = fullHeight / 2 - hint.crop_height / 2;
+                allocate( hint.crop_width, hint.crop_height, decompressInfo->output_components );
+
+                // libjpeg widens the column range to whole iMCUs on the left, and treats its right end as the
+                // image border when upsampling chroma: decode up to one iMCU more on the right so that the last
+                // column of the window is the same as in a full decode. The window is copied out of each row.
+                JDIMENSION xoffset = left;
+                JDIMENSION width = std::min<JDIMENSION>( hint.crop_width + 16, fullWidth - left );
+                ::jpeg_crop_scanline( decompressInfo, &xoffset, &width );
+                size_t scanlineBytes = width * m_pixelSize;
+                size_t group = decompressInfo->rec_outbuf_height;
+                session.context.scratch.resize( scanlineBytes * group );
+                ::JSAMPARRAY scanlines = session.context.rowPointers( session.context.scratch.data(), group, scanlineBytes );
+                size_t skip = ( left - xoffset ) * m_pixelSize;
+
+                ::jpeg_skip_scanlines( decompressInfo, top );
+                for ( size_t row = 0; row < m_height; ){
+                    size_t count = ::jpeg_read_scanlines( decompressInfo, scanlines, std::min( group, m_height - row ) );
+                    for ( size_t k = 0; k < count; ++k, ++row ){
+                        std::memcpy( m_bitmapData.data() + row * m_stride, scanlines[k] + skip, m_width * m_pixelSize );
+                    }
+                }
+                // the rows below the window are never decoded, the session aborts the rest
+                return;
+            }
 
-            m_bitmapData.clear();
-            m_bitmapData.reserve(m_height);
+            allocate( fullWidth, fullHeight, decompressInfo->output_components );
 
+            // decode straight into the rows of the contiguous buffer, as many rows per call as libjpeg returns
+            ::JSAMPARRAY rows = session.context.rowPointers( m_bitmapData.data(), m_height, m_stride );
             while (decompressInfo->output_scanline < m_height){
-                std::vector<uint8_t> vec(row_stride);
-                uint8_t* p = vec.data();
-                ::jpeg_read_scanlines(decompressInfo.get(), &p, 1);
-                m_bitmapData.push_back(vec);
+                JDIMENSION done = decompressInfo->output_scanline;
+                ::jpeg_read_scanlines(decompressInfo, rows + done, m_height - done);
             }
-            ::jpeg_finish_decompress(decompressInfo.get());
+            ::jpeg_finish_decompress(decompressInfo);
         }
 
         // Copy constructor
         Image::Image( const Image& rhs )
         {
-            m_errorMgr      = rhs.m_errorMgr;
             m_bitmapData    = rhs.m_bitmapData;
             m_width         = rhs.m_width;
             m_height        = rhs.m_height;
             m_pixelSize     = rhs.m_pixelSize;
+            m_stride        = rhs.m_stride;
+            m_colourSpace   = rhs.m_colourSpace;
+        }
+
+        Image::Image( Image&& rhs ) noexcept
+        {
+            m_bitmapData    = std::move( rhs.m_bitmapData );
+            m_width         = rhs.m_width;
+            m_height        = rhs.m_height;
+            m_pixelSize     = rhs.m_pixelSize;
+            m_stride        = rhs.m_stride;
             m_colourSpace   = rhs.m_colourSpace;
+            rhs.m_width = rhs.m_height = rhs.m_stride = 0;
+        }
+
+        Image& Image::operator=( const Image& rhs )
+        {
+            if ( this != &rhs ){
+                Image copy( rhs );
+                *this = std::move( copy );
+            }
+            return *this;
+        }
+
+        Image& Image::operator=( Image&& rhs ) noexcept
+        {
+            if ( this != &rhs ){
+                m_bitmapData    = std::move( rhs.m_bitmapData );
+                m_width         = rhs.m_width;
+                m_height        = rhs.m_height;
+                m_pixelSize     = rhs.m_pixelSize;
+                m_stride        = rhs.m_stride;
+                m_colourSpace   = rhs.m_colourSpace;
+                rhs.m_width = rhs.m_height = rhs.m_stride = 0;
+            }
+            return *this;
         }
 
         /// Destructor
@@ -144,78 +421,214 @@ namespace jpegimageSTL::jpeg
 
         void Image::save( const std::string& fileName, int quality ) const
         {
-            if ( quality < 0 ){
-                quality = 0;
-            }
-            if ( quality > 100 ){
-                quality = 100;
+            codec_session session;
+            unsigned long size = compress( session.context, *this, quality );
+            writeFile( fileName, session.context.output, size );
+        }
+
+        void Image::encode( std::vector<uint8_t>& out, int quality ) const
+        {
+            codec_session session;
+            unsigned long size = compress( session.context, *this, quality );
+            out.assign( session.context.output, session.context.output + size );
+        }
+
+        namespace
+        {
+            /// Image::transcode into the output buffer of the session's context
+            /// \return false if choose gave up or the transform does not fall on iMCU boundaries
+            bool transcodeCoefficients( codec_session& session, const std::string& source,
+                                        const Image::grid_chooser& choose )
+            {
+                source_file file( source );
+                ::jpeg_decompress_struct* src = &session.context.decompress;
+                ::jpeg_mem_src( src, file.data, file.size );
+                if ( ::jpeg_read_header( src, TRUE ) != 1 ){
+                    throw std::runtime_error("File does not seem to be a normal JPEG");
+                }
+
+                grid_transform t;
+                if ( !choose( src->image_width, src->image_height, t ) || t.width == 0 || t.height == 0 ){
+                    return false;
+                }
+
+                // the window must start (or, mirrored, end) on an iMCU boundary of the source, so that every block
+                // of every component maps onto exactly one source block
+                long mcuWidth = DCTSIZE * src->max_h_samp_factor;
+                long mcuHeight = DCTSIZE * src->max_v_samp_factor;
+                auto aligned = []( long offset, int sign, long size ){
+                    return sign > 0 ? offset % size == 0 : ( offset + 1 ) % size == 0;
+                };
+                if ( !aligned( t.x_offset, t.x_sign, mcuWidth ) || !aligned( t.y_offset, t.y_sign, mcuHeight ) ){
+                    return false;
+                }
+
+                // sampling factors and block grid of the output, transposed images swap them
+                int components = src->num_components;
+                std::vector<int> hSamp( components ), vSamp( components );
+                std::vector<JDIMENSION> widthInBlocks( components ), heightInBlocks( components );
+                int maxH = t.transpose ? src->max_v_samp_factor : src->max_h_samp_factor;
+                int maxV = t.transpose ? src->max_h_samp_factor : src->max_v_samp_factor;
+                for ( int c = 0; c < components; ++c ){
+                    auto comp = src->comp_info + c;
+                    hSamp[c] = t.transpose ? comp->v_samp_factor : comp->h_samp_factor;
+                    vSamp[c] = t.transpose ? comp->h_samp_factor : comp->v_samp_factor;
+                    widthInBlocks[c] = ( t.width * hSamp[c] + maxH * DCTSIZE - 1 ) / ( maxH * DCTSIZE );
+                    heightInBlocks[c] = ( t.height * vSamp[c] + maxV * DCTSIZE - 1 ) / ( maxV * DCTSIZE );
+                }
+
+                // source block of output block (bx, by) of component c, along the source x and y axes
+                auto sourceBlock = [&]( int c, long bx, long by, long& sx, long& sy ){
+                    auto comp = src->comp_info + c;
+                    long blockWidth = DCTSIZE * src->max_h_samp_factor / comp->h_samp_factor;
+                    long blockHeight = DCTSIZE * src->max_v_samp_factor / comp->v_samp_factor;
+                    long a = t.transpose ? by : bx;
+                    long b = t.transpose ? bx : by;
+                    sx = t.x_sign > 0 ? t.x_offset / blockWidth + a : ( t.x_offset + 1 ) / blockWidth - 1 - a;
+                    sy = t.y_sign > 0 ? t.y_offset / blockHeight + b : ( t.y_offset + 1 ) / blockHeight - 1 - b;
+                };
+                for ( int c = 0; c < components; ++c ){
+                    auto comp = src->comp_info + c;
+                    long corners[][2] = { { 0, 0 }, { (long) widthInBlocks[c] - 1, (long) heightInBlocks[c] - 1 } };
+                    for ( auto& corner : corners ){
+                        long sx, sy;
+                        sourceBlock( c, corner[0], corner[1], sx, sy );
+                        if ( sx < 0 || sy < 0 || sx >= (long) comp->width_in_blocks || sy >= (long) comp->height_in_blocks ){
+                            return false;
+                        }
+                    }
+                }
+
+                // output coefficient arrays come from the source's memory manager, before it realizes its own arrays.
+                // They are accessed whole, so that the source can be read one block row at a time in any order.
+                auto srcCommon = reinterpret_cast<::j_common_ptr>( src );
+                auto arrays = static_cast<::jvirt_barray_ptr*>( ( *src->mem->alloc_small )(
+                        srcCommon, JPOOL_IMAGE, sizeof( ::jvirt_barray_ptr ) * components ) );
+                std::vector<JDIMENSION> paddedHeight( components );
+                for ( int c = 0; c < components; ++c ){
+                    JDIMENSION paddedWidth = ( widthInBlocks[c] + hSamp[c] - 1 ) / hSamp[c] * hSamp[c];
+                    paddedHeight[c] = ( heightInBlocks[c] + vSamp[c] - 1 ) / vSamp[c] * vSamp[c];
+                    arrays[c] = ( *src->mem->request_virt_barray )( srcCommon, JPOOL_IMAGE, FALSE,
+                                                                    paddedWidth, paddedHeight[c], paddedHeight[c] );
+                }
+                ::jvirt_barray_ptr* sourceArrays = ::jpeg_read_coefficients( src );
+
+                // mirroring an axis negates its odd frequencies, transposing transposes the block
+                std::array<int, DCTSIZE2> from;
+                std::array<::JCOEF, DCTSIZE2> sign;
+                bool identity = true;
+                for ( int v = 0; v < DCTSIZE; ++v ){
+                    for ( int u = 0; u < DCTSIZE; ++u ){
+                        int su = t.transpose ? v : u;   // horizontal frequency in the source block
+                        int sv = t.transpose ? u : v;   // vertical frequency in the source block
+                        from[v * DCTSIZE + u] = sv * DCTSIZE + su;
+                        sign[v * DCTSIZE + u] = ( t.x_sign < 0 && ( su & 1 ) ) != ( t.y_sign < 0 && ( sv & 1 ) ) ? -1 : 1;
+                        identity = identity && !t.transpose && sign[v * DCTSIZE + u] == 1;
+                    }
+                }
+
+                for ( int c = 0; c < components; ++c ){
+                    ::JBLOCKARRAY out = ( *src->mem->access_virt_barray )( srcCommon, arrays[c], 0, paddedHeight[c], TRUE );
+                    // the source block row only depends on the output block row, or on the column when transposed
+                    JDIMENSION outer = t.transpose ? widthInBlocks[c] : heightInBlocks[c];
+                    JDIMENSION inner = t.transpose ? heightInBlocks[c] : widthInBlocks[c];
+                    for ( JDIMENSION o = 0; o < outer; ++o ){
+                        long sx, sy;
+                        sourceBlock( c, t.transpose ? o : 0, t.transpose ? 0 : o, sx, sy );
+                        ::JBLOCKROW in = ( *src->mem->access_virt_barray )( srcCommon, sourceArrays[c], sy, 1, FALSE )[0];
+                        if ( identity ){
+                            std::memcpy( out[o], in + sx, inner * sizeof( ::JBLOCK ) );
+                            continue;
+                        }
+                        for ( JDIMENSION i = 0; i < inner; ++i ){
+                            sourceBlock( c, t.transpose ? o : i, t.transpose ? i : o, sx, sy );
+                            const ::JCOEF* block = in[sx];
+                            ::JCOEF* target = t.transpose ? out[i][o] : out[o][i];
+                            for ( int k = 0; k < DCTSIZE2; ++k ){
+                                target[k] = (::JCOEF) ( sign[k] * block[from[k]] );
+                            }
+                        }
+                    }
+                }
+
+                ::jpeg_compress_struct* dst = &session.context.compress;
+                // the entropy coded output is about as large as the source
+                session.context.beginOutput( 2 * file.size + 65536 );
+                unsigned char* given = session.context.output;
+                ::jpeg_copy_critical_parameters( src, dst );
+                dst->image_width = t.width;
+                dst->image_height = t.height;
+                for ( int c = 0; c < components; ++c ){
+                    dst->comp_info[c].h_samp_factor = hSamp[c];
+                    dst->comp_info[c].v_samp_factor = vSamp[c];
+                }
+                if ( t.transpose ){
+                    // the quantization tables are indexed by frequency, so they are transposed with the blocks
+                    for ( auto table : dst->quant_tbl_ptrs ){
+                        if ( table == NULL ){
+                            continue;
+                        }
+                        for ( int v = 0; v < DCTSIZE; ++v ){
+                            for ( int u = v + 1; u < DCTSIZE; ++u ){
+                                std::swap( table->quantval[v * DCTSIZE + u], table->quantval[u * DCTSIZE + v] );
+                            }
+                        }
+                    }
+                }
+                ::jpeg_write_coefficients( dst, arrays );
+                ::jpeg_finish_compress( dst );
+                ::jpeg_finish_decompress( src );
+                session.context.endOutput( given );
+                return true;
             }
-            FILE* outfile = fopen(fileName.c_str(), "wb");
-            if ( outfile == NULL ){
-                throw std::runtime_error("Could not open " + fileName + " for writing");
+        }
+
+        bool Image::transcode( const std::string& source, const std::string& destination, const grid_chooser& choose )
+        {
+            codec_session session;
+            if ( !transcodeCoefficients( session, source, choose ) ){
+                return false;
             }
-            // Creating a custom deleter for the compressInfo pointer
-            // to ensure ::jpeg_destroy_compress() gets called even if
-            // we throw out of this function.
-            auto dt = []( ::jpeg_compress_struct *cs ){
-                ::jpeg_destroy_compress( cs );
+            writeFile( destination, session.context.output, session.context.outputSize );
+            return true;
+        }
 
-            };
-            std::unique_ptr<::jpeg_compress_struct, decltype(dt)> compressInfo(
-                    new ::jpeg_compress_struct,
-                    dt );
-            ::jpeg_create_compress( compressInfo.get() );
-            ::jpeg_stdio_dest( compressInfo.get(), outfile);
-            compressInfo->image_width = m_width;
-            compressInfo->image_height = m_height;
-            compressInfo->input_components = m_pixelSize;
-            compressInfo->in_color_space =
-                    static_cast<::J_COLOR_SPACE>( m_colourSpace );
-            compressInfo->err = ::jpeg_std_error( m_errorMgr.get() );
-            ::jpeg_set_defaults( compressInfo.get() );
-            ::jpeg_set_quality( compressInfo.get(), quality, TRUE );
-            ::jpeg_start_compress( compressInfo.get(), TRUE);
-            for ( auto const& vecLine : m_bitmapData ){
-                ::JSAMPROW rowPtr[1];
-                // Casting const-ness away here because the jpeglib
-                // call expects a non-const pointer. It presumably
-                // doesn't modify our data.
-                rowPtr[0] = const_cast<::JSAMPROW>( vecLine.data() );
-                ::jpeg_write_scanlines(compressInfo.get(),rowPtr,1);
+        bool Image::transcode( const std::string& source, std::vector<uint8_t>& out, const grid_chooser& choose )
+        {
+            codec_session session;
+            if ( !transcodeCoefficients( session, source, choose ) ){
+                return false;
             }
-            ::jpeg_finish_compress( compressInfo.get() );
-            fclose( outfile );
+            out.assign( session.context.output, session.context.output + session.context.outputSize );
+            return true;
         }
 
         std::vector<uint8_t> Image::getPixel( size_t x, size_t y ) const
         {
 
-            if (y > m_bitmapData.size()){
+            if (y >= m_height){
                 throw std::out_of_range( "Y value too large" );
             }
-            if (x > m_bitmapData[0].size() / m_pixelSize){
+            if (x >= m_width){
                 throw std::out_of_range( "X value too large" );
             }
-            std::vector<uint8_t> vec;
-            vec.reserve(m_pixelSize);
-            for (size_t n = 0; n < m_pixelSize; ++n){
-                vec.push_back( m_bitmapData[ y ][ x * m_pixelSize + n ] );
-            }
-            return vec;
+            const uint8_t* p = m_bitmapData.data() + y * m_stride + x * m_pixelSize;
+            return std::vector<uint8_t>( p, p + m_pixelSize );
         }
 
         void Image::setPixel(size_t x, size_t y, std::vector<uint8_t> pixelValue)
         {
-            if ( y >= m_bitmapData.size() ){
-                std::cout<<"y:"<<y<<" m_bitmapData:"<<m_bitmapData.size()<<"\n";
+            if ( y >= m_height ){
+                std::cout<<"y:"<<y<<" m_bitmapData:"<<m_height<<"\n";
                 throw std::out_of_range( "SetPixel: Y value too large" );
             }
-            if ( x >= (m_bitmapData[0].size() / m_pixelSize) ){
-                std::cout<<"x:"<<x<<" m_bitmapData:"<<m_bitmapData[0].size()/m_pixelSize<<"\n";
+            if ( x >= m_width ){
+                std::cout<<"x:"<<x<<" m_bitmapData:"<<m_width<<"\n";
                 throw std::out_of_range( "SetPixel: X value too large" );
             }
+            uint8_t* p = m_bitmapData.data() + y * m_stride + x * m_pixelSize;
             for ( size_t n = 0; n < m_pixelSize; ++n ){
-                m_bitmapData[ y ][ x * m_pixelSize + n ] = pixelValue[n];
+                p[n] = pixelValue[n];
             }
         }
 
@@ -229,27 +642,27 @@ namespace jpegimageSTL::jpeg
 
             float scaleFactor = static_cast<float>(newWidth) / m_width;
             float scaleFactorRow = static_cast<float>(newHeight) / m_height;
-            std::vector<std::vector<uint8_t>> vecNewBitmap;
-            vecNewBitmap.reserve( newHeight );
+            size_t newStride = alignedStride( newWidth, m_pixelSize );
+            buffer_type vecNewBitmap( newStride * newHeight, 0 );
 
             for ( size_t row = 0; row < newHeight; ++row )
             {
                 size_t oldRow = row / scaleFactorRow;
-                std::vector<uint8_t> vecNewLine( newWidth * m_pixelSize );
+                const uint8_t* oldLine = m_bitmapData.data() + oldRow * m_stride;
+                uint8_t* newLine = vecNewBitmap.data() + row * newStride;
                 for ( size_t col = 0; col < newWidth; ++col )
                 {
                     size_t oldCol = col / scaleFactor;
                     for ( size_t n = 0; n < m_pixelSize; ++n )
                     {
-                        vecNewLine[ col * m_pixelSize + n ] =
-                                m_bitmapData[ oldRow ][ oldCol * m_pixelSize + n ];
+                        newLine[ col * m_pixelSize + n ] = oldLine[ oldCol * m_pixelSize + n ];
                     }
                 }
-                vecNewBitmap.push_back( vecNewLine );
             }
-            m_bitmapData = vecNewBitmap;
-            m_height = m_bitmapData.size();
-            m_width = m_bitmapData[0].size() / m_pixelSize;
+            m_bitmapData.swap( vecNewBitmap );
+            m_height = newHeight;
+            m_width = newWidth;
+            m_stride = newStride;
         }
 
     } // namespace marengo
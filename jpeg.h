@@ -1,30 +1,158 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <new>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-// forward declarations of jpeglib struct
-struct jpeg_error_mgr;
-
 namespace jpegimageSTL::jpeg
     {
 
+        /// Allocator handing out storage aligned to `Alignment` bytes
+        ///
+        /// Used for the pixel buffer so every row starts on a cache line / SIMD register boundary.
+        /// \tparam T value type
+        /// \tparam Alignment alignment in bytes, must be a power of two
+        template<typename T, size_t Alignment>
+        struct aligned_allocator
+        {
+            typedef T value_type;
+
+            template<typename U>
+            struct rebind { typedef aligned_allocator<U, Alignment> other; };
+
+            aligned_allocator() noexcept = default;
+
+            template<typename U>
+            aligned_allocator( const aligned_allocator<U, Alignment>& ) noexcept {}
+
+            T* allocate( size_t n )
+            {
+                return static_cast<T*>( ::operator new( n * sizeof(T), std::align_val_t( Alignment ) ) );
+            }
+
+            void deallocate( T* p, size_t ) noexcept
+            {
+                ::operator delete( p, std::align_val_t( Alignment ) );
+            }
+
+            template<typename U>
+            bool operator==( const aligned_allocator<U, Alignment>& ) const noexcept { return true; }
+
+            template<typename U>
+            bool operator!=( const aligned_allocator<U, Alignment>& ) const noexcept { return false; }
+        };
+
+        /// A non-owning view over the pixels of one image row
+        ///
+        /// Holds getWidth() * getPixelSize() samples, interleaved per pixel (e.g. R, G, B, R, G, B, ...).
+        /// \tparam T sample type, const qualified for read-only rows
+        template<typename T>
+        struct row_span
+        {
+            T*     ptr;
+            size_t length;
+
+            [[nodiscard]] T* data() const { return ptr; }
+            [[nodiscard]] size_t size() const { return length; }
+            [[nodiscard]] T* begin() const { return ptr; }
+            [[nodiscard]] T* end() const { return ptr + length; }
+            T& operator[]( size_t i ) const { return ptr[i]; }
+        };
+
+        /// What the operations that follow a decode need from it
+        ///
+        /// libjpeg can scale an image by 1/2, 1/4 or 1/8 inside the IDCT, which costs a fraction of decoding at
+        /// full size (and of the memory) and leaves less to shrink afterwards. It can also decode only the
+        /// columns around a window and stop after its last row.
+        struct decode_hint
+        {
+            // Smallest acceptable size of the decoded image: the largest of the three factors that still gives
+            // at least min_width x min_height is used. 0 decodes at full size.
+            size_t min_width  = 0;
+            size_t min_height = 0;
+            // Only the centered crop_width x crop_height window is needed, the decoded image is that window
+            // (same offsets as a centered crop). 0, or a window larger than the image, decodes everything.
+            size_t crop_width  = 0;
+            size_t crop_height = 0;
+        };
+
+        /// A lossless rearrangement of the pixel grid
+        ///
+        /// Output pixel (x, y) of the width x height output is source pixel
+        ///     ( x_sign * x + x_offset, y_sign * y + y_offset )     without transpose
+        ///     ( x_sign * y + x_offset, y_sign * x + y_offset )     with transpose
+        /// which covers the 8 flips / quarter turns combined with a crop.
+        struct grid_transform
+        {
+            bool transpose = false;
+            int  x_sign    = 1;
+            int  y_sign    = 1;
+            long x_offset  = 0;
+            long y_offset  = 0;
+            size_t width   = 0;
+            size_t height  = 0;
+        };
+
         class Image
         {
+        public:
+            typedef uint8_t pixel_value_type;
+
+            /// Picks the grid_transform of a transcode from the width and height of the source, or returns false
+            typedef std::function<bool( size_t width, size_t height, grid_transform& transform )> grid_chooser;
+
+            /// Alignment (in bytes) of the pixel buffer and of every row inside it
+            static constexpr size_t row_alignment = 64;
+
         private:
-            // Note that m_errorMgr is a shared ptr and will be shared
-            // between objects if one copy constructs from another
-            std::shared_ptr< ::jpeg_error_mgr > m_errorMgr;
-            std::vector< std::vector<uint8_t> > m_bitmapData;
+            typedef std::vector< pixel_value_type, aligned_allocator<pixel_value_type, row_alignment> > buffer_type;
+
+            // All rows live in one contiguous allocation, row y starts at y * m_stride
+            buffer_type                       m_bitmapData;
             size_t                            m_width;
             size_t                            m_height;
             size_t                            m_pixelSize;
+            size_t                            m_stride;
             int                               m_colourSpace;
 
+            // Row length in bytes rounded up to row_alignment
+            static size_t alignedStride( size_t width, size_t pixelSize );
+
+            // (Re)allocates a zeroed buffer for the given geometry
+            void allocate( size_t width, size_t height, size_t pixelSize );
+
+            // Decompresses the JPEG file in data into this image
+            void decode( const uint8_t* data, size_t size, const decode_hint& hint );
+
+            void checkRow( size_t y ) const
+            {
+                if ( y >= m_height ){
+                    throw std::out_of_range( "Y value too large" );
+                }
+            }
+
+            void checkPixel( size_t x, size_t y ) const
+            {
+                checkRow( y );
+                if ( x >= m_width ){
+                    throw std::out_of_range( "X value too large" );
+                }
+            }
+
+            void checkComponents( size_t n ) const
+            {
+                if ( n != m_pixelSize ){
+                    throw std::invalid_argument( "Pixel array size does not match the pixel size" );
+                }
+            }
+
         public:
-            typedef uint8_t pixel_value_type;
 
             ///Image constructor
             ///
@@ -44,15 +172,41 @@ namespace jpegimageSTL::jpeg
             /// Image constructor
             ///
             /// Construct with an existing file. Will throw if file cannot be loaded, or is in the wrong format or some other error is encountered.
+            /// @note Files of 1 MiB or more are memory mapped and decoded straight from the page cache; smaller ones
+            /// are copied with one read() into a buffer that each thread reuses, which is cheaper than mapping
+            /// them. The libjpeg decompress and compress objects are created once per thread and reused by every
+            /// decode, save and transcode of that thread.
             /// \param fileName path to the input file
             explicit Image( const std::string& fileName );
 
+            /// Image constructor
+            ///
+            /// Construct with an existing file, decoding only as much as hint asks for.
+            /// \param fileName path to the input file
+            /// \param hint smallest size the decoded image may have
+            Image( const std::string& fileName, const decode_hint& hint );
+
+            /// Image constructor
+            ///
+            /// Decode a JPEG file already in memory, e.g. read ahead, cached or received over the network. The
+            /// bytes are decoded in place and not kept.
+            /// \param data first byte of the compressed file
+            /// \param size size of the compressed file in bytes
+            /// \param hint smallest size the decoded image may have
+            Image( const uint8_t* data, size_t size, const decode_hint& hint = decode_hint() );
+
             /// copy constructor
             ///
             /// We can construct from an existing image object. This allows us to work on a copy (e.g. shrink then save) without affecting the original we have in memory.
             /// \param rhs Source image object
             Image( const Image& rhs );
 
+            Image( Image&& rhs ) noexcept;
+
+            Image& operator=( const Image& rhs );
+
+            Image& operator=( Image&& rhs ) noexcept;
+
             ~Image();
 
             Image();
@@ -65,11 +219,52 @@ namespace jpegimageSTL::jpeg
             /// @note Will throw if file cannot be saved. Quality's usable values are 0-100
             void save( const std::string& fileName, int quality = 95 ) const;
 
+            /// Encode
+            ///
+            /// Compresses the image into memory instead of a file, so that compressed images can be cached,
+            /// sent or written in batches. save() is encode() followed by a single write.
+            /// \param out receives the JPEG file, its previous content is replaced
+            /// \param quality quality of the image, 0-100
+            void encode( std::vector<uint8_t>& out, int quality = 95 ) const;
+
+            /// Transcode
+            ///
+            /// Applies a grid_transform to a JPEG file in the DCT domain, like jpegtran: the quantized coefficients
+            /// are read with jpeg_read_coefficients, whole blocks are moved (and transposed / sign flipped) and
+            /// written with jpeg_write_coefficients. Nothing is decoded or re-quantized, so the result is bit
+            /// exact with no generational loss. Only transforms that move whole iMCUs can be done this way.
+            /// \param source path of the input file
+            /// \param destination path of the output file, only created when the transform can be done
+            /// \param choose gets the width and height of the source and fills in the transform, or returns
+            /// false to give up
+            /// \return false if choose gave up or the transform does not fall on iMCU boundaries
+            /// @note Will throw if a file cannot be read or written
+            static bool transcode( const std::string& source, const std::string& destination, const grid_chooser& choose );
+
+            /// Transcode into memory
+            ///
+            /// Same as transcode() to a file, the output JPEG is stored in out instead.
+            /// \return false if choose gave up or the transform does not fall on iMCU boundaries, out is then left
+            /// untouched
+            static bool transcode( const std::string& source, std::vector<uint8_t>& out, const grid_chooser& choose );
+
             [[nodiscard]] size_t getHeight()    const { return m_height; }
             [[nodiscard]] size_t getWidth()     const { return m_width;  }
             [[nodiscard]] size_t getPixelSize() const { return m_pixelSize; }
             [[nodiscard]] int getColorSpace() const { return m_colourSpace; }
 
+            /// Data
+            ///
+            /// Pointer to the first byte of the contiguous pixel buffer. Row y starts at data() + y * stride().
+            /// Every row is aligned to row_alignment bytes, bytes past getWidth() * getPixelSize() are padding.
+            [[nodiscard]] pixel_value_type* data() { return m_bitmapData.data(); }
+            [[nodiscard]] const pixel_value_type* data() const { return m_bitmapData.data(); }
+
+            /// Stride
+            ///
+            /// \return distance in bytes between the starts of two consecutive rows
+            [[nodiscard]] size_t stride() const { return m_stride; }
+
             /// GetPixel
             ///
             /// Will return a vector of pixel components. The vector's size will be 1 for monochrome or 3 for RGB. Elements for the latter will be in order R, G, B.
@@ -86,6 +281,101 @@ namespace jpegimageSTL::jpeg
             /// \param pixelValue An RGB vector of characters [R, G, B] that make that pixel
             void setPixel(size_t x, size_t y, std::vector<uint8_t> pixelValue);
 
+            /// Get Row
+            ///
+            /// Bounds checked view over row y. Will throw if y is out of range.
+            /// \param y row index
+            /// \return A span of getWidth() * getPixelSize() samples
+            [[nodiscard]] row_span<pixel_value_type> getRow( size_t y )
+            {
+                checkRow( y );
+                return { rowUnchecked( y ), m_width * m_pixelSize };
+            }
+
+            [[nodiscard]] row_span<const pixel_value_type> getRow( size_t y ) const
+            {
+                checkRow( y );
+                return { rowUnchecked( y ), m_width * m_pixelSize };
+            }
+
+            /// Row Unchecked
+            ///
+            /// Pointer to the first sample of row y, no bounds checking. This is the fast path used by the operations.
+            [[nodiscard]] pixel_value_type* rowUnchecked( size_t y ) { return m_bitmapData.data() + y * m_stride; }
+            [[nodiscard]] const pixel_value_type* rowUnchecked( size_t y ) const { return m_bitmapData.data() + y * m_stride; }
+
+            /// Get Pixel Pointer
+            ///
+            /// Bounds checked pointer to the getPixelSize() samples of pixel (x, y). Will throw if out of range.
+            [[nodiscard]] pixel_value_type* getPixelPtr( size_t x, size_t y )
+            {
+                checkPixel( x, y );
+                return pixelUnchecked( x, y );
+            }
+
+            [[nodiscard]] const pixel_value_type* getPixelPtr( size_t x, size_t y ) const
+            {
+                checkPixel( x, y );
+                return pixelUnchecked( x, y );
+            }
+
+            /// Pixel Unchecked
+            ///
+            /// Pointer to the getPixelSize() samples of pixel (x, y), no bounds checking.
+            [[nodiscard]] pixel_value_type* pixelUnchecked( size_t x, size_t y )
+            {
+                return m_bitmapData.data() + y * m_stride + x * m_pixelSize;
+            }
+
+            [[nodiscard]] const pixel_value_type* pixelUnchecked( size_t x, size_t y ) const
+            {
+                return m_bitmapData.data() + y * m_stride + x * m_pixelSize;
+            }
+
+            /// Get Pixel Array
+            ///
+            /// Allocation free version of getPixel. Will throw if out of range or if N differs from getPixelSize().
+            /// \tparam N number of components of a pixel, 3 for RGB
+            template<size_t N>
+            [[nodiscard]] std::array<pixel_value_type, N> getPixelArray( size_t x, size_t y ) const
+            {
+                checkPixel( x, y );
+                checkComponents( N );
+                return getPixelArrayUnchecked<N>( x, y );
+            }
+
+            template<size_t N>
+            [[nodiscard]] std::array<pixel_value_type, N> getPixelArrayUnchecked( size_t x, size_t y ) const
+            {
+                std::array<pixel_value_type, N> pixel;
+                const pixel_value_type* p = pixelUnchecked( x, y );
+                for ( size_t n = 0; n < N; ++n ){
+                    pixel[n] = p[n];
+                }
+                return pixel;
+            }
+
+            /// Set Pixel Array
+            ///
+            /// Allocation free version of setPixel. Will throw if out of range or if N differs from getPixelSize().
+            /// \tparam N number of components of a pixel, 3 for RGB
+            template<size_t N>
+            void setPixelArray( size_t x, size_t y, const std::array<pixel_value_type, N>& pixelValue )
+            {
+                checkPixel( x, y );
+                checkComponents( N );
+                setPixelArrayUnchecked<N>( x, y, pixelValue );
+            }
+
+            template<size_t N>
+            void setPixelArrayUnchecked( size_t x, size_t y, const std::array<pixel_value_type, N>& pixelValue )
+            {
+                pixel_value_type* p = pixelUnchecked( x, y );
+                for ( size_t n = 0; n < N; ++n ){
+                    p[n] = pixelValue[n];
+                }
+            }
+
             // Convenience function to resize image using height, width
             void resize( size_t newHeight, size_t newWidth );
 
@@ -0,0 +1,99 @@
+#include "lookup_table.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOOKUP_TABLE_X86
+#endif
+
+namespace augmentorLib {
+    namespace {
+        typedef void (*map_function)(const uint8_t* table, uint8_t* data, size_t n);
+
+        void map_scalar(const uint8_t* table, uint8_t* data, size_t n) {
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                uint8_t a = table[data[i]];
+                uint8_t b = table[data[i + 1]];
+                uint8_t c = table[data[i + 2]];
+                uint8_t d = table[data[i + 3]];
+                data[i] = a;
+                data[i + 1] = b;
+                data[i + 2] = c;
+                data[i + 3] = d;
+            }
+            for (; i < n; ++i) {
+                data[i] = table[data[i]];
+            }
+        }
+
+#ifdef LOOKUP_TABLE_X86
+        /// 64 bytes looked up per pair of vpermi2b: the low 7 bits index a 128 entry half of the table, the high
+        /// bit selects the half. A 256 entry table does not fit the 16 entries of a pshufb, and emulating it with
+        /// 16 pshufb per vector is slower than the scalar loop, so there is no AVX2 version
+        __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+        void map_avx512(const uint8_t* table, uint8_t* data, size_t n) {
+            __m512i t0 = _mm512_loadu_si512(table);
+            __m512i t1 = _mm512_loadu_si512(table + 64);
+            __m512i t2 = _mm512_loadu_si512(table + 128);
+            __m512i t3 = _mm512_loadu_si512(table + 192);
+
+            size_t i = 0;
+            for (; i + 64 <= n; i += 64) {
+                __m512i v = _mm512_loadu_si512(data + i);
+                __m512i low = _mm512_permutex2var_epi8(t0, v, t1);
+                __m512i high = _mm512_permutex2var_epi8(t2, v, t3);
+                __mmask64 upper = _mm512_movepi8_mask(v);
+                _mm512_storeu_si512(data + i, _mm512_mask_blend_epi8(upper, low, high));
+            }
+            map_scalar(table, data + i, n - i);
+        }
+#endif
+
+        map_function select_map() {
+#ifdef LOOKUP_TABLE_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw")) {
+                return map_avx512;
+            }
+#endif
+            return map_scalar;
+        }
+    }
+
+    void lookup_table::reset() {
+        for (auto& channel : channels) {
+            for (size_t v = 0; v < channel.size(); ++v) {
+                channel[v] = (uint8_t) v;
+            }
+        }
+    }
+
+    bool lookup_table::uniform() const {
+        for (size_t c = 1; c < channels.size(); ++c) {
+            if (channels[c] != channels[0]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void lookup_table::apply(uint8_t* data, size_t rows, size_t stride, size_t row_bytes, size_t pixel_size) const {
+        if (rows == 0) {
+            return;
+        }
+        static const map_function map_bytes = select_map();
+        if (uniform() || pixel_size == 1) {
+            // the rows and their padding are one contiguous block
+            map_bytes(channels[0].data(), data, (rows - 1) * stride + row_bytes);
+            return;
+        }
+        for (size_t y = 0; y < rows; ++y) {
+            auto row = data + y * stride;
+            for (size_t i = 0; i < row_bytes; i += pixel_size) {
+                for (size_t c = 0; c < pixel_size; ++c) {
+                    row[i + c] = channels[c][row[i + c]];
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef LIB_LOOKUP_TABLE_H
+#define LIB_LOOKUP_TABLE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace augmentorLib {
+
+    /// Largest number of components a pixel can have (CMYK)
+    const size_t MAX_PIXEL_SIZE = 4;
+
+    /// One 256 entry table per channel
+    ///
+    /// Pointwise operations (invert, brightness, contrast, gamma, ...) map every byte of a channel through a
+    /// function of that byte alone. Composing their tables gives a single table, so any number of consecutive
+    /// pointwise operations costs one pass over the pixels with one lookup per byte.
+    struct lookup_table {
+        typedef std::array<uint8_t, 256> channel_table;
+
+        std::array<channel_table, MAX_PIXEL_SIZE> channels;
+
+        /// Starts as the identity
+        lookup_table() {
+            reset();
+        }
+
+        void reset();
+
+        /// Compose f after the current table on every channel: table[c][v] = f(table[c][v])
+        template<typename Function>
+        void compose(Function f) {
+            for (auto& channel : channels) {
+                for (auto& value : channel) {
+                    value = f(value);
+                }
+            }
+        }
+
+        /// Compose f after the current table of one channel
+        template<typename Function>
+        void compose(size_t channel, Function f) {
+            for (auto& value : channels[channel]) {
+                value = f(value);
+            }
+        }
+
+        /// Every channel has the same table
+        [[nodiscard]] bool uniform() const;
+
+        /// Maps rows of interleaved pixels through the table in place
+        /// \param data first row
+        /// \param rows number of rows
+        /// \param stride distance between two rows in bytes
+        /// \param row_bytes used bytes of a row, the bytes up to stride are padding and may be mapped as well
+        /// \param pixel_size number of channels
+        void apply(uint8_t* data, size_t rows, size_t stride, size_t row_bytes, size_t pixel_size) const;
+    };
+}
+
+#endif //LIB_LOOKUP_TABLE_H
@@ -0,0 +1,551 @@
+#include "output_sink.h"
+#include "jpeg.h"
+#include "shm_ring.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace augmentorLib {
+    namespace {
+        /// Buffered bytes are written once there are this many
+        const size_t WRITE_BLOCK = size_t(4) << 20;
+
+        const size_t TAR_BLOCK = 512;
+
+        size_t tar_padded(size_t size) {
+            return (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        }
+
+        /// value as a zero padded octal number of width - 1 digits and a NUL
+        void tar_octal(char* field, size_t width, size_t value) {
+            std::snprintf(field, width, "%0*llo", (int) width - 1, (unsigned long long) value);
+        }
+
+        /// Tensor data starts on a page boundary, so that it can be mapped on its own
+        const size_t TENSOR_ALIGNMENT = 4096;
+
+        /// Slots of a shared memory ring and their pixels start on cache lines of their own
+        const size_t RING_ALIGNMENT = 64;
+
+        size_t round_up(size_t size, size_t alignment) {
+            return (size + alignment - 1) / alignment * alignment;
+        }
+    }
+
+    void output_sink::write_pixels(size_t, const uint8_t*, size_t, size_t, size_t, size_t) {
+        throw std::logic_error("This output sink only stores encoded images");
+    }
+
+    sharded_sink::sharded_sink(std::string directory, std::string prefix, std::string extension, size_t shard_bytes):
+            directory(std::move(directory)), prefix(std::move(prefix)), extension(std::move(extension)),
+            shard_bytes(shard_bytes) {
+        if (!this->directory.empty() && this->directory.back() != '/') {
+            this->directory += '/';
+        }
+    }
+
+    sharded_sink::~sharded_sink() {
+        // derived sinks flush in their own destructor, their trailer is gone by now
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    std::string sharded_sink::shard_path(size_t n, const std::string& ext) const {
+        char number[32];
+        std::snprintf(number, sizeof(number), "-%06zu", n);
+        return directory + prefix + number + ext;
+    }
+
+    void sharded_sink::open_shard() {
+        auto path = shard_path(shard, extension);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path + " for writing: " + std::strerror(errno));
+        }
+        ++shard;
+        written = 0;
+    }
+
+    void sharded_sink::drain() {
+        size_t done = 0;
+        while (done < buffer.size()) {
+            ssize_t n = ::write(fd, buffer.data() + done, buffer.size() - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                throw std::runtime_error("Could not write " + shard_path(current_shard(), extension) + ": " +
+                                         std::strerror(errno));
+            }
+            done += n;
+        }
+        buffer.clear();
+    }
+
+    void sharded_sink::close_shard() {
+        end_shard();
+        drain();
+        int closing = fd;
+        fd = -1;
+        if (::close(closing) != 0) {
+            throw std::runtime_error("Could not write " + shard_path(current_shard(), extension) + ": " +
+                                     std::strerror(errno));
+        }
+    }
+
+    void sharded_sink::put(const uint8_t* data, size_t size) {
+        buffer.insert(buffer.end(), data, data + size);
+        written += size;
+        if (buffer.size() >= WRITE_BLOCK) {
+            drain();
+        }
+    }
+
+    void sharded_sink::write(size_t index, const uint8_t* data, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd >= 0 && written > 0 && written + entry_size(size) > shard_bytes) {
+            close_shard();
+        }
+        if (fd < 0) {
+            open_shard();
+        }
+        append(index, data, size);
+    }
+
+    void sharded_sink::flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd >= 0) {
+            close_shard();
+        }
+    }
+
+    tar_sink::tar_sink(const std::string& directory, size_t shard_bytes, const std::string& prefix):
+            sharded_sink(directory, prefix, ".tar", shard_bytes) {
+    }
+
+    tar_sink::~tar_sink() {
+        try {
+            flush();
+        } catch (...) {
+        }
+    }
+
+    size_t tar_sink::entry_size(size_t size) const {
+        return TAR_BLOCK + tar_padded(size);
+    }
+
+    void tar_sink::append(size_t index, const uint8_t* data, size_t size) {
+        char header[TAR_BLOCK] = {};
+        std::snprintf(header, 100, "%09zu.jpg", index);     // name
+        tar_octal(header + 100, 8, 0644);                   // mode
+        tar_octal(header + 108, 8, 0);                      // uid
+        tar_octal(header + 116, 8, 0);                      // gid
+        tar_octal(header + 124, 12, size);                  // size
+        tar_octal(header + 136, 12, 0);                     // mtime
+        header[156] = '0';                                  // typeflag: regular file
+        std::memcpy(header + 257, "ustar", 6);              // magic
+        std::memcpy(header + 263, "00", 2);                 // version
+        // the checksum is computed with its own field set to spaces
+        std::memset(header + 148, ' ', 8);
+        unsigned sum = 0;
+        for (unsigned char c : header) {
+            sum += c;
+        }
+        std::snprintf(header + 148, 8, "%06o", sum);
+        header[155] = ' ';
+
+        put(reinterpret_cast<const uint8_t*>(header), TAR_BLOCK);
+        put(data, size);
+        static const uint8_t zeros[TAR_BLOCK] = {};
+        put(zeros, tar_padded(size) - size);
+    }
+
+    void tar_sink::end_shard() {
+        // end of archive: two zero blocks
+        static const uint8_t zeros[2 * TAR_BLOCK] = {};
+        put(zeros, sizeof(zeros));
+    }
+
+    record_sink::record_sink(const std::string& directory, size_t shard_bytes, const std::string& prefix):
+            sharded_sink(directory, prefix, ".rec", shard_bytes) {
+    }
+
+    record_sink::~record_sink() {
+        try {
+            flush();
+        } catch (...) {
+        }
+    }
+
+    size_t record_sink::entry_size(size_t size) const {
+        return size;
+    }
+
+    void record_sink::append(size_t index, const uint8_t* data, size_t size) {
+        entries.push_back({index, offset(), size});
+        put(data, size);
+    }
+
+    void record_sink::end_shard() {
+        auto path = shard_path(current_shard(), ".idx");
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path + " for writing: " + std::strerror(errno));
+        }
+        auto bytes = reinterpret_cast<const char*>(entries.data());
+        size_t size = entries.size() * sizeof(record_index_entry);
+        entries.clear();
+        while (size > 0) {
+            ssize_t n = ::write(fd, bytes, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                ::close(fd);
+                throw std::runtime_error("Could not write " + path + ": " + std::strerror(errno));
+            }
+            bytes += n;
+            size -= n;
+        }
+        ::close(fd);
+    }
+
+    /// An open shard mapped for writing. Writers keep it alive while they fill their slot, so that a shard
+    /// can be replaced by the next one while the last writers of the old one are still copying.
+    struct tensor_sink::shard_file {
+        std::string path;
+        int fd = -1;
+        uint8_t* map = nullptr;
+        size_t bytes = 0;
+
+        ~shard_file() {
+            if (map) {
+                ::munmap(map, bytes);
+            }
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+
+        tensor_shard_header& header() { return *reinterpret_cast<tensor_shard_header*>(map); }
+
+        uint64_t* index() { return reinterpret_cast<uint64_t*>(map + header().index_offset); }
+    };
+
+    tensor_sink::tensor_sink(const std::string& directory, const tensor_format& format, size_t tensors_per_shard,
+                             const std::string& prefix):
+            directory(directory), prefix(prefix), format(format), capacity(tensors_per_shard) {
+        if (format.height == 0 || format.width == 0 || format.channels == 0 || format.channels > 4) {
+            throw std::invalid_argument("Tensors need a size and 1 to 4 channels");
+        }
+        if (capacity == 0) {
+            throw std::invalid_argument("A tensor shard needs room for at least one tensor");
+        }
+        if (!this->directory.empty() && this->directory.back() != '/') {
+            this->directory += '/';
+        }
+        size_t samples = format.height * format.width * format.channels;
+        tensor_bytes = format.layout == tensor_layout::float_nchw ? samples * sizeof(float) : samples;
+        size_t index_end = sizeof(tensor_shard_header) + capacity * sizeof(uint64_t);
+        data_offset = (index_end + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT * TENSOR_ALIGNMENT;
+        for (size_t c = 0; c < format.channels; ++c) {
+            for (int v = 0; v < 256; ++v) {
+                normalized[c][v] = (float) ((v / 255.0 - format.mean[c]) / format.stddev[c]);
+            }
+        }
+    }
+
+    tensor_sink::~tensor_sink() {
+        try {
+            flush();
+        } catch (...) {
+        }
+    }
+
+    std::shared_ptr<tensor_sink::shard_file> tensor_sink::open_shard() {
+        char number[32];
+        std::snprintf(number, sizeof(number), "-%06zu.tensor", shard);
+        auto file = std::make_shared<shard_file>();
+        file->path = directory + prefix + number;
+        file->bytes = data_offset + capacity * tensor_bytes;
+        file->fd = ::open(file->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (file->fd < 0) {
+            throw std::runtime_error("Could not open " + file->path + " for writing: " + std::strerror(errno));
+        }
+        // allocated up front: a full disk shows here and not as a SIGBUS on some later store into the mapping
+        int error = ::posix_fallocate(file->fd, 0, (off_t) file->bytes);
+        if (error != 0) {
+            throw std::runtime_error("Could not allocate " + file->path + ": " + std::strerror(error));
+        }
+        void* map = ::mmap(nullptr, file->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+        if (map == MAP_FAILED) {
+            throw std::runtime_error("Could not map " + file->path + ": " + std::strerror(errno));
+        }
+        file->map = static_cast<uint8_t*>(map);
+        ++shard;
+
+        auto& header = file->header();
+        std::memcpy(header.magic, "AUGTENS", 8);
+        header.version = 1;
+        header.layout = static_cast<uint32_t>(format.layout);
+        header.capacity = capacity;
+        header.count = 0;
+        header.height = format.height;
+        header.width = format.width;
+        header.channels = format.channels;
+        header.tensor_bytes = tensor_bytes;
+        header.index_offset = sizeof(tensor_shard_header);
+        header.data_offset = data_offset;
+        for (size_t c = 0; c < 4; ++c) {
+            header.mean[c] = format.mean[c];
+            header.stddev[c] = format.stddev[c];
+        }
+        return file;
+    }
+
+    void tensor_sink::close_shard() {
+        auto closing = std::move(current);
+        size_t count = closing->header().count;
+        if (count < capacity) {
+            // the header must not promise the slots cut off
+            closing->header().capacity = count;
+            if (::ftruncate(closing->fd, (off_t) (data_offset + count * tensor_bytes)) != 0) {
+                throw std::runtime_error("Could not shrink " + closing->path + ": " + std::strerror(errno));
+            }
+        }
+    }
+
+    void tensor_sink::write(size_t index, const uint8_t* data, size_t size) {
+        jpegimageSTL::jpeg::Image image(data, size);
+        write_pixels(index, image.data(), image.getWidth(), image.getHeight(), image.getPixelSize(),
+                     image.stride());
+    }
+
+    void tensor_sink::write_pixels(size_t index, const uint8_t* pixels, size_t width, size_t height,
+                                   size_t channels, size_t stride) {
+        if (width != format.width || height != format.height || channels != format.channels) {
+            throw std::runtime_error("Output " + std::to_string(index) + " is " + std::to_string(width) + "x" +
+                                     std::to_string(height) + "x" + std::to_string(channels) +
+                                     ", the tensor shards hold " + std::to_string(format.width) + "x" +
+                                     std::to_string(format.height) + "x" + std::to_string(format.channels));
+        }
+        std::shared_ptr<shard_file> file;
+        size_t slot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (current && current->header().count == capacity) {
+                current.reset();    // full, nothing to shrink: unmapped once its last writer is done
+            }
+            if (!current) {
+                current = open_shard();
+            }
+            file = current;
+            slot = file->header().count++;
+            file->index()[slot] = index;
+        }
+
+        // the copy runs outside the lock, writers of different slots do not wait on each other
+        uint8_t* tensor = file->map + data_offset + slot * tensor_bytes;
+        size_t row_bytes = width * channels;
+        if (format.layout == tensor_layout::uint8_hwc) {
+            if (stride == row_bytes) {
+                std::memcpy(tensor, pixels, row_bytes * height);
+                return;
+            }
+            for (size_t y = 0; y < height; ++y) {
+                std::memcpy(tensor + y * row_bytes, pixels + y * stride, row_bytes);
+            }
+            return;
+        }
+        auto planes = reinterpret_cast<float*>(tensor);
+        size_t plane = width * height;
+        for (size_t c = 0; c < channels; ++c) {
+            const float* lut = normalized[c];
+            float* out = planes + c * plane;
+            for (size_t y = 0; y < height; ++y) {
+                const uint8_t* row = pixels + y * stride + c;
+                for (size_t x = 0; x < width; ++x) {
+                    out[x] = lut[row[x * channels]];
+                }
+                out += width;
+            }
+        }
+    }
+
+    void tensor_sink::flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (current) {
+            close_shard();
+        }
+    }
+
+    shm_ring_sink::shm_ring_sink(const std::string& name, size_t frame_bytes, size_t slot_count,
+                                 size_t frames_per_slot, double timeout): name(name) {
+        if (frame_bytes == 0 || slot_count == 0 || frames_per_slot == 0) {
+            throw std::invalid_argument("A shared memory ring needs room for at least one frame");
+        }
+        // with a single slot, published (s + 1) would read as writable by the next lap (s + slot_count)
+        if (slot_count < 2) {
+            throw std::invalid_argument("A shared memory ring needs at least two slots");
+        }
+        if (!(timeout > 0)) {
+            throw std::invalid_argument("A shared memory ring needs a positive timeout");
+        }
+        timeout_ns = (uint64_t) (timeout * 1e9);
+        size_t pixels_offset = round_up(sizeof(augshm_slot) + frames_per_slot * sizeof(augshm_frame), RING_ALIGNMENT);
+        size_t slot_bytes = round_up(pixels_offset + frames_per_slot * frame_bytes, RING_ALIGNMENT);
+        size_t slots_offset = round_up(sizeof(augshm_header), RING_ALIGNMENT);
+        map_size = slots_offset + slot_count * slot_bytes;
+
+        // a ring left behind by a crashed run is replaced, consumers still mapping it keep their copy
+        ::shm_unlink(name.c_str());
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            throw std::runtime_error("Could not create shared memory " + name + ": " + std::strerror(errno));
+        }
+        if (::ftruncate(fd, (off_t) map_size) != 0) {
+            int error = errno;
+            ::close(fd);
+            ::shm_unlink(name.c_str());
+            throw std::runtime_error("Could not size shared memory " + name + ": " + std::strerror(error));
+        }
+        map = ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int error = errno;
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            map = nullptr;
+            ::shm_unlink(name.c_str());
+            throw std::runtime_error("Could not map shared memory " + name + ": " + std::strerror(error));
+        }
+
+        // the object starts zeroed: only the geometry and the slot sequences need setting
+        auto header = static_cast<augshm_header*>(map);
+        std::memcpy(header->magic, AUGSHM_MAGIC, 8);
+        header->size = map_size;
+        header->slot_count = slot_count;
+        header->frames_per_slot = frames_per_slot;
+        header->frame_bytes = frame_bytes;
+        header->slot_bytes = slot_bytes;
+        header->slots_offset = slots_offset;
+        header->pixels_offset = pixels_offset;
+        for (size_t s = 0; s < slot_count; ++s) {
+            augshm_slot_number(header, s)->sequence = s;
+        }
+        __atomic_store_n(&header->version, AUGSHM_VERSION, __ATOMIC_RELEASE);
+    }
+
+    shm_ring_sink::~shm_ring_sink() {
+        try {
+            flush();
+        } catch (...) {
+        }
+        __atomic_store_n(&static_cast<augshm_header*>(map)->closed, 1, __ATOMIC_RELEASE);
+        ::munmap(map, map_size);
+        ::shm_unlink(name.c_str());
+    }
+
+    void shm_ring_sink::write(size_t index, const uint8_t* data, size_t size) {
+        jpegimageSTL::jpeg::Image image(data, size);
+        write_pixels(index, image.data(), image.getWidth(), image.getHeight(), image.getPixelSize(),
+                     image.stride());
+    }
+
+    void shm_ring_sink::write_pixels(size_t index, const uint8_t* pixels, size_t width, size_t height,
+                                     size_t channels, size_t stride) {
+        auto header = static_cast<augshm_header*>(map);
+        if (broken.load(std::memory_order_relaxed)) {
+            throw std::runtime_error("Shared memory ring " + name + " was broken by an earlier write");
+        }
+        size_t row_bytes = width * channels;
+        if (row_bytes * height > header->frame_bytes) {
+            throw std::runtime_error("Output " + std::to_string(index) + " is " + std::to_string(width) + "x" +
+                                     std::to_string(height) + "x" + std::to_string(channels) +
+                                     ", more than the " + std::to_string(header->frame_bytes) +
+                                     " bytes of a shared memory frame");
+        }
+        // frame p goes to place p % frames_per_slot of slot number p / frames_per_slot
+        uint64_t frame = __atomic_fetch_add(&header->write_position, 1, __ATOMIC_RELAXED);
+        uint64_t number = frame / header->frames_per_slot;
+        uint64_t k = frame % header->frames_per_slot;
+        augshm_slot* slot = augshm_slot_number(header, number);
+        unsigned spins = 0;
+        uint64_t waiting_since = 0;
+        while (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != number) {
+            augshm_backoff(&spins);     // the consumer still holds the previous lap of this slot
+            if (spins % 64 == 0) {
+                if (waiting_since == 0) {
+                    waiting_since = augshm_now();
+                }
+                check_consumer(waiting_since);
+            }
+        }
+
+        auto descriptor = reinterpret_cast<augshm_frame*>(slot + 1) + k;
+        descriptor->index = index;
+        descriptor->width = (uint32_t) width;
+        descriptor->height = (uint32_t) height;
+        descriptor->channels = (uint32_t) channels;
+        auto out = reinterpret_cast<uint8_t*>(slot) + header->pixels_offset + k * header->frame_bytes;
+        if (stride == row_bytes) {
+            std::memcpy(out, pixels, row_bytes * height);
+        } else {
+            for (size_t y = 0; y < height; ++y) {
+                std::memcpy(out + y * row_bytes, pixels + y * stride, row_bytes);
+            }
+        }
+
+        if (__atomic_add_fetch(&slot->filled, 1, __ATOMIC_ACQ_REL) == header->frames_per_slot) {
+            slot->filled = 0;
+            slot->count = header->frames_per_slot;
+            __atomic_store_n(&slot->sequence, number + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    void shm_ring_sink::check_consumer(uint64_t waiting_since) {
+        auto header = static_cast<augshm_header*>(map);
+        auto fail = [&](const std::string& reason) {
+            broken.store(true, std::memory_order_relaxed);
+            throw std::runtime_error("Shared memory ring " + name + " is full and " + reason);
+        };
+        if (broken.load(std::memory_order_relaxed)) {
+            fail("broken by an earlier write");
+        }
+        auto pid = __atomic_load_n(&header->consumer_pid, __ATOMIC_ACQUIRE);
+        if (pid != 0 && ::kill((pid_t) pid, 0) != 0 && errno == ESRCH) {
+            fail("its consumer, process " + std::to_string(pid) + ", is gone");
+        }
+        uint64_t heartbeat = __atomic_load_n(&header->heartbeat, __ATOMIC_RELAXED);
+        uint64_t now = augshm_now();
+        bool silent = pid != 0 && heartbeat < now && now - heartbeat > timeout_ns;
+        if (now - waiting_since <= timeout_ns && !silent) {
+            return;
+        }
+        char seconds[32];
+        std::snprintf(seconds, sizeof(seconds), "%g s", timeout_ns / 1e9);
+        fail(pid == 0 ? std::string("no consumer attached within ") + seconds
+                      : std::string("its consumer made no progress for ") + seconds);
+    }
+
+    void shm_ring_sink::flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto header = static_cast<augshm_header*>(map);
+        uint64_t frames = __atomic_load_n(&header->write_position, __ATOMIC_ACQUIRE);
+        uint64_t partial = frames % header->frames_per_slot;
+        if (partial == 0) {
+            return;
+        }
+        // every writer has returned: the partial slot holds exactly its claimed frames
+        uint64_t number = frames / header->frames_per_slot;
+        augshm_slot* slot = augshm_slot_number(header, number);
+        __atomic_store_n(&header->write_position, (number + 1) * header->frames_per_slot, __ATOMIC_RELAXED);
+        slot->filled = 0;
+        slot->count = partial;
+        __atomic_store_n(&slot->sequence, number + 1, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,280 @@
+#ifndef LIB_OUTPUT_SINK_H
+#define LIB_OUTPUT_SINK_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace augmentorLib {
+
+    /// Where encoded outputs go instead of one output_N.jpg file each
+    ///
+    /// At millions of outputs, a file per output costs a create, a write and a close each, plus a directory too
+    /// large to list. A sink appends the outputs to a few large shard files: the writes are large and
+    /// sequential, and loaders can stream the shards.
+    class output_sink {
+    public:
+        virtual ~output_sink() = default;
+
+        /// Stores the encoded JPEG of output index. Called from several threads at once, in no particular order.
+        virtual void write(size_t index, const uint8_t* data, size_t size) = 0;
+
+        /// Completes the current shard on disk. The next write starts a new one.
+        virtual void flush() = 0;
+
+        /// Sinks that store decoded pixels instead of JPEG files return true. Every output then takes the pixel
+        /// path and reaches write_pixels(): nothing is encoded, copied or transcoded.
+        [[nodiscard]] virtual bool takes_pixels() const { return false; }
+
+        /// Stores the decoded pixels of output index: height rows of width * channels samples, row y starting
+        /// at pixels + y * stride. Called like write(), only when takes_pixels() is true.
+        virtual void write_pixels(size_t index, const uint8_t* pixels, size_t width, size_t height, size_t channels,
+                                  size_t stride);
+    };
+
+    /// Shard files of bounded size: prefix-000000<extension>, prefix-000001<extension>, ...
+    ///
+    /// An output goes to a new shard when the current one would grow past shard_bytes (a single larger output
+    /// still gets a shard of its own). Bytes are buffered and written to the shard in large blocks.
+    class sharded_sink : public output_sink {
+    private:
+        std::mutex mutex;
+        std::string directory;
+        std::string prefix;
+        std::string extension;
+        size_t shard_bytes;
+
+        int fd = -1;
+        size_t shard = 0;           // number of the next shard to open
+        size_t written = 0;         // bytes of the current shard, buffered ones included
+        std::vector<uint8_t> buffer;
+
+        void open_shard();
+        void close_shard();
+        void drain();
+
+    protected:
+        /// Number of the current shard, valid while one is open
+        [[nodiscard]] size_t current_shard() const { return shard - 1; }
+
+        /// Offset of the next byte in the current shard
+        [[nodiscard]] size_t offset() const { return written; }
+
+        /// Path of shard number n with the given extension
+        [[nodiscard]] std::string shard_path(size_t n, const std::string& ext) const;
+
+        /// Appends bytes to the current shard
+        void put(const uint8_t* data, size_t size);
+
+        /// Bytes an output of size bytes adds to a shard
+        [[nodiscard]] virtual size_t entry_size(size_t size) const = 0;
+
+        /// Appends one output to the current shard with put()
+        virtual void append(size_t index, const uint8_t* data, size_t size) = 0;
+
+        /// Appends the trailer of the current shard before it is closed
+        virtual void end_shard() {}
+
+    public:
+        sharded_sink(std::string directory, std::string prefix, std::string extension, size_t shard_bytes);
+
+        /// Completes the last shard, errors are lost: call flush() to see them
+        ~sharded_sink() override;
+
+        void write(size_t index, const uint8_t* data, size_t size) override;
+
+        void flush() override;
+    };
+
+    /// POSIX ustar shards as read by WebDataset: output index is member %09d.jpg, so its sample key is the
+    /// zero padded index and its only field is "jpg"
+    class tar_sink : public sharded_sink {
+    protected:
+        [[nodiscard]] size_t entry_size(size_t size) const override;
+        void append(size_t index, const uint8_t* data, size_t size) override;
+        void end_shard() override;
+
+    public:
+        /// \param directory existing directory the shards are written to
+        /// \param shard_bytes largest size of a shard, 1 GiB by default
+        /// \param prefix shard file names start with it
+        explicit tar_sink(const std::string& directory, size_t shard_bytes = size_t(1) << 30,
+                          const std::string& prefix = "shard");
+
+        ~tar_sink() override;
+    };
+
+    /// Record shards: prefix-N.rec holds the JPEG files back to back, prefix-N.idx one record_index_entry per
+    /// output in the order they were written
+    class record_sink : public sharded_sink {
+    public:
+        /// Entry of an .idx file, native byte order
+        struct record_index_entry {
+            uint64_t index;     // output index, the N of output_N.jpg
+            uint64_t offset;    // first byte of the JPEG in the .rec file
+            uint64_t size;      // bytes of the JPEG
+        };
+
+    private:
+        std::vector<record_index_entry> entries;
+
+    protected:
+        [[nodiscard]] size_t entry_size(size_t size) const override;
+        void append(size_t index, const uint8_t* data, size_t size) override;
+        void end_shard() override;
+
+    public:
+        /// \param directory existing directory the shards are written to
+        /// \param shard_bytes largest size of a .rec file, 1 GiB by default
+        /// \param prefix shard file names start with it
+        explicit record_sink(const std::string& directory, size_t shard_bytes = size_t(1) << 30,
+                             const std::string& prefix = "shard");
+
+        ~record_sink() override;
+    };
+
+    /// Element type and order of the tensors of a tensor_sink
+    enum class tensor_layout : uint32_t {
+        uint8_hwc = 0,      // the samples as decoded: row by row, channels interleaved
+        float_nchw = 1,     // float32 planes, one per channel, normalized with mean and stddev
+    };
+
+    /// Size, layout and normalization of the tensors of a tensor_sink
+    struct tensor_format {
+        size_t height = 0;
+        size_t width = 0;
+        size_t channels = 3;
+        tensor_layout layout = tensor_layout::uint8_hwc;
+        /// float_nchw stores (sample / 255 - mean[c]) / stddev[c] for channel c, uint8_hwc ignores both
+        std::array<float, 4> mean{{0, 0, 0, 0}};
+        std::array<float, 4> stddev{{1, 1, 1, 1}};
+    };
+
+    /// First bytes of a tensor shard, native byte order
+    struct tensor_shard_header {
+        char magic[8];              // "AUGTENS" and a NUL
+        uint32_t version;           // 1
+        uint32_t layout;            // a tensor_layout
+        uint64_t capacity;          // number of tensor slots in the file, count once a short last shard is shrunk
+        uint64_t count;             // slots [0, count) hold a tensor
+        uint64_t height;
+        uint64_t width;
+        uint64_t channels;
+        uint64_t tensor_bytes;      // size of one tensor, the distance between two slots
+        uint64_t index_offset;      // at least capacity uint64 output indices, the N of output_N.jpg of every slot
+        uint64_t data_offset;       // first byte of slot 0, page aligned
+        float mean[4];
+        float stddev[4];
+    };
+
+    /// Raw tensor shards for training jobs that would otherwise decode every JPEG they are given
+    ///
+    /// prefix-N.tensor holds a tensor_shard_header, the output index of every slot and capacity fixed size
+    /// tensors back to back. The file is allocated at its full size when it is opened and written through a
+    /// shared mapping: the final image of an output is copied (uint8_hwc) or converted (float_nchw) straight
+    /// into its slot, it is never encoded and no intermediate buffer is made. A trainer maps the file and
+    /// views data_offset on as an array of count tensors, at no decode cost. The last shard is shrunk to
+    /// its count on flush().
+    ///
+    /// Every output must have the height, width and channels of the format, so the chain has to end with a
+    /// fixed size resize or crop. Outputs of another size throw.
+    class tensor_sink : public output_sink {
+    private:
+        struct shard_file;
+
+        std::mutex mutex;
+        std::string directory;
+        std::string prefix;
+        tensor_format format;
+        size_t capacity;
+        size_t tensor_bytes;
+        size_t data_offset;
+        float normalized[4][256];   // float value of every sample value, per channel
+
+        size_t shard = 0;           // number of the next shard to open
+        std::shared_ptr<shard_file> current;
+
+        std::shared_ptr<shard_file> open_shard();
+        void close_shard();
+
+    public:
+        /// \param directory existing directory the shards are written to
+        /// \param format size and layout of every tensor
+        /// \param tensors_per_shard number of tensor slots of a shard
+        /// \param prefix shard file names start with it
+        tensor_sink(const std::string& directory, const tensor_format& format, size_t tensors_per_shard = 4096,
+                    const std::string& prefix = "shard");
+
+        /// Shrinks the last shard, errors are lost: call flush() to see them
+        ~tensor_sink() override;
+
+        /// Decodes the JPEG and stores its pixels, for outputs that reach the sink encoded
+        void write(size_t index, const uint8_t* data, size_t size) override;
+
+        void flush() override;
+
+        [[nodiscard]] bool takes_pixels() const override { return true; }
+
+        void write_pixels(size_t index, const uint8_t* pixels, size_t width, size_t height, size_t channels,
+                          size_t stride) override;
+    };
+
+    /// Publishes the final pixels of every output into a POSIX shared memory ring read by another process
+    ///
+    /// For a trainer running beside the augmentor: frames reach it through memory shared by both processes,
+    /// with no file, encode or decode in between, and the trainer reads them in place. The layout and a C
+    /// consumer are in shm_ring.h. Images are published in batches of frames_per_slot; a full ring blocks the
+    /// writers until the consumer hands slots back. flush() publishes the last, partial batch.
+    ///
+    /// A blocked writer throws std::runtime_error instead of waiting forever when no consumer attached within
+    /// the timeout, when the attached process is gone, or when it neither took nor handed back a slot for the
+    /// timeout. The ring is then broken and every later write throws as well.
+    ///
+    /// The name is removed when the sink is destroyed, after the ring is marked closed: a consumer that has
+    /// mapped it reads what is left and then sees the end.
+    class shm_ring_sink : public output_sink {
+    private:
+        std::mutex mutex;           // flush() against itself, writers never take it
+        std::string name;
+        void* map = nullptr;
+        size_t map_size = 0;
+        uint64_t timeout_ns;
+        std::atomic<bool> broken{false};
+
+        /// Throws if the consumer is gone or the writer waited longer than the timeout since waiting_since
+        void check_consumer(uint64_t waiting_since);
+
+    public:
+        /// \param name shared memory object name, "/something". An object of that name is replaced.
+        /// \param frame_bytes largest width * height * channels of an output
+        /// \param slot_count batches the ring holds, at least 2
+        /// \param frames_per_slot images in a batch
+        /// \param timeout seconds a writer waits on a full ring for a consumer that attaches or makes progress
+        shm_ring_sink(const std::string& name, size_t frame_bytes, size_t slot_count = 16,
+                      size_t frames_per_slot = 1, double timeout = 30);
+
+        /// Publishes the last batch, closes the ring and removes its name. Errors are lost.
+        ~shm_ring_sink() override;
+
+        shm_ring_sink(const shm_ring_sink&) = delete;
+        shm_ring_sink& operator=(const shm_ring_sink&) = delete;
+
+        /// Decodes the JPEG and publishes its pixels, for outputs that reach the sink encoded
+        void write(size_t index, const uint8_t* data, size_t size) override;
+
+        /// Publishes the partial batch, if any. Called once every write has returned.
+        void flush() override;
+
+        [[nodiscard]] bool takes_pixels() const override { return true; }
+
+        void write_pixels(size_t index, const uint8_t* pixels, size_t width, size_t height, size_t channels,
+                          size_t stride) override;
+    };
+}
+
+#endif //LIB_OUTPUT_SINK_H
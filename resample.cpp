@@ -0,0 +1,336 @@
+#include "resample.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLE_X86
+#endif
+
+namespace augmentorLib {
+    namespace {
+        const int F = affine_resampler::FRACTION_BITS;
+        const int64_t HALF = (int64_t) 1 << (F - 1);
+        const int WEIGHT_SHIFT = F - affine_resampler::WEIGHT_BITS;
+        const int WEIGHT_ONE = 1 << affine_resampler::WEIGHT_BITS;
+        const int OUTPUT_SHIFT = 2 * affine_resampler::WEIGHT_BITS;
+
+        /// Largest coefficient of a map, in pixels, so that coordinates stay far from overflowing
+        const double MAX_COEFFICIENT = (double) (1 << 30);
+
+        /// n output pixels from the source coordinates (u, v) of the first one and their step (du, dv)
+        typedef void (*sample_function)(const uint8_t* source, size_t stride, size_t pixel_size, int64_t u,
+                                        int64_t v, int64_t du, int64_t dv, uint8_t* out, size_t n);
+
+        /// The same for whole blocks of 8 pixels, returns how many pixels it sampled
+        typedef size_t (*block_function)(const uint8_t* source, size_t stride, int64_t u, int64_t v, int64_t du,
+                                         int64_t dv, uint8_t* out, size_t n);
+
+        struct resample_kernels {
+            sample_function nearest;
+            sample_function bilinear;           // all 4 pixels inside the source
+            block_function bilinear_blocks;     // the same, nullptr if there is no SIMD version
+        };
+
+        int64_t floor_div(int64_t n, int64_t d) {
+            int64_t q = n / d;
+            return (n % d != 0 && (n < 0) != (d < 0)) ? q - 1 : q;
+        }
+
+        int64_t ceil_div(int64_t n, int64_t d) {
+            return -floor_div(-n, d);
+        }
+
+        /// Restricts [begin, end) to the x with lo <= a + b * x < hi, end is at least begin
+        void restrict_to(int64_t a, int64_t b, int64_t lo, int64_t hi, int64_t& begin, int64_t& end) {
+            if (b == 0) {
+                if (a < lo || a >= hi) {
+                    end = begin;
+                }
+                return;
+            }
+            int64_t first = b > 0 ? ceil_div(lo - a, b) : floor_div(hi - a, b) + 1;
+            int64_t past = b > 0 ? ceil_div(hi - a, b) : floor_div(lo - a, b) + 1;
+            begin = std::max(begin, first);
+            end = std::max(begin, std::min(end, past));
+        }
+
+        inline uint8_t interpolate(int p00, int p01, int p10, int p11, int fx, int fy) {
+            int top = p00 * (WEIGHT_ONE - fx) + p01 * fx;
+            int bottom = p10 * (WEIGHT_ONE - fx) + p11 * fx;
+            return (uint8_t) ((top * (WEIGHT_ONE - fy) + bottom * fy + (1 << (OUTPUT_SHIFT - 1))) >> OUTPUT_SHIFT);
+        }
+
+        inline int weight(int64_t coordinate) {
+            return (int) ((coordinate >> WEIGHT_SHIFT) & (WEIGHT_ONE - 1));
+        }
+
+        /// PixelSize channels, 0 for pixel_size of them
+        template<size_t PixelSize>
+        void nearest_scalar(const uint8_t* source, size_t stride, size_t pixel_size, int64_t u, int64_t v,
+                            int64_t du, int64_t dv, uint8_t* out, size_t n) {
+            const size_t ps = PixelSize ? PixelSize : pixel_size;
+            for (size_t i = 0; i < n; ++i, u += du, v += dv, out += ps) {
+                std::memcpy(out, source + (size_t) ((v + HALF) >> F) * stride + (size_t) ((u + HALF) >> F) * ps, ps);
+            }
+        }
+
+        template<size_t PixelSize>
+        void bilinear_scalar(const uint8_t* source, size_t stride, size_t pixel_size, int64_t u, int64_t v,
+                             int64_t du, int64_t dv, uint8_t* out, size_t n) {
+            const size_t ps = PixelSize ? PixelSize : pixel_size;
+            for (size_t i = 0; i < n; ++i, u += du, v += dv, out += ps) {
+                const uint8_t* top = source + (size_t) (v >> F) * stride + (size_t) (u >> F) * ps;
+                const uint8_t* bottom = top + stride;
+                int fx = weight(u);
+                int fy = weight(v);
+                for (size_t c = 0; c < ps; ++c) {
+                    out[c] = interpolate(top[c], top[c + ps], bottom[c], bottom[c + ps], fx, fy);
+                }
+            }
+        }
+
+        /// Bilinear sampling along the border, where the pixels around the position may lie outside the source
+        void bilinear_clamped(const uint8_t* source, size_t stride, size_t pixel_size, size_t width, size_t height,
+                              int64_t u, int64_t v, int64_t du, int64_t dv, uint8_t* out, size_t n) {
+            const int64_t right = (int64_t) width - 1;
+            const int64_t bottom = (int64_t) height - 1;
+            for (size_t i = 0; i < n; ++i, u += du, v += dv, out += pixel_size) {
+                int64_t x = u >> F;
+                int64_t y = v >> F;
+                size_t x0 = (size_t) std::clamp(x, (int64_t) 0, right) * pixel_size;
+                size_t x1 = (size_t) std::clamp(x + 1, (int64_t) 0, right) * pixel_size;
+                const uint8_t* row0 = source + (size_t) std::clamp(y, (int64_t) 0, bottom) * stride;
+                const uint8_t* row1 = source + (size_t) std::clamp(y + 1, (int64_t) 0, bottom) * stride;
+                int fx = weight(u);
+                int fy = weight(v);
+                for (size_t c = 0; c < pixel_size; ++c) {
+                    out[c] = interpolate(row0[x0 + c], row0[x1 + c], row1[x0 + c], row1[x1 + c], fx, fy);
+                }
+            }
+        }
+
+#ifdef RESAMPLE_X86
+        /// 8 pixels per step. Every gather loads 4 bytes per pixel, so a pixel of fewer channels reads a few bytes
+        /// past it: the caller keeps the rows read off the last row of the source. The 4 channels of a pixel go
+        /// through the lanes together: the bytes of the left and right pixels are interleaved for pmaddubsw with
+        /// the horizontal weights, the sums of the top and bottom rows for pmaddwd with the vertical ones.
+        template<size_t PixelSize>
+        __attribute__((target("avx2")))
+        size_t bilinear_avx2(const uint8_t* source, size_t stride, int64_t u, int64_t v, int64_t du, int64_t dv,
+                             uint8_t* out, size_t n) {
+            // coordinates are within 16 bits of pixels, offsets within 31 bits: 32-bit lanes compute them
+            // exactly, wrapping the same way as the 64-bit start and step they are truncated from
+            const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            __m256i us = _mm256_add_epi32(_mm256_set1_epi32((int32_t) u),
+                                          _mm256_mullo_epi32(lanes, _mm256_set1_epi32((int32_t) du)));
+            __m256i vs = _mm256_add_epi32(_mm256_set1_epi32((int32_t) v),
+                                          _mm256_mullo_epi32(lanes, _mm256_set1_epi32((int32_t) dv)));
+            const __m256i u_step = _mm256_set1_epi32((int32_t) (du * 8));
+            const __m256i v_step = _mm256_set1_epi32((int32_t) (dv * 8));
+            const __m256i row_bytes = _mm256_set1_epi32((int32_t) stride);
+            const __m256i pixel_bytes = _mm256_set1_epi32((int32_t) PixelSize);
+            const __m256i fraction = _mm256_set1_epi32(WEIGHT_ONE - 1);
+            const __m256i one = _mm256_set1_epi32(WEIGHT_ONE);
+            const __m256i round = _mm256_set1_epi32(1 << (OUTPUT_SHIFT - 1));
+            const auto* top_left = reinterpret_cast<const int*>(source);
+            const auto* top_right = reinterpret_cast<const int*>(source + PixelSize);
+            const auto* bottom_left = reinterpret_cast<const int*>(source + stride);
+            const auto* bottom_right = reinterpret_cast<const int*>(source + stride + PixelSize);
+
+            // the first PixelSize bytes of each 4, in both halves
+            alignas(32) int8_t compact[32];
+            for (int j = 0; j < 32; ++j) {
+                int k = j % 16;
+                compact[j] = (int8_t) (k < 4 * (int) PixelSize ? (k / PixelSize) * 4 + k % PixelSize : 0x80);
+            }
+            const __m256i pack = _mm256_load_si256(reinterpret_cast<const __m256i*>(compact));
+
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8, out += 8 * PixelSize) {
+                __m256i offsets = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(vs, F), row_bytes),
+                                                   _mm256_mullo_epi32(_mm256_srai_epi32(us, F), pixel_bytes));
+                __m256i p00 = _mm256_i32gather_epi32(top_left, offsets, 1);
+                __m256i p01 = _mm256_i32gather_epi32(top_right, offsets, 1);
+                __m256i p10 = _mm256_i32gather_epi32(bottom_left, offsets, 1);
+                __m256i p11 = _mm256_i32gather_epi32(bottom_right, offsets, 1);
+
+                // bytes (1 - fx, fx) twice per lane, words (1 - fy, fy) once
+                __m256i fx = _mm256_and_si256(_mm256_srli_epi32(us, WEIGHT_SHIFT), fraction);
+                __m256i fy = _mm256_and_si256(_mm256_srli_epi32(vs, WEIGHT_SHIFT), fraction);
+                __m256i wx = _mm256_or_si256(_mm256_sub_epi32(one, fx), _mm256_slli_epi32(fx, 8));
+                wx = _mm256_or_si256(wx, _mm256_slli_epi32(wx, 16));
+                __m256i wy = _mm256_or_si256(_mm256_sub_epi32(one, fy), _mm256_slli_epi32(fy, 16));
+
+                // lanes 0 and 1 of each half, then 2 and 3: 4 channels of 2 pixels per register
+                __m256i wx_low = _mm256_unpacklo_epi32(wx, wx);
+                __m256i wx_high = _mm256_unpackhi_epi32(wx, wx);
+                __m256i top_low = _mm256_maddubs_epi16(_mm256_unpacklo_epi8(p00, p01), wx_low);
+                __m256i top_high = _mm256_maddubs_epi16(_mm256_unpackhi_epi8(p00, p01), wx_high);
+                __m256i bottom_low = _mm256_maddubs_epi16(_mm256_unpacklo_epi8(p10, p11), wx_low);
+                __m256i bottom_high = _mm256_maddubs_epi16(_mm256_unpackhi_epi8(p10, p11), wx_high);
+
+                // one lane of each half per register
+                __m256i r0 = _mm256_madd_epi16(_mm256_unpacklo_epi16(top_low, bottom_low),
+                                               _mm256_shuffle_epi32(wy, 0x00));
+                __m256i r1 = _mm256_madd_epi16(_mm256_unpackhi_epi16(top_low, bottom_low),
+                                               _mm256_shuffle_epi32(wy, 0x55));
+                __m256i r2 = _mm256_madd_epi16(_mm256_unpacklo_epi16(top_high, bottom_high),
+                                               _mm256_shuffle_epi32(wy, 0xaa));
+                __m256i r3 = _mm256_madd_epi16(_mm256_unpackhi_epi16(top_high, bottom_high),
+                                               _mm256_shuffle_epi32(wy, 0xff));
+                r0 = _mm256_srli_epi32(_mm256_add_epi32(r0, round), OUTPUT_SHIFT);
+                r1 = _mm256_srli_epi32(_mm256_add_epi32(r1, round), OUTPUT_SHIFT);
+                r2 = _mm256_srli_epi32(_mm256_add_epi32(r2, round), OUTPUT_SHIFT);
+                r3 = _mm256_srli_epi32(_mm256_add_epi32(r3, round), OUTPUT_SHIFT);
+                __m256i pixels = _mm256_packus_epi16(_mm256_packs_epi32(r0, r1), _mm256_packs_epi32(r2, r3));
+
+                if (PixelSize == 4) {
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), pixels);
+                } else {
+                    alignas(32) uint8_t bytes[32];
+                    _mm256_store_si256(reinterpret_cast<__m256i*>(bytes), _mm256_shuffle_epi8(pixels, pack));
+                    std::memcpy(out, bytes, 4 * PixelSize);
+                    std::memcpy(out + 4 * PixelSize, bytes + 16, 4 * PixelSize);
+                }
+                us = _mm256_add_epi32(us, u_step);
+                vs = _mm256_add_epi32(vs, v_step);
+            }
+            return i;
+        }
+#endif
+
+        bool has_avx2() {
+#ifdef RESAMPLE_X86
+            static const bool supported = []() {
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx2") != 0;
+            }();
+            return supported;
+#else
+            return false;
+#endif
+        }
+
+        template<size_t PixelSize>
+        resample_kernels kernels_of() {
+            resample_kernels run{nearest_scalar<PixelSize>, bilinear_scalar<PixelSize>, nullptr};
+#ifdef RESAMPLE_X86
+            if constexpr (PixelSize >= 1 && PixelSize <= 4) {
+                if (has_avx2()) {
+                    run.bilinear_blocks = bilinear_avx2<PixelSize>;
+                }
+            }
+#endif
+            return run;
+        }
+
+        const resample_kernels& select_kernels(size_t pixel_size) {
+            static const resample_kernels table[] = {
+                    kernels_of<0>(), kernels_of<1>(), kernels_of<2>(), kernels_of<3>(), kernels_of<4>()
+            };
+            return table[pixel_size <= 4 ? pixel_size : 0];
+        }
+    }
+
+    affine_resampler::affine_resampler(const affine_transform& inverse, size_t width, size_t height,
+                                       bool bilinear): source_width{width}, source_height{height},
+                                                       bilinear{bilinear} {
+        for (double coefficient : {inverse.xx, inverse.xy, inverse.x0, inverse.yx, inverse.yy, inverse.y0}) {
+            if (!(std::abs(coefficient) <= MAX_COEFFICIENT)) {
+                throw std::invalid_argument("Affine map out of range for resampling");
+            }
+        }
+        const double one = (double) ((int64_t) 1 << F);
+        column_u = std::llround(inverse.xx * one);
+        column_v = std::llround(inverse.yx * one);
+        row_u = std::llround(inverse.xy * one);
+        row_v = std::llround(inverse.yy * one);
+        origin_u = std::llround(inverse.x0 * one);
+        origin_v = std::llround(inverse.y0 * one);
+    }
+
+    affine_resampler::span affine_resampler::covered(size_t y, size_t width) const {
+        int64_t begin = 0;
+        int64_t end = (int64_t) width;
+        restrict_to(origin_u + (int64_t) y * row_u, column_u, -HALF, ((int64_t) source_width << F) - HALF,
+                    begin, end);
+        restrict_to(origin_v + (int64_t) y * row_v, column_v, -HALF, ((int64_t) source_height << F) - HALF,
+                    begin, end);
+        return {(size_t) begin, (size_t) end};
+    }
+
+    void affine_resampler::row(const uint8_t* source, size_t stride, size_t pixel_size, size_t y, span columns,
+                               uint8_t* out) const {
+        if (columns.begin >= columns.end) {
+            return;
+        }
+        const auto& run = select_kernels(pixel_size);
+        const int64_t u = origin_u + (int64_t) y * row_u;
+        const int64_t v = origin_v + (int64_t) y * row_v;
+        const int64_t begin = (int64_t) columns.begin;
+        const int64_t end = (int64_t) columns.end;
+        auto sample = [&](sample_function function, int64_t from, int64_t to) {
+            if (from < to) {
+                function(source, stride, pixel_size, u + from * column_u, v + from * column_v, column_u, column_v,
+                         out + from * pixel_size, (size_t) (to - from));
+            }
+        };
+        auto clamped = [&](int64_t from, int64_t to) {
+            if (from < to) {
+                bilinear_clamped(source, stride, pixel_size, source_width, source_height, u + from * column_u,
+                                 v + from * column_v, column_u, column_v, out + from * pixel_size,
+                                 (size_t) (to - from));
+            }
+        };
+
+        if (!bilinear) {
+            sample(run.nearest, begin, end);
+            return;
+        }
+
+        // the pixels whose 4 neighbours are all inside, a single span since both conditions are affine
+        int64_t inner_begin = begin;
+        int64_t inner_end = end;
+        restrict_to(u, column_u, 0, ((int64_t) source_width - 1) << F, inner_begin, inner_end);
+        restrict_to(v, column_v, 0, ((int64_t) source_height - 1) << F, inner_begin, inner_end);
+        if (inner_begin == inner_end) {
+            inner_begin = inner_end = end;
+        }
+
+        // the blocks also keep the bytes their gathers read past a pixel inside the source, and their offsets
+        // within 32 bits
+        int64_t fast_begin = inner_begin;
+        int64_t fast_end = inner_begin;
+        if (run.bilinear_blocks && source_width < (1u << 15) && source_height < (1u << 15) &&
+            stride * source_height <= (size_t) std::numeric_limits<int32_t>::max()) {
+            fast_end = inner_end;
+            auto rows_read = (int64_t) source_height - (pixel_size < 4 ? 2 : 1);
+            restrict_to(v, column_v, 0, rows_read << F, fast_begin, fast_end);
+            if (fast_begin == fast_end) {
+                fast_begin = fast_end = inner_end;
+            }
+        }
+
+        clamped(begin, inner_begin);
+        sample(run.bilinear, inner_begin, fast_begin);
+        if (fast_begin < fast_end) {
+            fast_begin += (int64_t) run.bilinear_blocks(source, stride, u + fast_begin * column_u,
+                                                        v + fast_begin * column_v, column_u, column_v,
+                                                        out + fast_begin * pixel_size,
+                                                        (size_t) (fast_end - fast_begin));
+        }
+        sample(run.bilinear, fast_begin, inner_end);
+        clamped(inner_end, end);
+    }
+
+    void affine_resampler::apply(const uint8_t* source, size_t source_stride, uint8_t* output, size_t width,
+                                 size_t height, size_t stride, size_t pixel_size) const {
+        for (size_t y = 0; y < height; ++y) {
+            row(source, source_stride, pixel_size, y, covered(y, width), output + y * stride);
+        }
+    }
+}
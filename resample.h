@@ -0,0 +1,70 @@
+#ifndef LIB_RESAMPLE_H
+#define LIB_RESAMPLE_H
+
+#include "affine.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace augmentorLib {
+
+    /// Resampling of 8-bit interleaved pixels through an affine map, from a source image into another image
+    ///
+    /// Source coordinates are fixed point, FRACTION_BITS fractional bits, and exactly affine in the output
+    /// column: a row starts from the coordinates of its first pixel and adds the same step per pixel. Which
+    /// pixels of a row fall inside the source is therefore solved once per row, from the start and the step,
+    /// instead of being checked per pixel. A pixel is inside when its nearest source pixel is; pixels outside
+    /// are left as they are.
+    ///
+    /// Nearest sampling copies that pixel. Bilinear sampling weighs the 4 source pixels around the position
+    /// with WEIGHT_BITS bits per axis, clamped to the edge of the source for the half pixel along its border.
+    /// Away from the border, the part of a row that needs no clamping runs 8 pixels at a time with AVX2 when
+    /// the CPU has it and pixels have 1 to 4 channels: 4 gathers per 8 pixels, pmaddubsw across, pmaddwd
+    /// down. The scalar fallback computes the same bytes.
+    class affine_resampler {
+    public:
+        static const int FRACTION_BITS = 16;
+        static const int WEIGHT_BITS = 6;
+
+        /// Output columns [begin, end) of a row, empty when begin >= end
+        struct span {
+            size_t begin;
+            size_t end;
+        };
+
+    private:
+        int64_t column_u, column_v;     // source coordinates step per output column
+        int64_t row_u, row_v;           // and per output row
+        int64_t origin_u, origin_v;     // source coordinates of output pixel (0, 0)
+        size_t source_width;
+        size_t source_height;
+        bool bilinear;
+
+    public:
+        /// \param inverse map from output pixel coordinates to source pixel coordinates
+        /// \param width width of the source in pixels
+        /// \param height height of the source in pixels
+        /// \param bilinear interpolate between the 4 source pixels around the position, else take the nearest
+        affine_resampler(const affine_transform& inverse, size_t width, size_t height, bool bilinear);
+
+        /// The columns of output row y, among the first width, whose nearest source pixel is inside the source
+        [[nodiscard]] span covered(size_t y, size_t width) const;
+
+        /// Samples the columns of output row y into out, the first pixel of that row
+        /// \param columns part of covered(y, ...)
+        void row(const uint8_t* source, size_t stride, size_t pixel_size, size_t y, span columns,
+                 uint8_t* out) const;
+
+        /// Samples every covered pixel of an output image
+        /// \param source first row of the source
+        /// \param source_stride distance between two source rows in bytes
+        /// \param output first row of the output
+        /// \param width output pixels per row
+        /// \param height number of output rows
+        /// \param stride distance between two output rows in bytes
+        /// \param pixel_size number of channels of both images
+        void apply(const uint8_t* source, size_t source_stride, uint8_t* output, size_t width, size_t height,
+                   size_t stride, size_t pixel_size) const;
+    };
+}
+
+#endif //LIB_RESAMPLE_H
@@ -0,0 +1,87 @@
+/*
+ * Test consumer of a shm_ring_sink: drains the ring, checks every frame and reports the throughput
+ *
+ *     shm_consumer NAME [TIMEOUT_SECONDS]
+ *
+ * Waits up to TIMEOUT_SECONDS (10 by default) for the producer to create the ring, then takes slots until
+ * the producer closes it. Prints the frames, bytes and batches seen, the time from the first to the last
+ * frame and a checksum of the pixels, so that runs can be compared.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "shm_ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    augshm_consumer ring = {NULL, 0};
+    const augshm_slot* slot;
+    double timeout = argc > 2 ? atof(argv[2]) : 10;
+    double start = seconds();
+    double first = 0;
+    double last = 0;
+    uint64_t frames = 0;
+    uint64_t batches = 0;
+    uint64_t bytes = 0;
+    uint64_t checksum = 0;
+    int result;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s NAME [TIMEOUT_SECONDS]\n", argv[0]);
+        return 2;
+    }
+    while ((result = augshm_open(&ring, argv[1])) != 0) {
+        if ((result != -ENOENT && result != -EAGAIN) || seconds() - start > timeout) {
+            fprintf(stderr, "could not open %s: %s\n", argv[1], strerror(-result));
+            return 1;
+        }
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+
+    while ((slot = augshm_acquire(&ring)) != NULL) {
+        uint64_t k;
+        if (batches == 0) {
+            first = seconds();
+        }
+        for (k = 0; k < slot->count; ++k) {
+            const augshm_frame* frame = augshm_frame_at(&ring, slot, k);
+            const uint8_t* pixels = augshm_pixels(&ring, slot, k);
+            uint64_t size = (uint64_t) frame->width * frame->height * frame->channels;
+            uint64_t i;
+            if (size > ring.header->frame_bytes) {
+                fprintf(stderr, "frame %llu of slot %llu is larger than a frame\n", (unsigned long long) k,
+                        (unsigned long long) ring.next);
+                return 1;
+            }
+            /* touch every sample, as a trainer copying the batch to its device would */
+            for (i = 0; i < size; ++i) {
+                checksum += pixels[i];
+            }
+            checksum += frame->index;
+            bytes += size;
+        }
+        frames += slot->count;
+        ++batches;
+        augshm_release(&ring, slot);
+        last = seconds();
+    }
+    augshm_close(&ring);
+
+    printf("frames:   %llu in %llu batches\n", (unsigned long long) frames, (unsigned long long) batches);
+    printf("bytes:    %llu\n", (unsigned long long) bytes);
+    if (last > first) {
+        printf("rate:     %.1f frames/s, %.1f MB/s\n", (double) frames / (last - first),
+               (double) bytes / (last - first) / 1e6);
+    }
+    printf("checksum: %llu\n", (unsigned long long) checksum);
+    return 0;
+}
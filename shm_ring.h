@@ -0,0 +1,217 @@
+#ifndef LIB_SHM_RING_H
+#define LIB_SHM_RING_H
+
+/*
+ * Shared memory ring of decoded images, written by augmentorLib::shm_ring_sink and read by another process
+ *
+ * Plain C with no dependency on the library, so that a trainer or its native extension can include it on its
+ * own. The ring is a POSIX shared memory object (shm_open): an augshm_header, then slot_count slots. A slot
+ * holds a batch of up to frames_per_slot images: their augshm_frame descriptors, then their pixels, frame k at
+ * pixels_offset + k * frame_bytes from the slot, rows of width * channels samples without padding. A batch of
+ * equally sized images is therefore one contiguous array.
+ *
+ * Slot states are sequence numbers, as in a bounded MPMC queue: slot number s (counted from the start, the
+ * ring position is s % slot_count) may be written while its sequence is s, is ready for the consumer once it
+ * is s + 1, and is handed back to the producers as s + slot_count. Nobody takes a lock, the producer threads
+ * only claim frames with an atomic add. There is a single consumer.
+ *
+ * The consumer records its process id when it opens the ring and clears it when it closes it, and refreshes a
+ * heartbeat while it takes and hands back slots. A producer blocked on a full ring gives up, rather than
+ * waiting forever, when nobody attached, the attached process is gone, or the heartbeat went stale. Either side
+ * waits by sleeping once a short spin is over, see augshm_backoff.
+ *
+ * Consumer:
+ *
+ *     augshm_consumer ring;
+ *     if (augshm_open(&ring, "/augmentor") == 0) {
+ *         const augshm_slot* slot;
+ *         while ((slot = augshm_acquire(&ring)) != NULL) {
+ *             for (uint64_t k = 0; k < slot->count; ++k) {
+ *                 use(augshm_frame_at(&ring, slot, k), augshm_pixels(&ring, slot, k));
+ *             }
+ *             augshm_release(&ring, slot);
+ *         }
+ *         augshm_close(&ring);
+ *     }
+ *
+ * Needs POSIX: define _POSIX_C_SOURCE 200809L before any include in strict C modes.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AUGSHM_MAGIC "AUGSHM1"
+#define AUGSHM_VERSION 2
+
+/* First bytes of the ring, native byte order. The two positions are on cache lines of their own. */
+typedef struct augshm_header {
+    char magic[8];              /* AUGSHM_MAGIC */
+    uint32_t version;           /* AUGSHM_VERSION, stored last: 0 while the producer is still setting up */
+    uint32_t reserved;
+    uint64_t size;              /* bytes of the whole object */
+    uint64_t slot_count;
+    uint64_t frames_per_slot;   /* images per slot, the batch size */
+    uint64_t frame_bytes;       /* room for the pixels of one image */
+    uint64_t slot_bytes;        /* distance between two slots */
+    uint64_t slots_offset;      /* first slot, from the start of the object */
+    uint64_t pixels_offset;     /* pixels of frame 0, from the start of its slot */
+    uint64_t closed;            /* set once the producer published its last slot */
+    uint64_t padding0[6];
+    uint64_t write_position;    /* frames claimed by the producers */
+    uint64_t padding1[7];
+    uint64_t read_position;     /* slots taken by the consumer */
+    uint64_t consumer_pid;      /* process that opened the ring, 0 while none is attached */
+    uint64_t heartbeat;         /* CLOCK_MONOTONIC nanoseconds, refreshed by the consumer while it runs */
+    uint64_t padding2[5];
+} augshm_header;
+
+/* One image of a slot */
+typedef struct augshm_frame {
+    uint64_t index;             /* output index, the N of output_N.jpg */
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t reserved;
+} augshm_frame;
+
+/* Slot header, followed by frames_per_slot augshm_frame */
+typedef struct augshm_slot {
+    uint64_t sequence;          /* state, see above */
+    uint64_t count;             /* frames in the slot: frames_per_slot, fewer in the last slot of a run */
+    uint64_t filled;            /* frames written so far, the producer writing the last one publishes */
+    uint64_t reserved;
+} augshm_slot;
+
+typedef struct augshm_consumer {
+    augshm_header* header;
+    uint64_t next;              /* number of the next slot to take */
+} augshm_consumer;
+
+static inline augshm_slot* augshm_slot_number(const augshm_header* header, uint64_t number) {
+    return (augshm_slot*) ((uint8_t*) header + header->slots_offset +
+                           (number % header->slot_count) * header->slot_bytes);
+}
+
+static inline const augshm_frame* augshm_frame_at(const augshm_consumer* consumer, const augshm_slot* slot,
+                                                  uint64_t k) {
+    (void) consumer;
+    return (const augshm_frame*) (slot + 1) + k;
+}
+
+static inline const uint8_t* augshm_pixels(const augshm_consumer* consumer, const augshm_slot* slot, uint64_t k) {
+    return (const uint8_t*) slot + consumer->header->pixels_offset + k * consumer->header->frame_bytes;
+}
+
+static inline uint64_t augshm_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/* Tells the producer the consumer is still alive */
+static inline void augshm_beat(augshm_consumer* consumer) {
+    __atomic_store_n(&consumer->header->heartbeat, augshm_now(), __ATOMIC_RELAXED);
+}
+
+/* Spins a little, then gives up the processor a little, then sleeps: 1 us at first, doubling up to 1 ms. A side
+ * waiting on a slower one takes next to no CPU and still sees its progress within a millisecond. */
+static inline void augshm_backoff(unsigned* spins) {
+    unsigned n = ++*spins;
+    struct timespec pause;
+    if (n < 64) {
+        return;
+    }
+    if (n < 128) {
+        sched_yield();
+        return;
+    }
+    pause.tv_sec = 0;
+    pause.tv_nsec = n - 128 < 10 ? 1000L << (n - 128) : 1000000L;
+    nanosleep(&pause, NULL);
+}
+
+/* Maps the ring called name. Returns 0, -EAGAIN while the producer is still setting it up, or -errno. */
+static inline int augshm_open(augshm_consumer* consumer, const char* name) {
+    struct stat status;
+    void* map;
+    int fd = shm_open(name, O_RDWR, 0);
+    consumer->header = NULL;
+    consumer->next = 0;
+    if (fd < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(augshm_header)) {
+        close(fd);
+        return -EAGAIN;
+    }
+    map = mmap(NULL, (size_t) status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+    consumer->header = (augshm_header*) map;
+    if (__atomic_load_n(&consumer->header->version, __ATOMIC_ACQUIRE) != AUGSHM_VERSION ||
+        memcmp(consumer->header->magic, AUGSHM_MAGIC, 8) != 0) {
+        munmap(map, (size_t) status.st_size);
+        consumer->header = NULL;
+        return -EAGAIN;
+    }
+    consumer->next = __atomic_load_n(&consumer->header->read_position, __ATOMIC_ACQUIRE);
+    augshm_beat(consumer);
+    __atomic_store_n(&consumer->header->consumer_pid, (uint64_t) getpid(), __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Takes the next slot, waiting until it is ready. Returns NULL once the producer closed the ring and every
+ * slot was taken. The pixels stay valid until augshm_release. */
+static inline const augshm_slot* augshm_acquire(augshm_consumer* consumer) {
+    augshm_slot* slot = augshm_slot_number(consumer->header, consumer->next);
+    unsigned spins = 0;
+    for (;;) {
+        /* read the flag first, so that a slot published right before closing is never missed */
+        uint64_t closed = __atomic_load_n(&consumer->header->closed, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == consumer->next + 1) {
+            augshm_beat(consumer);
+            return slot;
+        }
+        if (closed) {
+            return NULL;
+        }
+        augshm_beat(consumer);
+        augshm_backoff(&spins);
+    }
+}
+
+/* Hands the slot taken last back to the producers */
+static inline void augshm_release(augshm_consumer* consumer, const augshm_slot* slot) {
+    __atomic_store_n(&((augshm_slot*) slot)->sequence, consumer->next + consumer->header->slot_count,
+                     __ATOMIC_RELEASE);
+    ++consumer->next;
+    __atomic_store_n(&consumer->header->read_position, consumer->next, __ATOMIC_RELEASE);
+    augshm_beat(consumer);
+}
+
+/* Detaches from the ring: a producer blocked on it will give up */
+static inline void augshm_close(augshm_consumer* consumer) {
+    __atomic_store_n(&consumer->header->consumer_pid, 0, __ATOMIC_RELEASE);
+    munmap(consumer->header, (size_t) consumer->header->size);
+    consumer->header = NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIB_SHM_RING_H */
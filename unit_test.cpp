@@ -4,7 +4,20 @@
 
 #include "gtest/gtest.h"
 #include "Augmentor.h"
+#include "async_io.h"
+#include "BoundedQueue.h"
+#include "counter_rng.h"
+#include "file_copy.h"
+#include "output_sink.h"
+#include "Plan.h"
 #include "jpeg.h"
+#include "shm_ring.h"
+
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
 
 class AugmentorTest : public ::testing::Test {
 
@@ -87,6 +100,1272 @@ TEST_F(AugmentorTest, rotate0)
 
 
 
+TEST(ImageTest, contiguousStorage0)
+{
+    Image image(37, 5);
+    EXPECT_EQ(0u, image.stride() % Image::row_alignment);
+    EXPECT_GE(image.stride(), image.getWidth() * image.getPixelSize());
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(image.data()) % Image::row_alignment);
+
+    image.setPixel(36, 4, {1, 2, 3});
+    const uint8_t* p = image.data() + 4 * image.stride() + 36 * image.getPixelSize();
+    EXPECT_TRUE(p[0] == 1 && p[1] == 2 && p[2] == 3);
+
+    Image copy = image;
+    EXPECT_NE(copy.data(), image.data());
+    EXPECT_TRUE(copy.getPixel(36, 4) == image.getPixel(36, 4));
+}
+
+TEST(ImageTest, pixelAccessors0)
+{
+    Image image(4, 3);
+    image.setPixelArray<3>(2, 1, {10, 20, 30});
+
+    auto pixel = image.getPixelArray<3>(2, 1);
+    EXPECT_TRUE(pixel[0] == 10 && pixel[1] == 20 && pixel[2] == 30);
+    EXPECT_EQ(image.getPixelPtr(2, 1), image.pixelUnchecked(2, 1));
+    EXPECT_EQ(image.getRow(1).data() + 2 * 3, image.pixelUnchecked(2, 1));
+    EXPECT_EQ(12u, image.getRow(1).size());
+
+    EXPECT_THROW((void) image.getRow(3), std::out_of_range);
+    EXPECT_THROW((void) image.getPixelPtr(4, 0), std::out_of_range);
+    EXPECT_THROW((void) image.getPixelArray<1>(0, 0), std::invalid_argument);
+}
+
+TEST(ImageTest, scaledDecode0)
+{
+    auto path = ::testing::TempDir() + "scaled.jpg";
+    Image(64, 48).save(path);
+
+    EXPECT_EQ(64u, Image(path).getWidth());
+    Image quarter(path, decode_hint{10, 10});
+    EXPECT_EQ(16u, quarter.getWidth());
+    EXPECT_EQ(12u, quarter.getHeight());
+    EXPECT_EQ(32u, Image(path, decode_hint{17, 5}).getWidth());
+    EXPECT_EQ(64u, Image(path, decode_hint{65, 1}).getWidth());
+}
+
+TEST(ImageTest, windowDecode0)
+{
+    auto path = ::testing::TempDir() + "window.jpg";
+    Image source(203, 150);
+    augmentorLib::CounterGenerator generator(3, 0, 0);
+    for (size_t y = 0; y < source.getHeight(); ++y) {
+        generator.fill(source.rowUnchecked(y), source.getWidth() * source.getPixelSize());
+    }
+    source.save(path, 90);
+
+    Image full(path);
+    augmentorLib::CropOperation<Image> crop({61, 77}, true);
+    (void) crop.apply(&full, nullptr);
+
+    decode_hint hint;
+    hint.crop_width = 77;
+    hint.crop_height = 61;
+    Image window(path, hint);
+    ASSERT_EQ(77u, window.getWidth());
+    ASSERT_EQ(61u, window.getHeight());
+    for (size_t y = 0; y < window.getHeight(); ++y) {
+        EXPECT_EQ(0, std::memcmp(full.rowUnchecked(y), window.rowUnchecked(y), 77 * 3)) << "row " << y;
+    }
+}
+
+TEST(ImageTest, losslessTranscode0)
+{
+    auto source = ::testing::TempDir() + "transcode_in.jpg";
+    auto destination = ::testing::TempDir() + "transcode_out.jpg";
+    Image image(64, 48);
+    augmentorLib::CounterGenerator generator(5, 0, 0);
+    for (size_t y = 0; y < image.getHeight(); ++y) {
+        generator.fill(image.rowUnchecked(y), image.getWidth() * image.getPixelSize());
+    }
+    image.save(source, 90);
+    Image decoded(source);
+
+    // quarter turn: output (x, y) is source (63 - y, x)
+    auto turn = [](size_t, size_t, grid_transform& grid) {
+        grid = {true, -1, 1, 63, 0, 48, 64};
+        return true;
+    };
+    ASSERT_TRUE(Image::transcode(source, destination, turn));
+    Image turned(destination);
+    ASSERT_EQ(48u, turned.getWidth());
+    ASSERT_EQ(64u, turned.getHeight());
+    int difference = 0;
+    for (size_t y = 0; y < turned.getHeight(); ++y) {
+        for (size_t x = 0; x < turned.getWidth(); ++x) {
+            for (size_t c = 0; c < 3; ++c) {
+                int d = std::abs(turned.pixelUnchecked(x, y)[c] - decoded.pixelUnchecked(63 - y, x)[c]);
+                difference = std::max(difference, d);
+            }
+        }
+    }
+    // the coefficients are moved exactly, only the rounding of chroma upsampling differs
+    EXPECT_LE(difference, 3);
+
+    // 4:2:0 iMCUs are 16 pixels, a crop starting at row 8 cannot be done on blocks
+    auto misaligned = [](size_t, size_t, grid_transform& grid) {
+        grid = {false, 1, 1, 16, 8, 32, 16};
+        return true;
+    };
+    std::remove(destination.c_str());
+    EXPECT_FALSE(Image::transcode(source, destination, misaligned));
+    EXPECT_EQ(nullptr, fopen(destination.c_str(), "rb"));
+}
+
+TEST(ImageTest, memoryEncodeDecode0)
+{
+    Image image(40, 24);
+    augmentorLib::CounterGenerator generator(11, 0, 0);
+    for (size_t y = 0; y < image.getHeight(); ++y) {
+        generator.fill(image.rowUnchecked(y), image.getWidth() * image.getPixelSize());
+    }
+    std::vector<uint8_t> bytes;
+    image.encode(bytes, 90);
+    ASSERT_FALSE(bytes.empty());
+
+    // save writes the same bytes, and decoding from memory or from the file gives the same pixels
+    auto path = ::testing::TempDir() + "memory.jpg";
+    image.save(path, 90);
+    std::ifstream in(path, std::ios::binary);
+    std::vector<uint8_t> saved((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(bytes, saved);
+
+    Image fromMemory(bytes.data(), bytes.size());
+    Image fromFile(path);
+    ASSERT_EQ(40u, fromMemory.getWidth());
+    ASSERT_EQ(24u, fromMemory.getHeight());
+    for (size_t y = 0; y < fromMemory.getHeight(); ++y) {
+        EXPECT_EQ(0, std::memcmp(fromMemory.rowUnchecked(y), fromFile.rowUnchecked(y), 40 * 3));
+    }
+
+    // cut inside the tables of the header
+    EXPECT_THROW(Image(bytes.data(), bytes.size() / 8), std::runtime_error);
+
+    // files over a megabyte are memory mapped instead of read
+    Image large(1024, 768);
+    for (size_t y = 0; y < large.getHeight(); ++y) {
+        generator.fill(large.rowUnchecked(y), large.getWidth() * large.getPixelSize());
+    }
+    large.encode(bytes, 100);
+    ASSERT_GT(bytes.size(), 1u << 20);
+    large.save(path, 100);
+    Image mapped(path);
+    Image decoded(bytes.data(), bytes.size());
+    for (size_t y = 0; y < mapped.getHeight(); ++y) {
+        ASSERT_EQ(0, std::memcmp(mapped.rowUnchecked(y), decoded.rowUnchecked(y), 1024 * 3));
+    }
+}
+
+TEST(AsyncFileIoTest, writeThenRead0)
+{
+    for (bool uring : {true, false}) {
+        auto io = augmentorLib::async_file_io::create(4, uring);
+        std::vector<std::future<void>> writes;
+        for (size_t i = 0; i < 16; ++i) {
+            std::vector<uint8_t> data(1000 + 4099 * i, (uint8_t) i);
+            writes.push_back(io->write(::testing::TempDir() + "async_" + std::to_string(i), std::move(data)));
+        }
+        for (auto& write : writes) {
+            write.get();
+        }
+        std::vector<std::future<std::vector<uint8_t>>> reads;
+        for (size_t i = 0; i < 16; ++i) {
+            reads.push_back(io->read(::testing::TempDir() + "async_" + std::to_string(i)));
+        }
+        for (size_t i = 0; i < 16; ++i) {
+            auto data = reads[i].get();
+            ASSERT_EQ(1000 + 4099 * i, data.size()) << io->backend();
+            EXPECT_EQ((uint8_t) i, data.back()) << io->backend();
+        }
+        EXPECT_THROW(io->read(::testing::TempDir() + "async_missing").get(), std::runtime_error) << io->backend();
+    }
+}
+
+TEST(OutputSinkTest, recordShards0)
+{
+    auto directory = ::testing::TempDir();
+    std::vector<std::vector<uint8_t>> outputs;
+    {
+        augmentorLib::record_sink sink(directory, 2500, "records");
+        for (size_t i = 0; i < 5; ++i) {
+            outputs.emplace_back(1000, (uint8_t) (i + 1));
+            sink.write(10 + i, outputs[i].data(), outputs[i].size());
+        }
+    }
+    // two outputs fit in a shard of 2500 bytes
+    auto read = [](const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    size_t found = 0;
+    for (size_t shard = 0; shard < 3; ++shard) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "records-%06zu", shard);
+        auto records = read(directory + name + ".rec");
+        auto index = read(directory + name + ".idx");
+        typedef augmentorLib::record_sink::record_index_entry entry;
+        ASSERT_EQ(0u, index.size() % sizeof(entry));
+        for (size_t e = 0; e < index.size() / sizeof(entry); ++e, ++found) {
+            entry record;
+            std::memcpy(&record, index.data() + e * sizeof(entry), sizeof(entry));
+            auto& expected = outputs[record.index - 10];
+            ASSERT_EQ(expected.size(), record.size);
+            EXPECT_EQ(0, std::memcmp(expected.data(), records.data() + record.offset, record.size));
+        }
+        EXPECT_LE(records.size(), 2500u);
+    }
+    EXPECT_EQ(5u, found);
+}
+
+TEST(OutputSinkTest, tarShards0)
+{
+    auto directory = ::testing::TempDir();
+    std::vector<uint8_t> data(700, 42);
+    {
+        augmentorLib::tar_sink sink(directory, 1 << 20, "tars");
+        sink.write(7, data.data(), data.size());
+    }
+    std::ifstream in(directory + "tars-000000.tar", std::ios::binary);
+    std::string tar((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    // header, two blocks of data, two zero blocks
+    ASSERT_EQ(5u * 512, tar.size());
+    EXPECT_STREQ("000000007.jpg", tar.c_str());
+    EXPECT_EQ("ustar", tar.substr(257, 5));
+    EXPECT_EQ(700u, std::stoul(tar.substr(124, 11), nullptr, 8));
+    unsigned sum = 0;
+    for (size_t i = 0; i < 512; ++i) {
+        sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) tar[i];
+    }
+    EXPECT_EQ(sum, std::stoul(tar.substr(148, 6), nullptr, 8));
+    EXPECT_EQ(0, std::memcmp(data.data(), tar.data() + 512, data.size()));
+}
+
+TEST(OutputSinkTest, tensorShards0)
+{
+    auto directory = ::testing::TempDir();
+    // a padded stride, as Image rows have
+    Image image(3, 2);
+    for (size_t y = 0; y < 2; ++y) {
+        for (size_t x = 0; x < 3; ++x) {
+            image.setPixel(x, y, {(uint8_t) (10 * x + y), 255, 0});
+        }
+    }
+    augmentorLib::tensor_format format;
+    format.height = 2;
+    format.width = 3;
+    {
+        augmentorLib::tensor_sink sink(directory, format, 2, "hwc");
+        for (size_t i = 0; i < 3; ++i) {
+            sink.write_pixels(20 + i, image.data(), 3, 2, 3, image.stride());
+        }
+        EXPECT_THROW(sink.write_pixels(0, image.data(), 2, 2, 3, image.stride()), std::runtime_error);
+    }
+    auto read = [](const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    augmentorLib::tensor_shard_header header;
+    auto first = read(directory + "hwc-000000.tensor");
+    std::memcpy(&header, first.data(), sizeof(header));
+    EXPECT_STREQ("AUGTENS", header.magic);
+    EXPECT_EQ(2u, header.capacity);
+    EXPECT_EQ(2u, header.count);
+    EXPECT_EQ(0u, header.data_offset % 4096);
+    EXPECT_EQ(header.data_offset + 2 * 18, first.size());
+    uint64_t index;
+    std::memcpy(&index, first.data() + header.index_offset + sizeof(index), sizeof(index));
+    EXPECT_EQ(21u, index);
+    EXPECT_EQ(11, first[header.data_offset + 18 + 3 * 3 + 3]);   // slot 1, pixel (1, 1), red
+
+    // the last shard is shrunk to its one tensor
+    auto second = read(directory + "hwc-000001.tensor");
+    std::memcpy(&header, second.data(), sizeof(header));
+    EXPECT_EQ(1u, header.capacity);
+    EXPECT_EQ(1u, header.count);
+    EXPECT_EQ(header.data_offset + 18, second.size());
+
+    format.layout = augmentorLib::tensor_layout::float_nchw;
+    format.mean = {{0.5f, 0.5f, 0.5f, 0}};
+    format.stddev = {{0.5f, 0.5f, 0.5f, 1}};
+    {
+        augmentorLib::tensor_sink sink(directory, format, 8, "nchw");
+        sink.write_pixels(0, image.data(), 3, 2, 3, image.stride());
+    }
+    auto planes = read(directory + "nchw-000000.tensor");
+    std::memcpy(&header, planes.data(), sizeof(header));
+    ASSERT_EQ(header.data_offset + 18 * sizeof(float), planes.size());
+    float values[18];
+    std::memcpy(values, planes.data() + header.data_offset, sizeof(values));
+    EXPECT_FLOAT_EQ((11 / 255.0f - 0.5f) / 0.5f, values[1 * 3 + 1]);    // red plane, pixel (1, 1)
+    EXPECT_FLOAT_EQ(1.0f, values[6]);                                   // green plane
+    EXPECT_FLOAT_EQ(-1.0f, values[12]);                                 // blue plane
+}
+
+TEST(OutputSinkTest, sharedMemoryRing0)
+{
+    auto name = "/augmentor_test_" + std::to_string(::getpid());
+    std::vector<size_t> seen;
+    std::vector<uint64_t> counts;
+    bool pixels_match = true;
+    {
+        // 2 slots of 2 frames: the writers have to wait for the consumer
+        auto sink = std::make_unique<augmentorLib::shm_ring_sink>(name, 4 * 3 * 3, 2, 2);
+        augshm_consumer ring;
+        ASSERT_EQ(0, augshm_open(&ring, name.c_str()));
+        std::thread consumer([&]() {
+            const augshm_slot* slot;
+            while ((slot = augshm_acquire(&ring)) != nullptr) {
+                counts.push_back(slot->count);
+                for (uint64_t k = 0; k < slot->count; ++k) {
+                    auto frame = augshm_frame_at(&ring, slot, k);
+                    auto pixels = augshm_pixels(&ring, slot, k);
+                    seen.push_back(frame->index);
+                    pixels_match &= frame->width == 4 && frame->height == 3 && pixels[0] == frame->index &&
+                                    pixels[4 * 3 * 3 - 1] == 7;
+                }
+                augshm_release(&ring, slot);
+            }
+            augshm_close(&ring);
+        });
+
+        std::vector<std::thread> writers;
+        for (size_t w = 0; w < 2; ++w) {
+            writers.emplace_back([&, w]() {
+                for (size_t i = w; i < 9; i += 2) {
+                    Image image(4, 3);
+                    image.setPixel(0, 0, {(uint8_t) i, 0, 0});
+                    image.setPixel(3, 2, {0, 0, 7});
+                    sink->write_pixels(i, image.data(), 4, 3, 3, image.stride());
+                }
+            });
+        }
+        for (auto& writer : writers) {
+            writer.join();
+        }
+        EXPECT_THROW(sink->write_pixels(0, nullptr, 5, 3, 3, 15), std::runtime_error);
+        // publishes the last, single frame batch, closes the ring and removes its name
+        sink.reset();
+        consumer.join();
+    }
+    std::sort(seen.begin(), seen.end());
+    std::vector<size_t> expected(9);
+    std::iota(expected.begin(), expected.end(), 0);
+    EXPECT_EQ(expected, seen);
+    EXPECT_TRUE(pixels_match);
+    ASSERT_EQ(5u, counts.size());
+    EXPECT_EQ(1u, counts.back());
+    augshm_consumer gone;
+    EXPECT_EQ(-ENOENT, augshm_open(&gone, name.c_str()));
+}
+
+TEST(OutputSinkTest, sharedMemoryRingConsumerGone0)
+{
+    auto name = "/augmentor_test_gone_" + std::to_string(::getpid());
+    Image image(4, 3);
+    using clock = std::chrono::steady_clock;
+
+    // nobody attaches: the write that finds the ring full gives up after the timeout
+    {
+        EXPECT_THROW(augmentorLib::shm_ring_sink(name, 4 * 3 * 3, 1, 1), std::invalid_argument);
+        augmentorLib::shm_ring_sink sink(name, 4 * 3 * 3, 2, 1, 0.2);
+        sink.write_pixels(0, image.data(), 4, 3, 3, image.stride());
+        sink.write_pixels(1, image.data(), 4, 3, 3, image.stride());
+        auto start = clock::now();
+        EXPECT_THROW(sink.write_pixels(2, image.data(), 4, 3, 3, image.stride()), std::runtime_error);
+        EXPECT_GE(clock::now() - start, std::chrono::milliseconds(200));
+        // and the ring stays broken
+        EXPECT_THROW(sink.write_pixels(3, image.data(), 4, 3, 3, image.stride()), std::runtime_error);
+    }
+
+    // the consumer attaches, then its process dies: no need to wait for the timeout
+    {
+        augmentorLib::shm_ring_sink sink(name, 4 * 3 * 3, 2, 1, 30);
+        pid_t child = ::fork();
+        if (child == 0) {
+            augshm_consumer ring;
+            ::_exit(augshm_open(&ring, name.c_str()) == 0 ? 0 : 1);
+        }
+        int status = -1;
+        ASSERT_EQ(child, ::waitpid(child, &status, 0));
+        ASSERT_EQ(0, status);
+        sink.write_pixels(0, image.data(), 4, 3, 3, image.stride());
+        sink.write_pixels(1, image.data(), 4, 3, 3, image.stride());
+        auto start = clock::now();
+        EXPECT_THROW(sink.write_pixels(2, image.data(), 4, 3, 3, image.stride()), std::runtime_error);
+        EXPECT_LT(clock::now() - start, std::chrono::seconds(5));
+    }
+}
+
+TEST(OutputSinkTest, sharedMemoryRingIdleWait0)
+{
+    // a consumer waiting on an empty ring and a writer waiting on a full one sleep instead of spinning
+    auto name = "/augmentor_test_idle_" + std::to_string(::getpid());
+    Image image(4, 3);
+    {
+        augmentorLib::shm_ring_sink sink(name, 4 * 3 * 3, 2, 1);
+        augshm_consumer ring;
+        ASSERT_EQ(0, augshm_open(&ring, name.c_str()));
+        uint64_t index = 0;
+        std::thread consumer([&]() {
+            auto slot = augshm_acquire(&ring);
+            if (slot != nullptr) {
+                index = augshm_frame_at(&ring, slot, 0)->index;
+                augshm_release(&ring, slot);
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        auto before = std::clock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        EXPECT_LT(1000.0 * (double) (std::clock() - before) / CLOCKS_PER_SEC, 50.0);
+        sink.write_pixels(5, image.data(), 4, 3, 3, image.stride());
+        consumer.join();
+        EXPECT_EQ(5u, index);
+        augshm_close(&ring);
+    }
+    {
+        augmentorLib::shm_ring_sink sink(name, 4 * 3 * 3, 2, 1, 0.3);
+        sink.write_pixels(0, image.data(), 4, 3, 3, image.stride());
+        sink.write_pixels(1, image.data(), 4, 3, 3, image.stride());
+        auto before = std::clock();
+        EXPECT_THROW(sink.write_pixels(2, image.data(), 4, 3, 3, image.stride()), std::runtime_error);
+        EXPECT_LT(1000.0 * (double) (std::clock() - before) / CLOCKS_PER_SEC, 50.0);
+    }
+}
+
+TEST(StreamTest, pullImages0)
+{
+    auto directory = ::testing::TempDir() + "stream/";
+    mkdir(directory.c_str(), 0755);
+    for (int i = 0; i < 2; ++i) {
+        Image source(40 + 8 * i, 32);
+        source.setPixel(1, 1, {255, 0, 0});
+        source.save(directory + "source_" + std::to_string(i) + ".jpg");
+    }
+    augmentorLib::Augmentor augmentor(directory, directory);
+    augmentor.seed(5).resize(16, 12).flip("Horizontal", 0.5).invert(0.5);
+
+    for (auto& image : augmentor.stream(20)) {
+        EXPECT_EQ(12u, image.getWidth());
+        EXPECT_EQ(16u, image.getHeight());
+    }
+    augmentorLib::pipeline_config config;
+    config.transformers = 3;
+    auto batches = augmentor.stream(20, config, 4);
+    std::vector<Image> batch;
+    size_t total = 0;
+    while (batches.next_batch(batch, 8) > 0) {
+        total += batch.size();
+    }
+    EXPECT_EQ(20u, total);
+
+    // the pixels of an output only depend on its index, not on the threads that made it
+    std::vector<Image> serial(20);
+    auto first = augmentor.stream(augmentor.plan(20), augmentorLib::pipeline_config(), 1);
+    Image image;
+    size_t index;
+    while (first.next(image, index)) {
+        ASSERT_LT(index, 20u);
+        serial[index] = std::move(image);
+    }
+    auto second = augmentor.stream(augmentor.plan(20), config, 4);
+    size_t compared = 0;
+    while (second.next(image, index)) {
+        ASSERT_EQ(16u, serial[index].getHeight());
+        for (size_t y = 0; y < 16; ++y) {
+            EXPECT_EQ(0, std::memcmp(serial[index].rowUnchecked(y), image.rowUnchecked(y), 12 * 3));
+        }
+        ++compared;
+    }
+    EXPECT_EQ(20u, compared);
+
+    // dropping a stream early stops its pipeline
+    auto dropped = augmentor.stream(1000, config, 2);
+    EXPECT_TRUE(dropped.next(image));
+}
+
+TEST(SampleTest, threadedMatchesSerial0)
+{
+    auto directory = ::testing::TempDir() + "threaded/";
+    mkdir(directory.c_str(), 0755);
+    mkdir((directory + "in/").c_str(), 0755);
+    for (int i = 0; i < 3; ++i) {
+        Image source(48 + 8 * i, 40);
+        for (size_t y = 0; y < source.getHeight(); ++y) {
+            for (size_t x = 0; x < source.getWidth(); ++x) {
+                source.setPixel(x, y, {(uint8_t) (5 * x), (uint8_t) (6 * y), (uint8_t) (40 * i)});
+            }
+        }
+        source.save(directory + "in/source_" + std::to_string(i) + ".jpg");
+    }
+    auto run = [&](const std::string& out, size_t threads) {
+        mkdir((directory + out).c_str(), 0755);
+        augmentorLib::Augmentor augmentor(directory + "in/", directory + out);
+        augmentor.seed(7).rotate(-30, 30, 0.5).flip("Horizontal", 0.5).zoom(1, 1.5, 0.5).crop(24, 24, false, 0.5)
+                .brightness(0.5, 1.5, 0.5).invert(0.5);
+        augmentor.sample(24, threads);
+    };
+    run("serial/", 1);
+    run("parallel/", 4);
+
+    auto read = [](const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    for (size_t i = 0; i < 24; ++i) {
+        auto name = "output_" + std::to_string(i) + ".jpg";
+        auto serial = read(directory + "serial/" + name);
+        ASSERT_FALSE(serial.empty()) << name;
+        EXPECT_TRUE(serial == read(directory + "parallel/" + name)) << name;
+    }
+}
+
+TEST(FanOutTest, sharedDecodeMatchesSeparate0)
+{
+    auto directory = ::testing::TempDir() + "fan_out/";
+    mkdir(directory.c_str(), 0755);
+    mkdir((directory + "in/").c_str(), 0755);
+    // sizes on iMCU boundaries, so that outputs only flipped are transcoded losslessly
+    for (int i = 0; i < 3; ++i) {
+        Image source(32, 48 + 16 * i);
+        for (size_t y = 0; y < source.getHeight(); ++y) {
+            for (size_t x = 0; x < source.getWidth(); ++x) {
+                source.setPixel(x, y, {(uint8_t) (5 * x), (uint8_t) (7 * y), (uint8_t) (60 * i)});
+            }
+        }
+        source.save(directory + "in/source_" + std::to_string(i) + ".jpg");
+    }
+    auto chain = [](augmentorLib::Augmentor& augmentor) {
+        augmentor.seed(11).flip("Horizontal", 0.5).rotate(-20, 20, 0.3).invert(0.3).brightness(0.6, 1.4, 0.3);
+    };
+    augmentorLib::augmentation_plan plan;
+    {
+        augmentorLib::Augmentor planner(directory + "in/", directory);
+        chain(planner);
+        plan = planner.plan(24);
+    }
+    // several outputs per source, some copied (nothing fires) and some transcoded (only the flip fires)
+    ASSERT_EQ(3u, plan.sources.size());
+    EXPECT_NE(plan.enabled.end(), std::find(plan.enabled.begin(), plan.enabled.end(), 0u));
+    EXPECT_NE(plan.enabled.end(), std::find(plan.enabled.begin(), plan.enabled.end(), 1u));
+
+    auto read = [](const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    // serial, 4 threads and staged pipeline, each with and without fan out
+    for (bool fan_out : {false, true}) {
+        for (int mode = 0; mode < 3; ++mode) {
+            auto out = directory + "out_" + std::to_string(fan_out) + std::to_string(mode) + "/";
+            mkdir(out.c_str(), 0755);
+            augmentorLib::Augmentor augmentor(directory + "in/", out);
+            chain(augmentor);
+            augmentor.fan_out(fan_out);
+            if (mode == 2) {
+                augmentorLib::pipeline_config config;
+                config.decoders = 2;
+                config.transformers = 3;
+                config.encoders = 2;
+                augmentor.execute(plan, config);
+            } else {
+                augmentor.execute(plan, mode == 0 ? 1 : 4);
+            }
+            for (size_t i = 0; i < 24; ++i) {
+                auto name = "output_" + std::to_string(i) + ".jpg";
+                auto expected = read(directory + "out_00/" + name);
+                ASSERT_FALSE(expected.empty()) << name;
+                EXPECT_TRUE(expected == read(out + name)) << out + name;
+            }
+        }
+    }
+}
+
+TEST(PipelineTest, stagedMatchesSerial0)
+{
+    auto directory = ::testing::TempDir() + "pipeline/";
+    mkdir(directory.c_str(), 0755);
+    mkdir((directory + "in/").c_str(), 0755);
+    for (int i = 0; i < 4; ++i) {
+        Image source(40 + 8 * i, 36);
+        for (size_t y = 0; y < source.getHeight(); ++y) {
+            for (size_t x = 0; x < source.getWidth(); ++x) {
+                source.setPixel(x, y, {(uint8_t) (6 * x), (uint8_t) (50 * i), (uint8_t) (5 * y)});
+            }
+        }
+        source.save(directory + "in/source_" + std::to_string(i) + ".jpg");
+    }
+    // nothing copied or transcoded: every output goes through all three stages
+    auto chain = [](augmentorLib::Augmentor& augmentor) {
+        augmentor.seed(3).rotate(-15, 15, 0.5).flip("Vertical", 0.5).invert(0.5).passthrough(false).lossless(false);
+    };
+    augmentorLib::augmentation_plan plan;
+    {
+        augmentorLib::Augmentor planner(directory + "in/", directory);
+        chain(planner);
+        plan = planner.plan(20);
+    }
+    mkdir((directory + "serial/").c_str(), 0755);
+    {
+        augmentorLib::Augmentor augmentor(directory + "in/", directory + "serial/");
+        chain(augmentor);
+        augmentor.execute(plan, 1);
+    }
+
+    auto read = [](const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    // synchronous files, then background reads and writes through io_uring (where the kernel has it) and
+    // through the thread pool
+    std::vector<std::pair<size_t, bool>> io_settings = {{0, false}, {4, true}, {4, false}};
+    for (auto io : io_settings) {
+        auto out = directory + "staged_" + std::to_string(io.first) + std::to_string(io.second) + "/";
+        mkdir(out.c_str(), 0755);
+        augmentorLib::Augmentor augmentor(directory + "in/", out);
+        chain(augmentor);
+        augmentorLib::pipeline_config config;
+        config.decoders = 2;
+        config.transformers = 3;
+        config.encoders = 2;
+        config.queue_depth = 2;
+        config.io_depth = io.first;
+        config.io_uring = io.second;
+        augmentor.execute(plan, config);
+        for (size_t i = 0; i < 20; ++i) {
+            auto name = "output_" + std::to_string(i) + ".jpg";
+            auto expected = read(directory + "serial/" + name);
+            ASSERT_FALSE(expected.empty()) << name;
+            EXPECT_TRUE(expected == read(out + name)) << out + name;
+        }
+        auto& stats = augmentor.statistics();
+        EXPECT_EQ(20u, stats.decode.items);
+        EXPECT_EQ(20u, stats.transform.items);
+        EXPECT_EQ(20u, stats.encode.items);
+        EXPECT_EQ(3u, stats.transform.threads);
+        if (io.first == 0) {
+            EXPECT_STREQ("", stats.io_backend);
+        } else if (io.second) {
+            EXPECT_NE("", std::string(stats.io_backend));
+        } else {
+            EXPECT_STREQ("threads", stats.io_backend);
+        }
+    }
+}
+
+TEST(BoundedQueueTest, producersConsumers0)
+{
+    augmentorLib::BoundedQueue<size_t> queue(4);
+    const size_t per_producer = 1000;
+    std::atomic<size_t> sum{0};
+    std::atomic<size_t> count{0};
+
+    std::vector<std::thread> consumers;
+    for (int c = 0; c < 2; ++c) {
+        consumers.emplace_back([&]() {
+            size_t value;
+            while (queue.pop(value)) {
+                sum += value;
+                ++count;
+            }
+        });
+    }
+    std::vector<std::thread> producers;
+    for (int p = 0; p < 3; ++p) {
+        producers.emplace_back([&]() {
+            for (size_t i = 1; i <= per_producer; ++i) {
+                queue.push(i);
+            }
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    queue.close();
+    for (auto& consumer : consumers) {
+        consumer.join();
+    }
+
+    EXPECT_EQ(3 * per_producer, count.load());
+    EXPECT_EQ(3 * per_producer * (per_producer + 1) / 2, sum.load());
+    EXPECT_LE(queue.statistics().max_depth, queue.capacity());
+}
+
+TEST(BoundedQueueTest, idleWaitersPark0)
+{
+    // a producer on a full queue and a consumer on an empty one park instead of spinning
+    augmentorLib::BoundedQueue<size_t> full(2);
+    augmentorLib::BoundedQueue<size_t> empty(2);
+    full.push(1);
+    full.push(2);
+    bool pushed = true;
+    bool popped = true;
+    std::thread producer([&]() { pushed = full.push(3); });
+    std::thread consumer([&]() {
+        size_t value;
+        popped = empty.pop(value);
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto before = std::clock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    double cpu_ms = 1000.0 * (double) (std::clock() - before) / CLOCKS_PER_SEC;
+    EXPECT_LT(cpu_ms, 50.0);
+
+    // close() wakes them
+    full.close();
+    empty.close();
+    producer.join();
+    consumer.join();
+    EXPECT_FALSE(pushed);
+    EXPECT_FALSE(popped);
+
+    // and a parked consumer is woken by a push
+    augmentorLib::BoundedQueue<size_t> queue(2);
+    size_t value = 0;
+    std::thread late([&]() { popped = queue.pop(value); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    queue.push(7);
+    late.join();
+    EXPECT_TRUE(popped);
+    EXPECT_EQ(7u, value);
+}
+
+TEST(CounterGeneratorTest, philoxKnownAnswer0)
+{
+    using augmentorLib::philox4x32;
+    auto zero = philox4x32::generate({0, 0, 0, 0}, {0, 0});
+    EXPECT_TRUE(zero == (philox4x32::counter_type{0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}));
+    auto ones = philox4x32::generate({0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}, {0xffffffff, 0xffffffff});
+    EXPECT_TRUE(ones == (philox4x32::counter_type{0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}));
+}
+
+TEST(CounterGeneratorTest, reproducibleStreams0)
+{
+    augmentorLib::CounterGenerator a(42, 7, 3);
+    augmentorLib::CounterGenerator b(1, 1, 1);
+    b.reset(42, 7, 3);
+    augmentorLib::CounterGenerator other(42, 8, 3);
+
+    bool differs = false;
+    for (int i = 0; i < 16; ++i) {
+        auto value = a.uniform();
+        EXPECT_EQ(value, b.uniform());
+        EXPECT_TRUE(value >= 0 && value < 1);
+        differs |= value != other.uniform();
+    }
+    EXPECT_TRUE(differs);
+}
+
+TEST(PlanTest, saveLoadShard0)
+{
+    augmentorLib::augmentation_plan plan;
+    plan.seed = 42;
+    plan.sources = {"a.jpg", "b.jpg"};
+    plan.parameter_offset = {0, 0, 1};
+    plan.parameters_per_sample = 2;
+    plan.output = {0, 1, 2};
+    plan.source = {1, 0, 1};
+    plan.enabled = {0b101, 0b000, 0b010};
+    plan.parameters = {0.5, 0.25, 0, 0, 0.75, 0};
+
+    auto path = ::testing::TempDir() + "plan.bin";
+    plan.save(path);
+    auto loaded = augmentorLib::augmentation_plan::load(path);
+    EXPECT_EQ(plan.seed, loaded.seed);
+    EXPECT_EQ(plan.sources, loaded.sources);
+    EXPECT_EQ(plan.enabled, loaded.enabled);
+    EXPECT_EQ(plan.parameters, loaded.parameters);
+    EXPECT_TRUE(loaded.fires(0, 2) && !loaded.fires(0, 1));
+    EXPECT_EQ(0.25, *loaded.parameters_of(0, 2));
+
+    auto shard = loaded.shard(1, 2);
+    ASSERT_EQ(1u, shard.size());
+    EXPECT_EQ(1u, shard.output[0]);
+    EXPECT_EQ(0u, shard.enabled[0]);
+
+    // a corrupt source count, path length or truncated file is reported, never allocated
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    auto corrupt = ::testing::TempDir() + "plan_corrupt.bin";
+    auto load = [&](const std::string& damaged) {
+        std::ofstream(corrupt, std::ios::binary) << damaged;
+        augmentorLib::augmentation_plan::load(corrupt);
+    };
+    auto patched = [&](size_t offset, uint64_t value) {
+        auto damaged = bytes;
+        std::memcpy(&damaged[offset], &value, sizeof(value));
+        return damaged;
+    };
+    EXPECT_NO_THROW(load(bytes));
+    EXPECT_THROW(load(patched(16, ~uint64_t{0})), std::runtime_error);          // source count
+    EXPECT_THROW(load(patched(24, ~uint64_t{0} >> 1)), std::runtime_error);     // length of the first path
+    EXPECT_THROW(load(bytes.substr(0, 30)), std::runtime_error);
+}
+
+TEST(AffineWarpTest, fusedMatchesSequential0)
+{
+    Image source(31, 17);
+    for (size_t y = 0; y < source.getHeight(); ++y) {
+        for (size_t x = 0; x < source.getWidth(); ++x) {
+            source.setPixel(x, y, {(uint8_t) x, (uint8_t) y, (uint8_t) (x * y)});
+        }
+    }
+
+    augmentorLib::FlipOperation<Image> horizontal(HORIZONTAL);
+    augmentorLib::FlipOperation<Image> vertical(VERTICAL);
+    augmentorLib::CropOperation<Image> crop({12, 20}, true);
+    std::vector<augmentorLib::Operation<Image>*> chain = {&horizontal, &crop, &vertical};
+
+    Image sequential = source;
+    augmentorLib::AffineWarp<Image> warp;
+    warp.reset({source.getHeight(), source.getWidth()});
+    for (auto operation : chain) {
+        (void) operation->apply(&sequential, nullptr);
+        auto size = warp.output_size();
+        augmentorLib::affine_transform inverse;
+        ASSERT_TRUE(operation->affine(size, nullptr, inverse));
+        warp.push(inverse, size);
+    }
+    Image fused = source;
+    (void) warp.apply(&fused);
+
+    ASSERT_EQ(sequential.getWidth(), fused.getWidth());
+    ASSERT_EQ(sequential.getHeight(), fused.getHeight());
+    for (size_t y = 0; y < fused.getHeight(); ++y) {
+        EXPECT_EQ(0, std::memcmp(sequential.rowUnchecked(y), fused.rowUnchecked(y), fused.getWidth() * 3));
+    }
+}
+
+TEST(AffineWarpTest, intermediateBounds0)
+{
+    Image source(8, 8);
+    for (size_t y = 0; y < 8; ++y) {
+        for (size_t x = 0; x < 8; ++x) {
+            source.setPixel(x, y, {255, 255, 255});
+        }
+    }
+
+    // crop to the top-left 4x4 quarter, then take a window centered on its corner: only that quarter of the
+    // window shows source pixels although the rest of the window is inside the source as well
+    augmentorLib::affine_transform first = augmentorLib::affine_transform::translation(0, 0);
+    augmentorLib::affine_transform second = augmentorLib::affine_transform::translation(2, 2);
+    augmentorLib::AffineWarp<Image> warp;
+    warp.reset({8, 8});
+    warp.push(first, {4, 4});
+    warp.push(second, {4, 4});
+    (void) warp.apply(&source);
+
+    ASSERT_EQ(4u, source.getWidth());
+    EXPECT_EQ(255, source.getPixel(0, 0)[0]);
+    EXPECT_EQ(255, source.getPixel(1, 1)[0]);
+    EXPECT_EQ(0, source.getPixel(2, 1)[0]);
+    EXPECT_EQ(0, source.getPixel(3, 3)[0]);
+}
+
+TEST(AffineWarpTest, bilinearRotation0)
+{
+    // against bilinear sampling in double precision, neighbours clamped inside the half pixel border; the
+    // widths leave SIMD tails, pixel size 5 takes the generic kernels
+    for (size_t c : {1, 2, 3, 4, 5}) {
+        for (double degrees : {0.0, 33.0, -100.0}) {
+            const long w = 37, h = 29;
+            Image image(w, h, c);
+            augmentorLib::CounterGenerator random(c, (uint64_t) (w * h), 0);
+            for (long y = 0; y < h; ++y) {
+                random.fill(image.rowUnchecked(y), w * c);
+            }
+            Image source = image;
+            augmentorLib::RotateOperation<Image> rotate({0, 0});
+            (void) rotate.apply(&image, &degrees);
+            ASSERT_EQ((size_t) w, image.getWidth());
+
+            auto map = augmentorLib::affine_transform::rotation(degrees * PI / 180, w / 2, h / 2);
+            double error = 0;
+            for (long y = 0; y < h; ++y) {
+                for (long x = 0; x < w; ++x) {
+                    double u = map.x(x, y), v = map.y(x, y);
+                    bool inside = std::floor(u + 0.5) >= 0 && std::floor(u + 0.5) < w &&
+                                  std::floor(v + 0.5) >= 0 && std::floor(v + 0.5) < h;
+                    long x0 = (long) std::floor(u), y0 = (long) std::floor(v);
+                    double fx = u - x0, fy = v - y0;
+                    auto at = [&](long xs, long ys, size_t k) {
+                        return (double) source.rowUnchecked(std::clamp(ys, 0l, h - 1))[std::clamp(xs, 0l, w - 1) * c + k];
+                    };
+                    for (size_t k = 0; k < c; ++k) {
+                        double expected = !inside ? 0 :
+                                (1 - fy) * ((1 - fx) * at(x0, y0, k) + fx * at(x0 + 1, y0, k)) +
+                                fy * ((1 - fx) * at(x0, y0 + 1, k) + fx * at(x0 + 1, y0 + 1, k));
+                        double difference = std::abs(expected - image.rowUnchecked(y)[x * c + k]);
+                        // 6-bit weights
+                        ASSERT_LE(difference, 6.0) << c << " " << degrees << " " << x << " " << y;
+                        error += difference;
+                    }
+                }
+            }
+            EXPECT_LT(error / (w * h * c), 1.0);
+            if (degrees == 0) {
+                EXPECT_EQ(0, std::memcmp(source.data(), image.data(), source.stride() * h));
+            }
+        }
+    }
+
+    // fused with a crop, the rotation is still interpolated: the same as rotating then cropping, up to the
+    // rounding of the composed map to fixed point
+    {
+        Image source(41, 31);
+        augmentorLib::CounterGenerator random(11, 41 * 31, 0);
+        for (size_t y = 0; y < 31; ++y) {
+            random.fill(source.rowUnchecked(y), 41 * 3);
+        }
+        double angle = 21;
+        augmentorLib::RotateOperation<Image> rotate({0, 0});
+        augmentorLib::CropOperation<Image> crop({20, 28}, true);
+        Image sequential = source;
+        (void) crop.apply(rotate.apply(&sequential, &angle), nullptr);
+
+        augmentorLib::AffineWarp<Image> warp;
+        warp.reset({31, 41});
+        for (std::pair<augmentorLib::Operation<Image>*, const double*> step :
+                {std::make_pair((augmentorLib::Operation<Image>*) &rotate, (const double*) &angle),
+                 std::make_pair((augmentorLib::Operation<Image>*) &crop, (const double*) nullptr)}) {
+            auto size = warp.output_size();
+            augmentorLib::affine_transform inverse;
+            ASSERT_TRUE(step.first->affine(size, step.second, inverse));
+            warp.push(inverse, size);
+        }
+        Image fused = source;
+        (void) warp.apply(&fused);
+        ASSERT_EQ(sequential.getWidth(), fused.getWidth());
+        ASSERT_EQ(sequential.getHeight(), fused.getHeight());
+        size_t equal = 0;
+        for (size_t y = 0; y < fused.getHeight(); ++y) {
+            for (size_t i = 0; i < fused.getWidth() * 3; ++i) {
+                int difference = std::abs(sequential.rowUnchecked(y)[i] - fused.rowUnchecked(y)[i]);
+                ASSERT_LE(difference, 4) << y << " " << i;
+                equal += difference == 0;
+            }
+        }
+        EXPECT_GT(equal, fused.getWidth() * fused.getHeight() * 3 * 9 / 10);
+    }
+
+    // canvases: the bounding box keeps every pixel, the inscribed rectangle shows no black corner
+    Image flat(60, 40);
+    std::memset(flat.data(), 200, flat.stride() * 40);
+    double degrees = 30;
+    Image expanded = flat;
+    (void) augmentorLib::RotateOperation<Image>({0, 0}, augmentorLib::rotate_canvas::expand).apply(&expanded, &degrees);
+    EXPECT_EQ(72u, expanded.getWidth());   // 60 cos + 40 sin
+    EXPECT_EQ(65u, expanded.getHeight());  // 60 sin + 40 cos
+    size_t lit = 0;
+    for (size_t y = 0; y < expanded.getHeight(); ++y) {
+        for (size_t x = 0; x < expanded.getWidth(); ++x) {
+            lit += expanded.getPixel(x, y)[0] != 0;
+        }
+    }
+    EXPECT_NEAR(60.0 * 40.0, (double) lit, 60.0);
+    Image cropped = flat;
+    (void) augmentorLib::RotateOperation<Image>({0, 0}, augmentorLib::rotate_canvas::crop).apply(&cropped, &degrees);
+    EXPECT_LT(cropped.getWidth(), 60u);
+    EXPECT_LT(cropped.getHeight(), 40u);
+    for (size_t y = 0; y < cropped.getHeight(); ++y) {
+        for (size_t x = 0; x < cropped.getWidth(); ++x) {
+            ASSERT_EQ(200, cropped.getPixel(x, y)[0]) << x << " " << y;
+        }
+    }
+}
+
+TEST(LookupTableTest, composedMatchesSequential0)
+{
+    Image image(67, 5);
+    augmentorLib::CounterGenerator generator(7, 0, 0);
+    for (size_t y = 0; y < image.getHeight(); ++y) {
+        generator.fill(image.rowUnchecked(y), image.getWidth() * image.getPixelSize());
+    }
+
+    augmentorLib::InvertOperation<Image> invert;
+    augmentorLib::BrightnessOperation<Image> brightness(1.3, 1.3);
+    augmentorLib::GammaOperation<Image> gamma(0.7, 0.7);
+    augmentorLib::PosterizeOperation<Image> posterize(5);
+    std::vector<augmentorLib::Operation<Image>*> chain = {&invert, &brightness, &gamma, &posterize};
+    double parameters[] = {1.3};
+
+    Image sequential = image;
+    augmentorLib::lookup_table table;
+    for (auto operation : chain) {
+        (void) operation->apply(&sequential, parameters);
+        ASSERT_TRUE(operation->pointwise(table, parameters));
+    }
+    augmentorLib::PointwiseOperation<Image>::map(table, &image);
+
+    for (size_t y = 0; y < image.getHeight(); ++y) {
+        EXPECT_EQ(0, std::memcmp(sequential.rowUnchecked(y), image.rowUnchecked(y), image.getWidth() * 3));
+    }
+}
+
+TEST(LookupTableTest, perChannelTables0)
+{
+    Image image(3, 2);
+    image.setPixel(2, 1, {10, 20, 30});
+
+    augmentorLib::lookup_table table;
+    table.compose(2, [](uint8_t v) { return (uint8_t) (v + 1); });
+    EXPECT_FALSE(table.uniform());
+    augmentorLib::PointwiseOperation<Image>::map(table, &image);
+
+    auto pixel = image.getPixel(2, 1);
+    EXPECT_TRUE(pixel[0] == 10 && pixel[1] == 20 && pixel[2] == 31);
+    EXPECT_EQ(1, image.getPixel(0, 0)[2]);
+}
+
+TEST(BlurTest, matchesReference0)
+{
+    // odd sizes leave vector tails, a 2 pixel wide image is narrower than the radius
+    const size_t sizes[][3] = {{37, 23, 3}, {2, 9, 3}, {16, 1, 1}, {19, 17, 4}};
+    augmentorLib::gaussian_blur_filter_1D<11> filter(3.0);
+    std::vector<double> kernel(11);
+    for (size_t k = 0; k < 11; ++k) {
+        kernel[k] = filter[k];
+    }
+    augmentorLib::separable_blur blur(kernel);
+    int sum = 0;
+    for (auto w : blur.fixed_weights()) {
+        sum += w;
+    }
+    EXPECT_EQ(1 << augmentorLib::separable_blur::WEIGHT_BITS, sum);
+
+    for (auto& size : sizes) {
+        long w = size[0], h = size[1], c = size[2];
+        Image image(w, h, c);
+        augmentorLib::CounterGenerator random(3, (uint64_t) (w * h), 0);
+        for (long y = 0; y < h; ++y) {
+            for (long i = 0; i < w * c; ++i) {
+                image.rowUnchecked(y)[i] = (uint8_t) (random.uniform() * 256);
+            }
+        }
+        // clamp-to-edge separable convolution in double precision
+        std::vector<double> across(w * h * c), reference(w * h * c);
+        for (long y = 0; y < h; ++y) {
+            for (long i = 0; i < w * c; ++i) {
+                double v = 0;
+                for (long k = 0; k < 11; ++k) {
+                    long x = std::clamp(i / c + k - 5, 0l, w - 1);
+                    v += kernel[k] * image.rowUnchecked(y)[x * c + i % c];
+                }
+                across[y * w * c + i] = v;
+            }
+        }
+        for (long y = 0; y < h; ++y) {
+            for (long i = 0; i < w * c; ++i) {
+                double v = 0;
+                for (long k = 0; k < 11; ++k) {
+                    v += kernel[k] * across[std::clamp(y + k - 5, 0l, h - 1) * w * c + i];
+                }
+                reference[y * w * c + i] = v;
+            }
+        }
+
+        blur.apply(image.data(), w, h, image.stride(), c);
+        for (long y = 0; y < h; ++y) {
+            for (long i = 0; i < w * c; ++i) {
+                ASSERT_NEAR(reference[y * w * c + i], image.rowUnchecked(y)[i], 1.0) << w << "x" << h << "x" << c;
+            }
+        }
+    }
+
+    // a flat image stays exactly flat
+    Image flat(40, 20);
+    std::memset(flat.data(), 200, flat.stride() * 20);
+    blur.apply(flat.data(), 40, 20, flat.stride(), 3);
+    for (size_t y = 0; y < 20; ++y) {
+        for (size_t i = 0; i < 120; ++i) {
+            ASSERT_EQ(200, flat.rowUnchecked(y)[i]);
+        }
+    }
+}
+
+TEST(BlurTest, specializedKernels0)
+{
+    using augmentorLib::separable_blur;
+    EXPECT_EQ(1u, separable_blur::specialized_size(1));
+    EXPECT_EQ(5u, separable_blur::specialized_size(4));
+    EXPECT_EQ(11u, separable_blur::specialized_size(11));
+    EXPECT_EQ(15u, separable_blur::specialized_size(13));
+    EXPECT_EQ(21u, separable_blur::specialized_size(21));
+    EXPECT_FALSE(separable_blur({0.2, 0.5, 0.3}).specialized());
+    EXPECT_FALSE(separable_blur(std::vector<double>(13, 1.0)).specialized());
+
+    // the unrolled, folded kernels give exactly the bytes of the generic ones
+    Image source(37, 23, 3);
+    augmentorLib::CounterGenerator random(5, 37 * 23, 0);
+    for (size_t y = 0; y < 23; ++y) {
+        for (size_t i = 0; i < 37 * 3; ++i) {
+            source.rowUnchecked(y)[i] = (uint8_t) (random.uniform() * 256);
+        }
+    }
+    for (size_t taps : {3, 5, 7, 9, 11, 15}) {
+        augmentorLib::gaussian_blur_filter_1D<> filter(taps / 2.0, taps);
+        std::vector<double> kernel(taps);
+        for (size_t k = 0; k < taps; ++k) {
+            kernel[k] = filter[k];
+        }
+        separable_blur unrolled(kernel), generic(kernel, false);
+        ASSERT_TRUE(unrolled.specialized()) << taps;
+        ASSERT_FALSE(generic.specialized()) << taps;
+        Image a(source), b(source);
+        unrolled.apply(a.data(), 37, 23, a.stride(), 3);
+        generic.apply(b.data(), 37, 23, b.stride(), 3);
+        for (size_t y = 0; y < 23; ++y) {
+            ASSERT_EQ(0, std::memcmp(a.rowUnchecked(y), b.rowUnchecked(y), 37 * 3)) << taps << " row " << y;
+        }
+    }
+}
+
+TEST(BlurTest, recursiveGaussian0)
+{
+    EXPECT_THROW(augmentorLib::recursive_blur(0.2), std::invalid_argument);
+
+    // against a clamp-to-edge Gaussian in double precision, 4 sigma on each side
+    const long w = 61, h = 45, c = 3, radius = 24;
+    const double sigma = 6;
+    Image image(w, h, c);
+    augmentorLib::CounterGenerator random(7, (uint64_t) (w * h), 0);
+    for (long y = 0; y < h; ++y) {
+        for (long i = 0; i < w * c; ++i) {
+            image.rowUnchecked(y)[i] = (uint8_t) (random.uniform() * 256);
+        }
+    }
+    std::vector<double> kernel(2 * radius + 1);
+    double sum = 0;
+    for (long k = -radius; k <= radius; ++k) {
+        sum += kernel[k + radius] = std::exp(-(double) (k * k) / (2 * sigma * sigma));
+    }
+    std::vector<double> across(w * h * c), reference(w * h * c);
+    for (long y = 0; y < h; ++y) {
+        for (long i = 0; i < w * c; ++i) {
+            double v = 0;
+            for (long k = -radius; k <= radius; ++k) {
+                v += kernel[k + radius] / sum * image.rowUnchecked(y)[std::clamp(i / c + k, 0l, w - 1) * c + i % c];
+            }
+            across[y * w * c + i] = v;
+        }
+    }
+    for (long y = 0; y < h; ++y) {
+        for (long i = 0; i < w * c; ++i) {
+            double v = 0;
+            for (long k = -radius; k <= radius; ++k) {
+                v += kernel[k + radius] / sum * across[std::clamp(y + k, 0l, h - 1) * w * c + i];
+            }
+            reference[y * w * c + i] = v;
+        }
+    }
+    augmentorLib::RecursiveGaussianBlurOperation<Image> blur(sigma);
+    blur.apply(&image, nullptr);
+    double error = 0;
+    for (long y = 0; y < h; ++y) {
+        for (long i = 0; i < w * c; ++i) {
+            double difference = std::abs(reference[y * w * c + i] - image.rowUnchecked(y)[i]);
+            ASSERT_LT(difference, 3.0) << y << " " << i;
+            error += difference;
+        }
+    }
+    EXPECT_LT(error / (w * h * c), 1.0);
+
+    // a flat image stays exactly flat
+    Image flat(40, 20);
+    std::memset(flat.data(), 77, flat.stride() * 20);
+    augmentorLib::recursive_blur(20).apply(flat.data(), 40, 20, flat.stride(), 3);
+    for (size_t y = 0; y < 20; ++y) {
+        for (size_t i = 0; i < 120; ++i) {
+            ASSERT_EQ(77, flat.rowUnchecked(y)[i]);
+        }
+    }
+
+    // the engine follows sigma
+    using augmentorLib::make_gaussian_blur;
+    EXPECT_TRUE(dynamic_cast<augmentorLib::GaussianBlurOperation<Image>*>(make_gaussian_blur<Image>(1.5).get()));
+    EXPECT_TRUE(dynamic_cast<augmentorLib::FastGaussianBlurOperation<Image>*>(make_gaussian_blur<Image>(4).get()));
+    EXPECT_TRUE(dynamic_cast<augmentorLib::RecursiveGaussianBlurOperation<Image>*>(make_gaussian_blur<Image>(9).get()));
+}
+
+TEST(BlurTest, boxBlur0)
+{
+    EXPECT_THROW(augmentorLib::box_blur(4), std::invalid_argument);
+    EXPECT_THROW(augmentorLib::box_blur(augmentorLib::box_blur::MAX_LENGTH + 2), std::invalid_argument);
+
+    // rounded horizontal means, then rounded vertical means of those, borders clamped; 203 has no 16-bit
+    // multiplier, 301 needs 32-bit sums, the widths leave SIMD tails, pixel size 2 takes the generic prefix
+    for (long length : {1l, 3l, 9l, 21l, 203l, 301l}) {
+        for (long c : {1l, 2l, 3l, 4l}) {
+            const long w = 37 + c, h = 23, r = length / 2;
+            Image image(w, h, c);
+            augmentorLib::CounterGenerator random((uint64_t) (length * 10 + c), (uint64_t) (w * h), 0);
+            for (long y = 0; y < h; ++y) {
+                for (long i = 0; i < w * c; ++i) {
+                    image.rowUnchecked(y)[i] = (uint8_t) (random.uniform() * 256);
+                }
+            }
+            std::vector<long> across(w * h * c);
+            for (long y = 0; y < h; ++y) {
+                for (long i = 0; i < w * c; ++i) {
+                    long sum = 0;
+                    for (long k = -r; k <= r; ++k) {
+                        sum += image.rowUnchecked(y)[std::clamp(i / c + k, 0l, w - 1) * c + i % c];
+                    }
+                    across[y * w * c + i] = (sum + r) / length;
+                }
+            }
+            augmentorLib::box_blur(length).apply(image.data(), w, h, image.stride(), c);
+            for (long y = 0; y < h; ++y) {
+                for (long i = 0; i < w * c; ++i) {
+                    long sum = 0;
+                    for (long k = -r; k <= r; ++k) {
+                        sum += across[std::clamp(y + k, 0l, h - 1) * w * c + i];
+                    }
+                    ASSERT_EQ((sum + r) / length, image.rowUnchecked(y)[i]) << length << " " << c << " " << y << " " << i;
+                }
+            }
+        }
+    }
+}
+
+TEST(FileCopyTest, copyAndLink0)
+{
+    using augmentorLib::copy_result;
+    auto source = ::testing::TempDir() + "copy_in.bin";
+    auto destination = ::testing::TempDir() + "copy_out.bin";
+    std::string bytes(300000, 0);
+    augmentorLib::CounterGenerator generator(9, 0, 0);
+    generator.fill(reinterpret_cast<uint8_t*>(&bytes[0]), bytes.size());
+    std::ofstream(source, std::ios::binary).write(bytes.data(), bytes.size());
+    auto read = [](const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+
+    EXPECT_NE(copy_result::linked, augmentorLib::copy_file(source, destination));
+    EXPECT_EQ(bytes, read(destination));
+
+    struct stat in{}, out{};
+    if (augmentorLib::copy_file(source, destination, true) == copy_result::linked) {
+        ASSERT_EQ(0, stat(source.c_str(), &in));
+        ASSERT_EQ(0, stat(destination.c_str(), &out));
+        EXPECT_EQ(in.st_ino, out.st_ino);
+    }
+    EXPECT_EQ(bytes, read(destination));
+
+    // writing an output never goes through the link into the source
+    augmentorLib::prepare_output(destination);
+    std::ofstream(destination, std::ios::binary) << "output";
+    EXPECT_EQ(bytes, read(source));
+    EXPECT_EQ("output", read(destination));
+
+    // a source that cannot be read fails instead of leaving a truncated copy; an I/O error in the middle of a
+    // real file cannot be provoked here, a directory fails its first copy_file_range or pread instead
+    EXPECT_THROW(augmentorLib::copy_file(::testing::TempDir(), destination), std::runtime_error);
+}
 
 
 int main(int argc, char **argv) { ::testing::InitGoogleTest(&argc, argv); return RUN_ALL_TESTS(); }